@@ -1,12 +1,14 @@
 #include "APU.h"
 
+#include <cstring>
+
 namespace APU
 {
-	uint8_t* registers;
+	thread_local uint8_t* registers;
 
 	void initialize()
 	{
-		registers = new uint8_t[0x17];
+		registers = new uint8_t[0x18]();
 	}
 
 	uint8_t readRegister(uint16_t addr)
@@ -18,4 +20,14 @@ namespace APU
 	{
 		registers[addr - 0x4000] = value;
 	}
+
+	void save(state_s& state)
+	{
+		memcpy(state.registers, registers, sizeof(state.registers));
+	}
+
+	void load(const state_s& state)
+	{
+		memcpy(registers, state.registers, sizeof(state.registers));
+	}
 }
\ No newline at end of file
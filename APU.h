@@ -1,10 +1,18 @@
 #pragma once
 
 #include <iostream>
+#include <cstdint>
 
 namespace APU
 {
+	typedef struct {
+		uint8_t registers[0x18];
+	} state_s;
+
 	void initialize();
 	uint8_t readRegister(uint16_t addr);
 	void writeRegister(uint16_t addr, uint8_t value);
-}
\ No newline at end of file
+
+	void save(state_s& state);
+	void load(const state_s& state);
+}
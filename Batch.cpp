@@ -0,0 +1,795 @@
+#include "Batch.h"
+#include "Cartridge.h"
+#include "Console.h"
+#include "Controller.h"
+#include "Savestate.h"
+#include "PPU.h"
+#include "APU.h"
+#include "Timeline.h"
+
+#include <cstring>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/*
+* The vector kernels below mirror the handlers in CPU.cpp instruction for
+* instruction, flag quirks included, so a lane is indistinguishable from a
+* console run on its own. NESHeadless --batch checks this on every run; any
+* change to an opcode in CPU.cpp must be made here too.
+*/
+namespace Batch
+{
+	using namespace CPU; // addressing_mode_e
+
+	enum {
+		FLAG_C = 0x01,
+		FLAG_Z = 0x02,
+		FLAG_I = 0x04,
+		FLAG_D = 0x08,
+		FLAG_V = 0x40,
+		FLAG_N = 0x80
+	};
+
+	int count = 0;
+	uint32_t active = 0;
+
+	alignas(32) uint16_t PC[BATCH_LANES];
+	alignas(16) uint8_t SP[BATCH_LANES];
+	alignas(16) uint8_t A[BATCH_LANES];
+	alignas(16) uint8_t X[BATCH_LANES];
+	alignas(16) uint8_t Y[BATCH_LANES];
+	alignas(16) uint8_t P[BATCH_LANES];
+
+	std::vector<uint8_t> ram; // One 2KB plane per lane
+	std::vector<uint8_t> framebuffers;
+	std::vector<PPU::state_s> ppu;
+	APU::state_s apu[BATCH_LANES];
+	Controller::state_s controller[BATCH_LANES];
+	uint8_t buttons[BATCH_LANES][2];
+	uint16_t owedDots[BATCH_LANES];
+	uint32_t position = 0; // Dots into the frame on the timeline all lanes share
+	bool frameStart = false; // The coming step is the first of a runFrame()
+
+	std::vector<uint8_t> mapperRegisters; // One register block per lane
+	std::vector<uint8_t> scratchRegisters;
+	uint32_t registerSize = 0;
+	int resident = 0; // Lane whose registers the cartridge's mapper holds
+	uint32_t synced = 0; // Lanes whose registers match the resident lane's
+
+	const uint32_t dotsPerFrame = 341 * 262;
+	const uint32_t vblankDot = 241 * 341 + 1;
+
+	Savestate::Snapshot home;
+	uint8_t* homeRam;
+	uint8_t* homeFramebuffer;
+	PPU::backend_e homeBackend;
+
+	uint64_t vectorCount = 0;
+	uint64_t scalarCount = 0;
+
+	typedef uint32_t (*handler_t)(uint32_t mask);
+	handler_t handlers[256];
+
+	inline uint8_t* laneRam(int lane)
+	{
+		return &ram[lane * 0x800];
+	}
+
+	inline uint8_t* laneRegisters(int lane)
+	{
+		return &mapperRegisters[lane * registerSize];
+	}
+
+	/*
+	* Work out which lanes can read ROM through the mapper as it stands.
+	*/
+	void resync()
+	{
+		synced = 0;
+		for (int lane = 0; lane < count; ++lane)
+		{
+			if (!memcmp(laneRegisters(lane), laneRegisters(resident), registerSize))
+				synced |= 1u << lane;
+		}
+	}
+
+	inline int lowestLane(uint32_t mask)
+	{
+		int lane = 0;
+		while (!(mask & 1))
+		{
+			mask >>= 1;
+			++lane;
+		}
+		return lane;
+	}
+
+	/*
+	* Read an instruction byte. Only work RAM and PRG-ROM are side-effect free.
+	*/
+	inline bool fetchable(uint16_t addr)
+	{
+		return addr < 0x2000 || addr >= 0x8000;
+	}
+
+	/*
+	* Lanes in a group usually sit at the same PC, so remember the last ROM byte
+	* fetched and skip the mapper for the rest of them.
+	*/
+	class Fetcher
+	{
+		uint16_t lastAddr = 0;
+		uint8_t lastValue = 0;
+		bool valid = false;
+
+	public:
+		uint8_t operator()(int lane, uint16_t addr)
+		{
+			if (addr < 0x2000)
+				return laneRam(lane)[addr % 0x800];
+			if (!valid || addr != lastAddr)
+			{
+				lastAddr = addr;
+				lastValue = Cartridge::mapper->read(addr);
+				valid = true;
+			}
+			return lastValue;
+		}
+	};
+
+	/*
+	* Lanes whose opcode matches, as a bitmask.
+	*/
+	inline uint32_t sameOpcode(const uint8_t* opcodes, uint8_t opcode)
+	{
+#if defined(__AVX2__)
+		__m128i ops = _mm_load_si128((const __m128i*)opcodes);
+		return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ops, _mm_set1_epi8((char)opcode)));
+#else
+		uint32_t mask = 0;
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+			mask |= (uint32_t)(opcodes[lane] == opcode) << lane;
+		return mask;
+#endif
+	}
+
+	/*
+	* Turn a lane bitmask into one 0x00/0xFF byte per lane for the blend kernels.
+	*/
+	inline void expandMask(uint32_t mask, uint8_t* m)
+	{
+#if defined(__AVX2__)
+		__m128i bits = _mm_shuffle_epi8(_mm_set1_epi16((short)mask),
+			_mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1));
+		__m128i select = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+		_mm_store_si128((__m128i*)m, _mm_cmpeq_epi8(_mm_and_si128(bits, select), select));
+#else
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+			m[lane] = (mask >> lane & 1) ? 0xFF : 0x00;
+#endif
+	}
+
+	/*
+	* PC += delta on the selected lanes.
+	*/
+	inline void advance(const uint8_t* m, const int16_t* delta)
+	{
+#if defined(__AVX2__)
+		__m256i wide = _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i*)m));
+		__m256i pc = _mm256_load_si256((const __m256i*)PC);
+		__m256i step = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)delta), wide);
+		_mm256_store_si256((__m256i*)PC, _mm256_add_epi16(pc, step));
+#else
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+			PC[lane] += delta[lane] & (int16_t)(int8_t)m[lane];
+#endif
+	}
+
+	inline void advance(const uint8_t* m, int16_t length)
+	{
+		alignas(32) int16_t delta[BATCH_LANES];
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+			delta[lane] = length;
+		advance(m, delta);
+	}
+
+	/*
+	* Instruction length as the scalar handlers consume it.
+	*/
+	template<addressing_mode_e MODE>
+	constexpr int16_t length()
+	{
+		return MODE == IMPLI || MODE == ACCUM ? 1 : (MODE == ABSOL || MODE == ABSIX || MODE == ABSIY || MODE == INDIA) ? 3 : 2;
+	}
+
+	/*
+	* Effective work-RAM address per lane. Lanes whose address leaves work RAM
+	* are dropped from the returned mask and left for the scalar core.
+	*/
+	template<addressing_mode_e MODE>
+	uint32_t address(uint32_t mask, uint16_t* addr)
+	{
+		Fetcher low, high;
+		for (int lane = 0; lane < count; ++lane)
+		{
+			if (!(mask >> lane & 1))
+				continue;
+
+			uint16_t operand = low(lane, PC[lane] + 1);
+			switch (MODE)
+			{
+			case ZEROP:
+				addr[lane] = operand;
+				break;
+			case ZEPIX:
+				addr[lane] = (operand + X[lane]) % 0xFF;
+				break;
+			case ZEPIY:
+				addr[lane] = (operand + Y[lane]) % 0xFF;
+				break;
+			case ABSOL:
+				addr[lane] = operand + (high(lane, PC[lane] + 2) << 8);
+				if (addr[lane] >= 0x2000)
+					mask &= ~(1u << lane);
+				addr[lane] %= 0x800;
+				break;
+			default:
+				break;
+			}
+		}
+		return mask;
+	}
+
+	/*
+	* Operand value per lane, from the instruction stream or work RAM.
+	*/
+	template<addressing_mode_e MODE>
+	uint32_t operand(uint32_t mask, uint8_t* value)
+	{
+		if (MODE == IMMED)
+		{
+			Fetcher immediate;
+			for (int lane = 0; lane < count; ++lane)
+			{
+				if (mask >> lane & 1)
+					value[lane] = immediate(lane, PC[lane] + 1);
+			}
+			return mask;
+		}
+
+		uint16_t addr[BATCH_LANES];
+		mask = address<MODE>(mask, addr);
+		for (int lane = 0; lane < count; ++lane)
+		{
+			if (mask >> lane & 1)
+				value[lane] = laneRam(lane)[addr[lane]];
+		}
+		return mask;
+	}
+
+	/*
+	* Flag updates, matching the scalar handlers:
+	* loads and transfers only ever set Z and N, arithmetic sets Z and assigns N.
+	*/
+	inline void setZN(const uint8_t* m, const uint8_t* value)
+	{
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+			P[lane] |= m[lane] & ((value[lane] == 0 ? FLAG_Z : 0) | (value[lane] & FLAG_N));
+	}
+
+	inline void setZassignN(const uint8_t* m, const uint8_t* value)
+	{
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+		{
+			uint8_t flags = (value[lane] == 0 ? FLAG_Z : 0) | (value[lane] & FLAG_N);
+			P[lane] = (P[lane] & ~(m[lane] & FLAG_N)) | (m[lane] & flags);
+		}
+	}
+
+	inline void blend(uint8_t* reg, const uint8_t* m, const uint8_t* value)
+	{
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+			reg[lane] = (reg[lane] & ~m[lane]) | (value[lane] & m[lane]);
+	}
+
+	/*
+	* Loads: LDA, LDX, LDY
+	*/
+	template<addressing_mode_e MODE, uint8_t* REG>
+	uint32_t load(uint32_t mask)
+	{
+		alignas(16) uint8_t value[BATCH_LANES] = { 0 };
+		alignas(16) uint8_t m[BATCH_LANES];
+		mask = operand<MODE>(mask, value);
+		expandMask(mask, m);
+		blend(REG, m, value);
+		setZN(m, value);
+		advance(m, length<MODE>());
+		return mask;
+	}
+
+	/*
+	* Stores: STA, STX, STY
+	*/
+	template<addressing_mode_e MODE, uint8_t* REG>
+	uint32_t store(uint32_t mask)
+	{
+		alignas(16) uint8_t m[BATCH_LANES];
+		uint16_t addr[BATCH_LANES];
+		mask = address<MODE>(mask, addr);
+		for (int lane = 0; lane < count; ++lane)
+		{
+			if (mask >> lane & 1)
+				laneRam(lane)[addr[lane]] = REG[lane];
+		}
+		expandMask(mask, m);
+		advance(m, length<MODE>());
+		return mask;
+	}
+
+	/*
+	* Logic on the accumulator: AND, ORA, EOR
+	*/
+	template<addressing_mode_e MODE, int OP>
+	uint32_t logic(uint32_t mask)
+	{
+		alignas(16) uint8_t value[BATCH_LANES] = { 0 };
+		alignas(16) uint8_t result[BATCH_LANES];
+		alignas(16) uint8_t m[BATCH_LANES];
+		mask = operand<MODE>(mask, value);
+		expandMask(mask, m);
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+			result[lane] = OP == 0 ? A[lane] & value[lane] : OP == 1 ? A[lane] | value[lane] : A[lane] ^ value[lane];
+		blend(A, m, result);
+		setZassignN(m, result);
+		advance(m, length<MODE>());
+		return mask;
+	}
+
+	/*
+	* Compares: CMP, CPX, CPY. C is only ever set; Z and N (of the register) are assigned.
+	*/
+	template<addressing_mode_e MODE, uint8_t* REG>
+	uint32_t compare(uint32_t mask)
+	{
+		alignas(16) uint8_t value[BATCH_LANES] = { 0 };
+		alignas(16) uint8_t m[BATCH_LANES];
+		mask = operand<MODE>(mask, value);
+		expandMask(mask, m);
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+		{
+			uint8_t flags = (REG[lane] >= value[lane] ? FLAG_C : 0) | (REG[lane] == value[lane] ? FLAG_Z : 0) | (REG[lane] & FLAG_N);
+			P[lane] = (P[lane] & ~(m[lane] & (FLAG_Z | FLAG_N))) | (m[lane] & flags);
+		}
+		advance(m, length<MODE>());
+		return mask;
+	}
+
+	/*
+	* Read-modify-write on work RAM: INC, DEC
+	*/
+	template<addressing_mode_e MODE, int DELTA>
+	uint32_t modify(uint32_t mask)
+	{
+		alignas(16) uint8_t value[BATCH_LANES] = { 0 };
+		alignas(16) uint8_t m[BATCH_LANES];
+		uint16_t addr[BATCH_LANES];
+		mask = address<MODE>(mask, addr);
+		for (int lane = 0; lane < count; ++lane)
+		{
+			if (mask >> lane & 1)
+				value[lane] = laneRam(lane)[addr[lane]] += DELTA;
+		}
+		expandMask(mask, m);
+		setZassignN(m, value);
+		advance(m, length<MODE>());
+		return mask;
+	}
+
+	/*
+	* Register increments: INX, INY, DEX, DEY
+	*/
+	template<uint8_t* REG, int DELTA>
+	uint32_t increment(uint32_t mask)
+	{
+		alignas(16) uint8_t result[BATCH_LANES];
+		alignas(16) uint8_t m[BATCH_LANES];
+		expandMask(mask, m);
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+			result[lane] = REG[lane] + DELTA;
+		blend(REG, m, result);
+		setZassignN(m, result);
+		advance(m, 1);
+		return mask;
+	}
+
+	/*
+	* Transfers: TAX, TAY, TXA, TYA, TSX, TXS (the last sets no flags)
+	*/
+	template<uint8_t* FROM, uint8_t* TO, bool FLAGS>
+	uint32_t transfer(uint32_t mask)
+	{
+		alignas(16) uint8_t m[BATCH_LANES];
+		expandMask(mask, m);
+		blend(TO, m, FROM);
+		if (FLAGS)
+			setZN(m, TO);
+		advance(m, 1);
+		return mask;
+	}
+
+	/*
+	* Flag instructions: CLC, SEC, CLI, SEI, CLV, CLD, SED
+	*/
+	template<uint8_t FLAG, bool SET>
+	uint32_t flag(uint32_t mask)
+	{
+		alignas(16) uint8_t m[BATCH_LANES];
+		expandMask(mask, m);
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+			P[lane] = SET ? P[lane] | (m[lane] & FLAG) : P[lane] & ~(m[lane] & FLAG);
+		advance(m, 1);
+		return mask;
+	}
+
+	uint32_t nop(uint32_t mask)
+	{
+		alignas(16) uint8_t m[BATCH_LANES];
+		expandMask(mask, m);
+		advance(m, 1);
+		return mask;
+	}
+
+	/*
+	* Conditional branches. Lanes that take the branch and lanes that don't
+	* both advance in the same vector add.
+	*/
+	template<uint8_t FLAG, bool SET>
+	uint32_t branch(uint32_t mask)
+	{
+		alignas(16) uint8_t m[BATCH_LANES];
+		alignas(32) int16_t delta[BATCH_LANES];
+		Fetcher relative;
+		expandMask(mask, m);
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+		{
+			bool taken = ((P[lane] & FLAG) != 0) == SET;
+			int8_t offset = (mask >> lane & 1) ? (int8_t)relative(lane, PC[lane] + 1) : 0;
+			delta[lane] = 2 + (taken ? offset : 0);
+		}
+		advance(m, delta);
+		return mask;
+	}
+
+	uint32_t jump(uint32_t mask)
+	{
+		Fetcher low, high;
+		for (int lane = 0; lane < count; ++lane)
+		{
+			if (mask >> lane & 1)
+				PC[lane] = low(lane, PC[lane] + 1) + (high(lane, PC[lane] + 2) << 8);
+		}
+		return mask;
+	}
+
+	/*
+	* Opcodes with a vector kernel. Anything else goes to the scalar core.
+	*/
+	void buildHandlers()
+	{
+		for (handler_t& handler : handlers)
+			handler = nullptr;
+
+		handlers[0xA9] = load<IMMED, A>;
+		handlers[0xA5] = load<ZEROP, A>;
+		handlers[0xB5] = load<ZEPIX, A>;
+		handlers[0xAD] = load<ABSOL, A>;
+		handlers[0xA2] = load<IMMED, X>;
+		handlers[0xA6] = load<ZEROP, X>;
+		handlers[0xB6] = load<ZEPIY, X>;
+		handlers[0xAE] = load<ABSOL, X>;
+		handlers[0xA0] = load<IMMED, Y>;
+		handlers[0xA4] = load<ZEROP, Y>;
+		handlers[0xB4] = load<ZEPIX, Y>;
+		handlers[0xAC] = load<ABSOL, Y>;
+
+		handlers[0x85] = store<ZEROP, A>;
+		handlers[0x95] = store<ZEPIX, A>;
+		handlers[0x8D] = store<ABSOL, A>;
+		handlers[0x86] = store<ZEROP, X>;
+		handlers[0x96] = store<ZEPIY, X>;
+		handlers[0x8E] = store<ABSOL, X>;
+		handlers[0x84] = store<ZEROP, Y>;
+		handlers[0x94] = store<ZEPIX, Y>;
+		handlers[0x8C] = store<ABSOL, Y>;
+
+		handlers[0x29] = logic<IMMED, 0>;
+		handlers[0x25] = logic<ZEROP, 0>;
+		handlers[0x09] = logic<IMMED, 1>;
+		handlers[0x05] = logic<ZEROP, 1>;
+		handlers[0x49] = logic<IMMED, 2>;
+		handlers[0x45] = logic<ZEROP, 2>;
+
+		handlers[0xC9] = compare<IMMED, A>;
+		handlers[0xC5] = compare<ZEROP, A>;
+		handlers[0xE0] = compare<IMMED, X>;
+		handlers[0xE4] = compare<ZEROP, X>;
+		handlers[0xC0] = compare<IMMED, Y>;
+		handlers[0xC4] = compare<ZEROP, Y>;
+
+		handlers[0xE6] = modify<ZEROP, 1>;
+		handlers[0xF6] = modify<ZEPIX, 1>;
+		handlers[0xC6] = modify<ZEROP, -1>;
+		handlers[0xD6] = modify<ZEPIX, -1>;
+
+		handlers[0xE8] = increment<X, 1>;
+		handlers[0xC8] = increment<Y, 1>;
+		handlers[0xCA] = increment<X, -1>;
+		handlers[0x88] = increment<Y, -1>;
+
+		handlers[0xAA] = transfer<A, X, true>;
+		handlers[0xA8] = transfer<A, Y, true>;
+		handlers[0x8A] = transfer<X, A, true>;
+		handlers[0x98] = transfer<Y, A, true>;
+		handlers[0xBA] = transfer<SP, X, true>;
+		handlers[0x9A] = transfer<X, SP, false>;
+
+		handlers[0x18] = flag<FLAG_C, false>;
+		handlers[0x38] = flag<FLAG_C, true>;
+		handlers[0x58] = flag<FLAG_I, false>;
+		handlers[0x78] = flag<FLAG_I, true>;
+		handlers[0xB8] = flag<FLAG_V, false>;
+		handlers[0xD8] = flag<FLAG_D, false>;
+		handlers[0xF8] = flag<FLAG_D, true>;
+		handlers[0xEA] = nop;
+
+		handlers[0x10] = branch<FLAG_N, false>;
+		handlers[0x30] = branch<FLAG_N, true>;
+		handlers[0x50] = branch<FLAG_V, false>;
+		handlers[0x70] = branch<FLAG_V, true>;
+		handlers[0x90] = branch<FLAG_C, false>;
+		handlers[0xB0] = branch<FLAG_C, true>;
+		handlers[0xD0] = branch<FLAG_Z, false>;
+		handlers[0xF0] = branch<FLAG_Z, true>;
+		handlers[0x4C] = jump;
+	}
+
+	CPU::registers_s getRegisters(int lane)
+	{
+		CPU::registers_s regs;
+		regs.PC = PC[lane];
+		regs.SP = SP[lane];
+		regs.accum = A[lane];
+		regs.x_reg = X[lane];
+		regs.y_reg = Y[lane];
+		regs.status = P[lane];
+		return regs;
+	}
+
+	void setRegisters(int lane, const CPU::registers_s& regs)
+	{
+		PC[lane] = regs.PC;
+		SP[lane] = regs.SP;
+		A[lane] = regs.accum;
+		X[lane] = regs.x_reg;
+		Y[lane] = regs.y_reg;
+		P[lane] = regs.status;
+	}
+
+	/*
+	* Run the dots the PPU of a vector-path lane still owes.
+	*/
+	void catchUp(int lane)
+	{
+		if (!owedDots[lane])
+			return;
+
+		PPU::attach(ppu[lane]);
+		PPU::setFramebuffer(getFramebuffer(lane));
+		Timeline::advance(owedDots[lane]);
+		owedDots[lane] = 0;
+		PPU::detach();
+	}
+
+	/*
+	* Switch one lane into the scalar core and execute a single instruction there.
+	* A lane that jams halts for good, as Console::runFrame() halts a console:
+	* one already stopped on a KIL when the frame begins does not step at all.
+	*/
+	void scalarStep(int lane)
+	{
+		bool swap = !(synced >> lane & 1);
+		resident = lane;
+		if (swap)
+		{
+			Cartridge::mapper->load_registers(laneRegisters(lane));
+			resync();
+		}
+
+		CPU::setRam(laneRam(lane));
+		CPU::setRegisters(getRegisters(lane));
+		PPU::attach(ppu[lane]);
+		PPU::setFramebuffer(getFramebuffer(lane));
+		APU::load(apu[lane]);
+		Controller::load(controller[lane]);
+		Controller::setButtons(0, buttons[lane][0]);
+		Controller::setButtons(1, buttons[lane][1]);
+
+		Timeline::advance(owedDots[lane]);
+		owedDots[lane] = 0;
+		if ((frameStart && CPU::jammed()) || !Console::step())
+			active &= ~(1u << lane);
+
+		setRegisters(lane, CPU::getRegisters());
+		PPU::detach();
+		APU::save(apu[lane]);
+		Controller::save(controller[lane]);
+
+		Cartridge::mapper->save_registers(scratchRegisters.data());
+		if (memcmp(scratchRegisters.data(), laneRegisters(lane), registerSize))
+		{
+			memcpy(laneRegisters(lane), scratchRegisters.data(), registerSize);
+			resync();
+		}
+	}
+
+	/*
+	* Copy the running console into each lane.
+	*/
+	void begin(int lanes)
+	{
+		count = lanes < 1 ? 1 : lanes > BATCH_LANES ? BATCH_LANES : lanes;
+		active = (1u << count) - 1;
+		buildHandlers();
+
+		// The shared timeline below counts scanline-backend dots.
+		homeBackend = PPU::getBackend();
+		PPU::setBackend(PPU::SCANLINE);
+
+		Savestate::save(home);
+		homeRam = CPU::getRam();
+		homeFramebuffer = PPU::getFramebuffer();
+
+		ram.resize(BATCH_LANES * 0x800);
+		framebuffers.resize(BATCH_LANES * PPU_WIDTH * PPU_HEIGHT);
+		ppu.resize(BATCH_LANES);
+		for (int lane = 0; lane < BATCH_LANES; ++lane)
+		{
+			setRegisters(lane, home.cpu.regs);
+			memcpy(laneRam(lane), home.cpu.ram, 0x800);
+			memcpy(getFramebuffer(lane), homeFramebuffer, PPU_WIDTH * PPU_HEIGHT);
+			ppu[lane] = home.ppu;
+			apu[lane] = home.apu;
+			controller[lane] = home.controller;
+			buttons[lane][0] = buttons[lane][1] = 0;
+			owedDots[lane] = 0;
+		}
+		position = home.ppu.scanline * 341 + home.ppu.dot;
+
+		registerSize = Cartridge::mapper->register_size();
+		mapperRegisters.resize(BATCH_LANES * registerSize);
+		scratchRegisters.resize(registerSize);
+		Cartridge::mapper->save_registers(laneRegisters(0));
+		for (int lane = 1; lane < BATCH_LANES; ++lane)
+			memcpy(laneRegisters(lane), laneRegisters(0), registerSize);
+		resident = 0;
+		synced = active;
+
+		vectorCount = scalarCount = 0;
+	}
+
+	/*
+	* Return the scalar core to the console that was running before begin().
+	*/
+	void end()
+	{
+		for (int lane = 0; lane < count; ++lane)
+			catchUp(lane);
+
+		CPU::setRam(homeRam);
+		PPU::setFramebuffer(homeFramebuffer);
+		Savestate::load(home);
+		PPU::setBackend(homeBackend);
+	}
+
+	void setButtons(int lane, int port, uint8_t value)
+	{
+		buttons[lane][port] = value;
+	}
+
+	/*
+	* Execute one instruction on every lane.
+	*/
+	void step()
+	{
+		alignas(16) uint8_t opcodes[BATCH_LANES] = { 0 };
+		uint32_t vectorizable = 0;
+		Fetcher opcode;
+
+		// The step that reaches V-Blank may raise an NMI, so every lane takes it on the scalar core.
+		bool vblank = position < vblankDot && position + 3 >= vblankDot;
+		for (int lane = 0; lane < count && !vblank; ++lane)
+		{
+			// ROM reads go through the resident lane's banks.
+			if ((active >> lane & 1) && fetchable(PC[lane]) && (PC[lane] < 0x2000 || (synced >> lane & 1)) && !ppu[lane].nmiPending)
+			{
+				opcodes[lane] = opcode(lane, PC[lane]);
+				vectorizable |= 1u << lane;
+			}
+		}
+
+		uint32_t scalar = active & ~vectorizable;
+		uint32_t pending = vectorizable;
+		while (pending)
+		{
+			uint8_t op = opcodes[lowestLane(pending)];
+			uint32_t group = sameOpcode(opcodes, op) & pending;
+			pending &= ~group;
+
+			uint32_t done = handlers[op] ? handlers[op](group) : 0;
+			scalar |= group & ~done;
+			for (uint32_t bits = done; bits; bits &= bits - 1)
+				++vectorCount;
+		}
+
+		for (int lane = 0; lane < count; ++lane)
+		{
+			if (scalar >> lane & 1)
+			{
+				scalarStep(lane);
+				++scalarCount;
+			}
+			else if ((active >> lane & 1) && (owedDots[lane] += 3) >= 341)
+			{
+				catchUp(lane);
+			}
+		}
+		position = (position + 3) % dotsPerFrame;
+		frameStart = false;
+	}
+
+	/*
+	* Step every lane to the end of the current frame. Lanes execute the same
+	* number of instructions, so they all share one PPU timeline.
+	*/
+	void runFrame()
+	{
+		frameStart = true;
+		for (uint32_t steps = (dotsPerFrame - position + 2) / 3; steps; --steps)
+			step();
+
+		for (int lane = 0; lane < count; ++lane)
+			catchUp(lane);
+	}
+
+	uint8_t* getRam(int lane)
+	{
+		return laneRam(lane);
+	}
+
+	uint8_t* getFramebuffer(int lane)
+	{
+		return &framebuffers[lane * PPU_WIDTH * PPU_HEIGHT];
+	}
+
+	/*
+	* The lane's $2001, for the output stage.
+	*/
+	uint8_t getMask(int lane)
+	{
+		return ppu[lane].registers[1];
+	}
+
+	uint64_t vectorInstructions()
+	{
+		return vectorCount;
+	}
+
+	uint64_t scalarInstructions()
+	{
+		return scalarCount;
+	}
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+
+#include "CPU.h"
+
+#define BATCH_LANES 16
+
+/*
+* Up to BATCH_LANES copies of the loaded cartridge stepped together, e.g. for
+* rollouts of one ROM with different inputs.
+*
+* CPU registers are stored structure-of-arrays. Each step, lanes are grouped by
+* opcode and a group whose instruction only touches registers, ROM operands and
+* work RAM advances in one vector operation. Everything else (I/O, mapper
+* writes, instructions without a vector kernel) runs on the scalar core one lane
+* at a time, as does every lane on the step that reaches V-Blank and any lane
+* with an NMI pending. The PPU of a lane on the vector path is caught up lazily,
+* at least once per scanline and always before the lane touches I/O.
+*
+* Each lane has its own copy of the mapper registers, swapped into the
+* cartridge when a lane that differs runs on the scalar core; a lane only reads
+* ROM on the vector path while its banks match the ones swapped in. PRG and CHR
+* RAM are shared. Lanes always use the scanline PPU backend. A lane whose CPU
+* jams stops there, PPU and all, while the others go on.
+*/
+namespace Batch
+{
+	void begin(int lanes);
+	void end();
+
+	void setButtons(int lane, int port, uint8_t buttons);
+	void step();
+	void runFrame();
+
+	CPU::registers_s getRegisters(int lane);
+	uint8_t* getRam(int lane);
+	uint8_t* getFramebuffer(int lane);
+	uint8_t getMask(int lane);
+
+	uint64_t vectorInstructions();
+	uint64_t scalarInstructions();
+}
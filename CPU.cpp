@@ -2,9 +2,12 @@
 #include "Cartridge.h"
 #include "PPU.h"
 #include "APU.h"
+#include "Controller.h"
+#include "Timeline.h"
 
 #include <iostream>
 #include <string>
+#include <cstring>
 
 /*
 * CPU Performance Rundown:
@@ -34,9 +37,10 @@
 */
 namespace CPU
 {
-	uint16_t PC = 0x8000; // Program Counter
-	uint8_t SP = 0x00; // Stack Pointer
-	struct status {
+	// Like every chip's, the CPU's state is per thread: each thread can run a console of its own.
+	thread_local uint16_t PC = 0x8000; // Program Counter
+	thread_local uint8_t SP = 0x00; // Stack Pointer
+	thread_local struct status {
 		uint8_t $carry     : 1,
 				$zero      : 1,
 				$interrupt : 1,
@@ -46,10 +50,13 @@ namespace CPU
 				$negative  : 1;
 	} status;
 
-	uint8_t* ram;
-	uint8_t accum;
-	uint8_t x_reg;
-	uint8_t y_reg;
+	thread_local uint8_t* ram;
+	thread_local uint8_t accum;
+	thread_local uint8_t x_reg;
+	thread_local uint8_t y_reg;
+	thread_local fault_s fault;
+
+	template<addressing_mode_e MODE> void PHP();
 
 	/*
 	* Read a byte from address in RAM.
@@ -64,17 +71,21 @@ namespace CPU
 		{
 			return PPU::readRegister(addr);
 		}
+		else if (addr == 0x4016 || addr == 0x4017) // Controller ports
+		{
+			return Controller::read(addr & 1);
+		}
 		else if (addr < 0x4018)
 		{
 			return APU::readRegister(addr);
 		}
-		else if (addr <= 0x6000)
+		else if (addr < 0x6000)
 		{
 			return 0; // Disabled
 		}
 		else if (addr < 0x8000)
 		{
-			return ram[addr]; // Battery-backed Save or Work RAM
+			return Cartridge::mapper->read(addr); // Battery-backed Save or Work RAM
 		}
 		else if (addr >= 0x8000) // Addressing PRG-ROM
 		{
@@ -101,23 +112,40 @@ namespace CPU
 		}
 		else if (addr == 0x4014) // DMA PPU register
 		{
-			PPU::dma(&ram[value << 8]); // Copy the 256-byte block at the indirect address ($XX00-$XXFF).
+			// Copy the 256-byte block at $XX00-$XXFF. RAM pages are copied straight
+			// from the mirror; anything else, such as PRG RAM, goes through read().
+			if (value < 0x20)
+			{
+				PPU::dma(&ram[(value << 8) % 0x800]);
+			}
+			else
+			{
+				uint8_t block[256];
+				for (int i = 0; i < 256; ++i)
+					block[i] = read((value << 8) | i);
+				PPU::dma(block);
+			}
+		}
+		else if (addr == 0x4016) // Controller strobe
+		{
+			Controller::write(value);
 		}
 		else if (addr < 0x4018) // Addressing APU registers
 		{
 			APU::writeRegister(addr, value);
 		}
-		else if (addr <= 0x6000)
+		else if (addr < 0x6000)
 		{
 			return; // Disabled
 		}
 		else if (addr < 0x8000)
 		{
-			ram[addr] = value; // Battery-backed Save or Work RAM
+			Cartridge::mapper->prg_ram_write(addr, value); // Battery-backed Save or Work RAM
 		}
-		else
+		else // Mapper registers
 		{
-			throw "Could not write to CPU RAM at address: " + addr;
+			Timeline::catchUp(); // Bank and mirroring changes apply from here on, not to dots the PPU still owes.
+			Cartridge::mapper->write(addr, value);
 		}
 	}
 
@@ -1642,11 +1670,282 @@ namespace CPU
 		}
 	}
 
+	/*
+	* Unofficial opcodes
+	*
+	* The stable ones: combinations of two official instructions that every
+	* 6502 in an NES runs the same way, and which some games use. Unlike the
+	* official handlers above, these clear the zero flag as well as set it.
+	*
+	* Left out are the unstable ones ($8B, $93, $9B, $9C, $9E, $9F, $AB, $BB),
+	* whose results depend on the chip and even the temperature; no licensed
+	* game relies on them.
+	*/
+
+	/*
+	* Effective address of a memory operand. Zero page addressing, indexed or
+	* indirect, wraps within page zero.
+	*/
+	template<addressing_mode_e MODE>
+	uint16_t address()
+	{
+		uint16_t addr = 0;
+		uint8_t pointer;
+
+		switch(MODE)
+		{
+		case IMMED:
+			addr = ++PC;
+			break;
+		case ZEROP:
+			addr = read(++PC);
+			break;
+		case ZEPIX:
+			addr = (read(++PC) + x_reg) & 0xFF;
+			break;
+		case ZEPIY:
+			addr = (read(++PC) + y_reg) & 0xFF;
+			break;
+		case ABSOL:
+			addr = read(++PC);
+			addr += read(++PC) << 8;
+			break;
+		case ABSIX:
+			addr = read(++PC);
+			addr += (read(++PC) << 8) + x_reg;
+			break;
+		case ABSIY:
+			addr = read(++PC);
+			addr += (read(++PC) << 8) + y_reg;
+			break;
+		case INDIN:
+			pointer = read(++PC) + x_reg;
+			addr = read(pointer) + (read((uint8_t)(pointer + 1)) << 8);
+			break;
+		case ININD:
+			pointer = read(++PC);
+			addr = read(pointer) + (read((uint8_t)(pointer + 1)) << 8) + y_reg;
+			break;
+		default:
+			break;
+		}
+		return addr;
+	}
+
+	void setZeroNegative(uint8_t value)
+	{
+		status.$zero = value == 0;
+		status.$negative = value >> 7;
+	}
+
+	/*
+	* The arithmetic ADC does, for RRA and ISB (which adds the complement).
+	*/
+	void addWithCarry(uint8_t value)
+	{
+		uint16_t sum = accum + value + status.$carry;
+		status.$carry = sum >> 8;
+		status.$overflow = (~(accum ^ value) & (accum ^ sum) & 0x80) != 0;
+		accum = sum;
+		setZeroNegative(accum);
+	}
+
+	/*
+	* AND Immediate, then copy bit 7 into Carry
+	*/
+	template<addressing_mode_e MODE>
+	void ANC()
+	{
+		accum &= read(address<MODE>());
+		setZeroNegative(accum);
+		status.$carry = accum >> 7;
+	}
+
+	/*
+	* AND Immediate, then Logical Shift Right the Accumulator
+	*/
+	template<addressing_mode_e MODE>
+	void ALR()
+	{
+		accum &= read(address<MODE>());
+		status.$carry = accum & 1;
+		accum >>= 1;
+		setZeroNegative(accum);
+	}
+
+	/*
+	* AND Immediate, then Rotate Right the Accumulator. Carry and Overflow come
+	* from bits 6 and 5 of the result rather than from the shift.
+	*/
+	template<addressing_mode_e MODE>
+	void ARR()
+	{
+		accum &= read(address<MODE>());
+		accum = (accum >> 1) | (status.$carry << 7);
+		setZeroNegative(accum);
+		status.$carry = (accum >> 6) & 1;
+		status.$overflow = ((accum >> 6) ^ (accum >> 5)) & 1;
+	}
+
+	/*
+	* X = (Accumulator AND X) - Immediate, without borrow, setting Carry like CMP
+	*/
+	template<addressing_mode_e MODE>
+	void AXS()
+	{
+		uint8_t value = read(address<MODE>());
+		uint8_t both = accum & x_reg;
+		status.$carry = both >= value;
+		x_reg = both - value;
+		setZeroNegative(x_reg);
+	}
+
+	/*
+	* Decrement Memory, then Compare it with the Accumulator
+	*/
+	template<addressing_mode_e MODE>
+	void DCP()
+	{
+		uint16_t addr = address<MODE>();
+		uint8_t value = read(addr) - 1;
+		write(addr, value);
+
+		status.$carry = accum >= value;
+		setZeroNegative(accum - value);
+	}
+
+	/*
+	* Increment Memory, then Subtract it from the Accumulator with Borrow
+	*/
+	template<addressing_mode_e MODE>
+	void ISB()
+	{
+		uint16_t addr = address<MODE>();
+		uint8_t value = read(addr) + 1;
+		write(addr, value);
+
+		addWithCarry(value ^ 0xFF);
+	}
+
+	/*
+	* Load Accumulator and X-Register with Memory
+	*/
+	template<addressing_mode_e MODE>
+	void LAX()
+	{
+		accum = x_reg = read(address<MODE>());
+		setZeroNegative(accum);
+	}
+
+	/*
+	* No Operation, reading its operand and throwing it away. The read still
+	* happens, so one aimed at an I/O register has that register's side effects.
+	*/
+	template<addressing_mode_e MODE>
+	void NOP()
+	{
+		if (MODE != IMPLI)
+			read(address<MODE>());
+	}
+
+	/*
+	* Rotate Memory Left, then AND it into the Accumulator
+	*/
+	template<addressing_mode_e MODE>
+	void RLA()
+	{
+		uint16_t addr = address<MODE>();
+		uint8_t value = read(addr);
+		uint8_t carry = status.$carry;
+		status.$carry = value >> 7;
+		value = (value << 1) | carry;
+		write(addr, value);
+
+		accum &= value;
+		setZeroNegative(accum);
+	}
+
+	/*
+	* Rotate Memory Right, then Add it to the Accumulator with Carry
+	*/
+	template<addressing_mode_e MODE>
+	void RRA()
+	{
+		uint16_t addr = address<MODE>();
+		uint8_t value = read(addr);
+		uint8_t carry = status.$carry;
+		status.$carry = value & 1;
+		value = (value >> 1) | (carry << 7);
+		write(addr, value);
+
+		addWithCarry(value);
+	}
+
+	/*
+	* Store Accumulator AND X-Register, leaving the flags alone
+	*/
+	template<addressing_mode_e MODE>
+	void SAX()
+	{
+		write(address<MODE>(), accum & x_reg);
+	}
+
+	/*
+	* Arithmetic Shift Memory Left, then OR it into the Accumulator
+	*/
+	template<addressing_mode_e MODE>
+	void SLO()
+	{
+		uint16_t addr = address<MODE>();
+		uint8_t value = read(addr);
+		status.$carry = value >> 7;
+		value <<= 1;
+		write(addr, value);
+
+		accum |= value;
+		setZeroNegative(accum);
+	}
+
+	/*
+	* Logical Shift Memory Right, then Exclusive OR it into the Accumulator
+	*/
+	template<addressing_mode_e MODE>
+	void SRE()
+	{
+		uint16_t addr = address<MODE>();
+		uint8_t value = read(addr);
+		status.$carry = value & 1;
+		value >>= 1;
+		write(addr, value);
+
+		accum ^= value;
+		setZeroNegative(accum);
+	}
+
+	/*
+	* Non-Maskable Interrupt, raised by the PPU at the start of V-Blank.
+	* PC already points at the next instruction, which is where RTI returns to.
+	*/
+	void nmi()
+	{
+		stackPush<uint16_t>(PC);
+		status.$break = 0;
+		PHP<IMPLI>();
+		status.$interrupt = 1;
+		PC = read(0xFFFA) + (read(0xFFFB) << 8);
+	}
+
 	/**
-	* Execute instruction at program counter.
+	* Execute instruction at program counter. Returns false if it was a KIL.
 	*/
-	void execute()
+	bool execute()
 	{
+		if (PPU::pollNmi())
+		{
+			nmi();
+			return true;
+		}
+
 		if(read(PC) == 0x69)
 		{
 			//std::cout << "Instruction: Add With Carry (0x69 IMMED) with " << (int)read(PC+1);
@@ -1668,7 +1967,8 @@ namespace CPU
 			<< "\nOverflow Flag: " << (int)status.$overflow
 			<< "\nNegative Flag: " << (int)status.$negative << "\n\n";*/
 
-		switch(read(PC))
+		uint8_t opcode = read(PC);
+		switch(opcode)
 		{
 			case 0x69: ADC<IMMED>(); break;
 			case 0x65: ADC<ZEROP>(); break;
@@ -1876,17 +2176,111 @@ namespace CPU
 			case 0x9A: TXS<IMPLI>(); break;
 
 			case 0x98: TYA<IMPLI>(); break;
+
+			// Unofficial
+			case 0x0B: ANC<IMMED>(); break;
+			case 0x2B: ANC<IMMED>(); break;
+
+			case 0x4B: ALR<IMMED>(); break;
+
+			case 0x6B: ARR<IMMED>(); break;
+
+			case 0xCB: AXS<IMMED>(); break;
+
+			case 0xC7: DCP<ZEROP>(); break;
+			case 0xD7: DCP<ZEPIX>(); break;
+			case 0xCF: DCP<ABSOL>(); break;
+			case 0xDF: DCP<ABSIX>(); break;
+			case 0xDB: DCP<ABSIY>(); break;
+			case 0xC3: DCP<INDIN>(); break;
+			case 0xD3: DCP<ININD>(); break;
+
+			case 0xE7: ISB<ZEROP>(); break;
+			case 0xF7: ISB<ZEPIX>(); break;
+			case 0xEF: ISB<ABSOL>(); break;
+			case 0xFF: ISB<ABSIX>(); break;
+			case 0xFB: ISB<ABSIY>(); break;
+			case 0xE3: ISB<INDIN>(); break;
+			case 0xF3: ISB<ININD>(); break;
+
+			case 0xA7: LAX<ZEROP>(); break;
+			case 0xB7: LAX<ZEPIY>(); break;
+			case 0xAF: LAX<ABSOL>(); break;
+			case 0xBF: LAX<ABSIY>(); break;
+			case 0xA3: LAX<INDIN>(); break;
+			case 0xB3: LAX<ININD>(); break;
+
+			case 0x1A: case 0x3A: case 0x5A: case 0x7A: case 0xDA: case 0xFA: NOP<IMPLI>(); break;
+			case 0x80: case 0x82: case 0x89: case 0xC2: case 0xE2: NOP<IMMED>(); break;
+			case 0x04: case 0x44: case 0x64: NOP<ZEROP>(); break;
+			case 0x14: case 0x34: case 0x54: case 0x74: case 0xD4: case 0xF4: NOP<ZEPIX>(); break;
+			case 0x0C: NOP<ABSOL>(); break;
+			case 0x1C: case 0x3C: case 0x5C: case 0x7C: case 0xDC: case 0xFC: NOP<ABSIX>(); break;
+
+			case 0x27: RLA<ZEROP>(); break;
+			case 0x37: RLA<ZEPIX>(); break;
+			case 0x2F: RLA<ABSOL>(); break;
+			case 0x3F: RLA<ABSIX>(); break;
+			case 0x3B: RLA<ABSIY>(); break;
+			case 0x23: RLA<INDIN>(); break;
+			case 0x33: RLA<ININD>(); break;
+
+			case 0x67: RRA<ZEROP>(); break;
+			case 0x77: RRA<ZEPIX>(); break;
+			case 0x6F: RRA<ABSOL>(); break;
+			case 0x7F: RRA<ABSIX>(); break;
+			case 0x7B: RRA<ABSIY>(); break;
+			case 0x63: RRA<INDIN>(); break;
+			case 0x73: RRA<ININD>(); break;
+
+			case 0x87: SAX<ZEROP>(); break;
+			case 0x97: SAX<ZEPIY>(); break;
+			case 0x8F: SAX<ABSOL>(); break;
+			case 0x83: SAX<INDIN>(); break;
+
+			case 0xEB: SBC<IMMED>(); break; // Same as $E9
+
+			case 0x07: SLO<ZEROP>(); break;
+			case 0x17: SLO<ZEPIX>(); break;
+			case 0x0F: SLO<ABSOL>(); break;
+			case 0x1F: SLO<ABSIX>(); break;
+			case 0x1B: SLO<ABSIY>(); break;
+			case 0x03: SLO<INDIN>(); break;
+			case 0x13: SLO<ININD>(); break;
+
+			case 0x47: SRE<ZEROP>(); break;
+			case 0x57: SRE<ZEPIX>(); break;
+			case 0x4F: SRE<ABSOL>(); break;
+			case 0x5F: SRE<ABSIX>(); break;
+			case 0x5B: SRE<ABSIY>(); break;
+			case 0x43: SRE<INDIN>(); break;
+			case 0x53: SRE<ININD>(); break;
+
+			// KIL: the CPU locks up until reset, ignoring interrupts. PC stays on the opcode.
+			case 0x02: case 0x12: case 0x22: case 0x32: case 0x42: case 0x52:
+			case 0x62: case 0x72: case 0x92: case 0xB2: case 0xD2: case 0xF2:
+				if (!fault.faulted)
+					fault = { true, true, PC, opcode };
+				return false;
+
+			default:
+				if (!fault.faulted)
+					fault = { true, false, PC, opcode };
+				break;
 		}
 		++PC;
+		return true;
 	}
 
+
 	/*
 	* Initialize CPU, called by power() after proper reset.
 	*/
 	void initialize()
 	{
-		ram = new uint8_t[0x800]; // RAM is addressable from $0000 to $0FFF and mirrored at $0800-$0FFF, $1000-$17FF, and $1800-$1FFF
-		memset(ram, 0xFF, sizeof(ram)); // Fill memory with $FF values (erasures in EEPROMs set to $FF)
+		if (!ram) // Allocated on first power; later powers, and consoles given RAM through setRam(), reuse it.
+			ram = new uint8_t[0x800]; // RAM is addressable from $0000 to $0FFF and mirrored at $0800-$0FFF, $1000-$17FF, and $1800-$1FFF
+		memset(ram, 0xFF, 0x800); // Fill memory with $FF values (erasures in EEPROMs set to $FF)
 		accum = 0x00;
 		x_reg = 0x00;
 		y_reg = 0x00;
@@ -1899,6 +2293,182 @@ namespace CPU
 		stackPush<uint8_t>(0);
 	}
 
+	/*
+	* Read a byte without side effects on I/O registers, for tracing and debugging.
+	*/
+	uint8_t peek(uint16_t addr)
+	{
+		if (addr < 0x2000)
+		{
+			return ram[addr % 0x800];
+		}
+		else if (addr >= 0x6000)
+		{
+			return Cartridge::mapper->read(addr);
+		}
+		return 0;
+	}
+
+	/*
+	* Whether the instruction at PC is a KIL, which the CPU never gets past.
+	*/
+	bool jammed()
+	{
+		uint8_t opcode = peek(PC);
+		return (opcode & 0x0F) == 0x02 && (opcode < 0x80 || (opcode & 0x10));
+	}
+
+	/*
+	* Find a loop at PC that only waits. Its instructions may load, compare
+	* and test RAM, cartridge memory or $2002 (zero page, absolute or
+	* immediate) and branch; the last must branch or jump back to PC. A branch
+	* elsewhere in it leaves the loop when taken.
+	*/
+	bool findLoop(loop_s& loop)
+	{
+		uint16_t addr = PC;
+		loop.status = false;
+
+		for (int i = 0; i < 4; ++i)
+		{
+			uint8_t opcode = peek(addr);
+			uint16_t operand;
+			loop.address[i] = addr;
+			loop.instructions = i + 1;
+
+			switch (opcode)
+			{
+			case 0x10: case 0x30: case 0x50: case 0x70: case 0x90: case 0xB0: case 0xD0: case 0xF0:
+				if ((uint16_t)(addr + 2 + (int8_t)peek(addr + 1)) == PC)
+					return true;
+				addr += 2;
+				break;
+
+			case 0x4C:
+				return (peek(addr + 1) | (peek(addr + 2) << 8)) == PC;
+
+			case 0xA9: case 0xA2: case 0xA0: case 0x29: case 0x09: case 0x49: case 0xC9: case 0xE0: case 0xC0: // Immediate
+			case 0xA5: case 0xA6: case 0xA4: case 0x25: case 0x05: case 0x45: case 0xC5: case 0xE4: case 0xC4: case 0x24: // Zero page
+				addr += 2;
+				break;
+
+			case 0xAD: case 0xAE: case 0xAC: case 0x2D: case 0x0D: case 0x4D: case 0xCD: case 0xEC: case 0xCC: case 0x2C: // Absolute
+				operand = peek(addr + 1) | (peek(addr + 2) << 8);
+				if (operand >= 0x2000 && operand < 0x6000)
+				{
+					if (operand >= 0x4000 || (operand & 7) != 2)
+						return false; // Other registers have side effects or change on their own.
+					loop.status = true;
+				}
+				addr += 3;
+				break;
+
+			default:
+				return false;
+			}
+		}
+		return false;
+	}
+
+	/*
+	* Execute one pass of a loop from findLoop(), stopping early if it leaves.
+	* Returns the instructions executed; unchanged is set when the pass came
+	* back to the start with every register as it was.
+	*/
+	int runPass(const loop_s& loop, bool& unchanged)
+	{
+		registers_s before = getRegisters();
+		unchanged = false;
+
+		for (int executed = 1; executed <= loop.instructions; ++executed)
+		{
+			execute();
+			if (PC != loop.address[executed % loop.instructions])
+				return executed;
+		}
+
+		registers_s after = getRegisters();
+		unchanged = after.SP == before.SP && after.accum == before.accum && after.x_reg == before.x_reg
+			&& after.y_reg == before.y_reg && after.status == before.status;
+		return loop.instructions;
+	}
+
+	uint16_t getProgramCounter()
+	{
+		return PC;
+	}
+
+	registers_s getRegisters()
+	{
+		registers_s regs;
+		regs.PC = PC;
+		regs.SP = SP;
+		regs.accum = accum;
+		regs.x_reg = x_reg;
+		regs.y_reg = y_reg;
+		regs.status = status.$negative << 7 |
+			status.$overflow << 6 |
+			status.$break << 4 |
+			status.$decimal << 3 |
+			status.$interrupt << 2 |
+			status.$zero << 1 |
+			status.$carry;
+		return regs;
+	}
+
+	void setRegisters(const registers_s& regs)
+	{
+		PC = regs.PC;
+		SP = regs.SP;
+		accum = regs.accum;
+		x_reg = regs.x_reg;
+		y_reg = regs.y_reg;
+		status.$negative = regs.status >> 7;
+		status.$overflow = (regs.status >> 6) & 1;
+		status.$break = (regs.status >> 4) & 1;
+		status.$decimal = (regs.status >> 3) & 1;
+		status.$interrupt = (regs.status >> 2) & 1;
+		status.$zero = (regs.status >> 1) & 1;
+		status.$carry = regs.status & 1;
+	}
+
+	const fault_s& getFault()
+	{
+		return fault;
+	}
+
+	uint8_t* getRam()
+	{
+		return ram;
+	}
+
+	/*
+	* Point work RAM at a caller-owned 2KB buffer, so several consoles can be
+	* switched in without copying.
+	*/
+	void setRam(uint8_t* buffer)
+	{
+		ram = buffer;
+	}
+
+	/*
+	* Snapshot the registers and work RAM.
+	*/
+	void save(state_s& state)
+	{
+		state.regs = getRegisters();
+		memcpy(state.ram, ram, 0x800);
+	}
+
+	/*
+	* Restore a snapshot taken by save().
+	*/
+	void load(const state_s& state)
+	{
+		setRegisters(state.regs);
+		memcpy(ram, state.ram, 0x800);
+	}
+
 	/**
 	* Turn on and reset CPU.
 	*/
@@ -1907,6 +2477,7 @@ namespace CPU
 		// Do stuff to reset CPU
 		PC = 0x8000;
 		SP = 0x00;
+		fault = {};
 
 		initialize();
 	}
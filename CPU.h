@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include <cstdint>
 
 namespace CPU
 {
@@ -21,6 +22,64 @@ namespace CPU
 		ACCUM /* Accumulator */
 	} addressing_mode_e;
 
-	void execute();
+	/*
+	* Programmer-visible registers, with the status flags packed as NV-BDIZC.
+	*/
+	typedef struct {
+		uint16_t PC;
+		uint8_t SP;
+		uint8_t accum;
+		uint8_t x_reg;
+		uint8_t y_reg;
+		uint8_t status;
+	} registers_s;
+
+	/*
+	* Everything needed to resume the CPU exactly where it left off.
+	*/
+	typedef struct {
+		registers_s regs;
+		uint8_t ram[0x800];
+	} state_s;
+
+	/*
+	* The first opcode the CPU met that stopped the program, if any. A KIL jams
+	* the CPU: PC stays on it and the console halts. Any other fault is one of
+	* the unstable unofficial opcodes, which are not emulated but skipped like a
+	* one-byte NOP, so the run carries on, usually into garbage; callers that
+	* care stop at the first fault. Cleared by power().
+	*/
+	typedef struct {
+		bool faulted;
+		bool jammed;
+		uint16_t PC;
+		uint8_t opcode;
+	} fault_s;
+
+	/*
+	* A loop that does nothing but wait: up to four instructions that read
+	* memory and branch, ending in a branch or jump back to the first. JMP *
+	* is the one-instruction kind.
+	*/
+	typedef struct {
+		uint16_t address[4]; // Each instruction of a pass
+		int instructions;
+		bool status; // Polls $2002
+	} loop_s;
+
+	bool execute();
 	void power();
+	bool jammed();
+	const fault_s& getFault();
+	bool findLoop(loop_s& loop);
+	int runPass(const loop_s& loop, bool& unchanged);
+	uint16_t getProgramCounter();
+
+	uint8_t peek(uint16_t addr);
+	registers_s getRegisters();
+	void setRegisters(const registers_s& regs);
+	uint8_t* getRam();
+	void setRam(uint8_t* buffer);
+	void save(state_s& state);
+	void load(const state_s& state);
 }
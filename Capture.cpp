@@ -0,0 +1,240 @@
+#include "Capture.h"
+#include "Palette.h"
+#include "PPU.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Capture
+{
+	typedef struct {
+		std::vector<uint8_t> indices;
+		uint8_t mask;
+	} buffer_s;
+
+	FILE* file = nullptr;
+	format_e format = Y4M;
+
+	std::vector<buffer_s> pool;
+	std::deque<buffer_s*> freeBuffers, readyBuffers;
+	std::mutex mutex;
+	std::condition_variable bufferFreed, bufferReady;
+	std::thread writer;
+	bool closing = false;
+	bool failed = false;
+
+	uint32_t frames = 0;
+	uint32_t stalls = 0; // Hand-offs that found the pool empty and had to wait
+
+	/*
+	* Fixed-point BT.601 full range, as C420jpeg expects.
+	*/
+	void toYCbCr(uint32_t rgba, int& y, int& cb, int& cr)
+	{
+		int r = rgba >> 24, g = (rgba >> 16) & 0xFF, b = (rgba >> 8) & 0xFF;
+		y = (77 * r + 150 * g + 29 * b + 128) >> 8;
+		cb = ((-43 * r - 85 * g + 128 * b + 128) >> 8) + 128;
+		cr = ((128 * r - 107 * g - 21 * b + 128) >> 8) + 128;
+	}
+
+	/*
+	* Writer side: one frame out in the chosen format. Colours come from the
+	* palette's tables for the frame's own mask, so greyscale and emphasis
+	* changes are kept.
+	*/
+	void writeFrame(const buffer_s& buffer, std::vector<uint8_t>& out)
+	{
+		const uint32_t* table = Palette::table(buffer.mask);
+		uint8_t keep = (buffer.mask & 0x01) ? 0x30 : 0x3F;
+		const uint8_t* in = buffer.indices.data();
+
+		if (format == RAW)
+		{
+			out.resize(PPU_WIDTH * PPU_HEIGHT * 4);
+			for (int p = 0; p < PPU_WIDTH * PPU_HEIGHT; ++p)
+			{
+				uint32_t rgba = table[in[p] & keep];
+				out[p * 4] = rgba >> 24;
+				out[p * 4 + 1] = rgba >> 16;
+				out[p * 4 + 2] = rgba >> 8;
+				out[p * 4 + 3] = rgba;
+			}
+			fwrite(out.data(), 1, out.size(), file);
+			return;
+		}
+
+		int lumaTable[64], blueTable[64], redTable[64];
+		for (int i = 0; i < 64; ++i)
+			toYCbCr(table[i & keep], lumaTable[i], blueTable[i], redTable[i]);
+
+		const int chromaWidth = PPU_WIDTH / 2, chromaHeight = PPU_HEIGHT / 2;
+		out.resize(PPU_WIDTH * PPU_HEIGHT + chromaWidth * chromaHeight * 2);
+		uint8_t* luma = out.data();
+		uint8_t* blue = luma + PPU_WIDTH * PPU_HEIGHT;
+		uint8_t* red = blue + chromaWidth * chromaHeight;
+
+		for (int p = 0; p < PPU_WIDTH * PPU_HEIGHT; ++p)
+			luma[p] = lumaTable[in[p] & 0x3F];
+
+		// Chroma is the average of each 2x2 block.
+		for (int y = 0; y < chromaHeight; ++y)
+		{
+			const uint8_t* top = &in[y * 2 * PPU_WIDTH];
+			const uint8_t* bottom = top + PPU_WIDTH;
+			for (int x = 0; x < chromaWidth; ++x)
+			{
+				uint8_t a = top[x * 2] & 0x3F, b = top[x * 2 + 1] & 0x3F, c = bottom[x * 2] & 0x3F, d = bottom[x * 2 + 1] & 0x3F;
+				blue[y * chromaWidth + x] = (blueTable[a] + blueTable[b] + blueTable[c] + blueTable[d] + 2) >> 2;
+				red[y * chromaWidth + x] = (redTable[a] + redTable[b] + redTable[c] + redTable[d] + 2) >> 2;
+			}
+		}
+
+		fputs("FRAME\n", file);
+		fwrite(out.data(), 1, out.size(), file);
+	}
+
+	void writerLoop()
+	{
+		std::vector<uint8_t> out;
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;)
+		{
+			bufferReady.wait(lock, [] { return closing || !readyBuffers.empty(); });
+			if (readyBuffers.empty())
+				return;
+
+			buffer_s* buffer = readyBuffers.front();
+			readyBuffers.pop_front();
+			lock.unlock();
+
+			writeFrame(*buffer, out);
+			bool ok = !ferror(file);
+
+			lock.lock();
+			failed = failed || !ok;
+			freeBuffers.push_back(buffer);
+			bufferFreed.notify_one();
+		}
+	}
+
+	/*
+	* Start capturing to a file, or to standard output for "-". depth is the
+	* number of frames that can be waiting for the writer.
+	*/
+	bool open(const char* filename, format_e captureFormat, int depth)
+	{
+		close();
+
+		if (filename[0] == '-' && !filename[1])
+		{
+			file = stdout;
+		}
+		else
+		{
+#ifdef _MSC_VER
+			fopen_s(&file, filename, "wb");
+#else
+			file = fopen(filename, "wb");
+#endif
+		}
+		if (!file)
+			return false;
+
+		format = captureFormat;
+		if (format == Y4M)
+		{
+			// The NTSC NES runs at 39375000 / 655171 (about 60.0988) frames per second, with 8:7 pixels.
+			fprintf(file, "YUV4MPEG2 W%d H%d F39375000:655171 Ip A8:7 C420jpeg\n", PPU_WIDTH, PPU_HEIGHT);
+		}
+
+		// Build the palette tables here so the writer thread never has to.
+		Palette::table(0);
+
+		pool.assign(depth < 1 ? 1 : depth, buffer_s());
+		for (buffer_s& buffer : pool)
+		{
+			buffer.indices.resize(PPU_WIDTH * PPU_HEIGHT);
+			freeBuffers.push_back(&buffer);
+		}
+		closing = false;
+		failed = false;
+		frames = 0;
+		stalls = 0;
+		writer = std::thread(writerLoop);
+		return true;
+	}
+
+	/*
+	* Hand over a composed frame. Returns as soon as it is copied into a free buffer.
+	*/
+	void frame(const uint8_t* indices, uint8_t mask)
+	{
+		if (!file)
+			return;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (freeBuffers.empty())
+		{
+			++stalls;
+			bufferFreed.wait(lock, [] { return !freeBuffers.empty(); });
+		}
+		buffer_s* buffer = freeBuffers.front();
+		freeBuffers.pop_front();
+		lock.unlock();
+
+		std::copy(indices, indices + PPU_WIDTH * PPU_HEIGHT, buffer->indices.begin());
+		buffer->mask = mask;
+
+		lock.lock();
+		readyBuffers.push_back(buffer);
+		++frames;
+		bufferReady.notify_one();
+	}
+
+	/*
+	* Write out everything still queued and finish the file.
+	*/
+	void close()
+	{
+		if (!file)
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closing = true;
+		}
+		bufferReady.notify_one();
+		writer.join();
+
+		if (failed)
+			std::cerr << "Capture: write failed, output is incomplete" << std::endl;
+		if (file == stdout)
+			fflush(file);
+		else
+			fclose(file);
+		file = nullptr;
+		freeBuffers.clear();
+		pool.clear();
+	}
+
+	bool active()
+	{
+		return file != nullptr;
+	}
+
+	uint32_t getFrameCount()
+	{
+		return frames;
+	}
+
+	uint32_t getStallCount()
+	{
+		return stalls;
+	}
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+* Video capture for recording runs. Frames are handed over as palette indices
+* into a fixed pool of buffers; a writer thread converts them and does the
+* I/O, so the emulator only waits when every buffer in the pool is taken.
+*
+* Y4M is 4:2:0 (C420jpeg, BT.601 full range); raw is packed R, G, B, A bytes
+* per pixel, PPU_WIDTH x PPU_HEIGHT per frame with no header.
+*/
+namespace Capture
+{
+	typedef enum {
+		Y4M,
+		RAW
+	} format_e;
+
+	bool open(const char* filename, format_e format, int depth = 8);
+	void frame(const uint8_t* indices, uint8_t mask);
+	void close();
+	bool active();
+
+	uint32_t getFrameCount();
+	uint32_t getStallCount();
+}
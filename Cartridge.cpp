@@ -1,41 +1,176 @@
 #include "Cartridge.h"
 #include "Mapper.h"
 #include "Mapper000.h"
+#include "Mapper001.h"
+#include "Hash.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
 
 namespace Cartridge
 {
-	Mapper* mapper = nullptr;
+	thread_local Mapper* mapper = nullptr;
+	std::vector<uint8_t> image; // The file as loaded, for threads that need a mapper of their own
+	uint32_t romCrc = 0; // CRC-32 of the ROM image minus its header
+	bool batterySaves = false;
+	int batteryFlushSeconds = 5;
+
+	/*
+	* Keep battery-backed PRG RAM in <rom name>.sav next to the ROM, flushed
+	* every flushSeconds while it changes. Off by default so that runs that
+	* must be reproducible don't pick up a previous run's save.
+	*/
+	void setBatterySaves(bool enabled, int flushSeconds)
+	{
+		batterySaves = enabled;
+		batteryFlushSeconds = flushSeconds;
+	}
+
+	/*
+	* Decode an iNES or NES 2.0 header. Old dumps often have junk such as
+	* "DiskDude!" in bytes 7-15; when bytes 12-15 are not zero the high mapper
+	* nibble and the PRG RAM size are taken to be junk too.
+	*/
+	header_s parseHeader(const uint8_t* data, size_t size)
+	{
+		header_s header = {};
+		if (size < 16 || memcmp(data, "NES\x1A", 4) != 0)
+		{
+			header.problem = "not an iNES image";
+			return header;
+		}
+		header.magic = true;
+
+		header.nes2 = (data[7] & 0x0C) == 0x08;
+		bool junk = !header.nes2 && (data[12] | data[13] | data[14] | data[15]) != 0;
+		header.mapper = (data[6] >> 4) | (junk ? 0 : data[7] & 0xF0);
+		header.prgSize = data[4] * 0x4000;
+		header.chrSize = data[5] * 0x2000;
+		if (header.nes2)
+		{
+			header.mapper |= (data[8] & 0x0F) << 8;
+			header.prgSize += (data[9] & 0x0F) << 8 << 14;
+			header.chrSize += (data[9] >> 4) << 8 << 13;
+			// Volatile and battery-backed RAM, each 64 << shift bytes or none
+			header.prgRamSize = ((data[10] & 0x0F) ? 64 << (data[10] & 0x0F) : 0) + ((data[10] >> 4) ? 64 << (data[10] >> 4) : 0);
+		}
+		else if (!junk)
+			header.prgRamSize = data[8] * 0x2000;
+		if (header.prgRamSize < 0x2000)
+			header.prgRamSize = 0x2000; // The mappers here decode all of $6000-$7FFF
+		header.trainer = (data[6] & 0x04) != 0;
+		header.battery = (data[6] & 0x02) != 0;
+		if (data[6] & 0x08)
+			header.mirroring = PPU::FOUR_SCREEN;
+		else
+			header.mirroring = data[6] & 0x01 ? PPU::VERTICAL : PPU::HORIZONTAL;
+
+		if (header.prgSize == 0)
+			header.problem = "no PRG ROM";
+		else if (size < 16 + (header.trainer ? 512 : 0) + (size_t)header.prgSize + header.chrSize)
+			header.problem = "truncated";
+		else
+			header.valid = true;
+		return header;
+	}
+
+	bool supported(int mapperNumber)
+	{
+		return mapperNumber == 0 || mapperNumber == 1;
+	}
+
+	/*
+	* A fresh mapper for an iNES image, on a copy the mapper owns, or nullptr
+	* if the image is truncated or the mapper isn't supported. The mapper finds
+	* PRG, CHR and its RAM where the parsed header says. Sets the calling
+	* thread's PPU mirroring.
+	*/
+	Mapper* create(const uint8_t* data, size_t size)
+	{
+		header_s header = parseHeader(data, size);
+		if (!header.valid || !supported(header.mapper))
+			return nullptr;
+
+		uint8_t* rom = new uint8_t[size];
+		memcpy(rom, data, size);
+
+		switch(header.mapper)
+		{
+		case 0:  return new Mapper000(rom, header);
+		case 1:  return new Mapper001(rom, header);
+		/*case 2:  return new Mapper002(rom, header);
+		case 3:  return new Mapper003(rom, header);
+		case 4:  return new Mapper004(rom, header);*/
+		}
+		delete[] rom;
+		return nullptr;
+	}
 
 	void load(const char *filename)
 	{
 		FILE* f;
+#ifdef _MSC_VER
 		fopen_s(&f, filename, "rb");
+#else
+		f = fopen(filename, "rb");
+#endif
+		if(!f) return;
 
 		// Find size of file in bytes and reset file pointer.
 		fseek(f, 0, SEEK_END);
 		int size = ftell(f);
 		fseek(f, 0, SEEK_SET);
 
-		// Allocate and store file into heap.
-		uint8_t *rom = new uint8_t[size];
-		fread(rom, size, 1, f);
+		// Keep the file around; every mapper made from it works on its own copy.
+		image.resize(size > 0 ? size : 0);
+		if (!image.empty())
+			image.resize(fread(image.data(), 1, image.size(), f));
 		fclose(f);
+		romCrc = image.size() > 16 ? Hash::crc32(image.data() + 16, image.size() - 16) : 0;
 
-		// Retrieve encoded mapper type from ROM
-		int mapperNum = (rom[7] & 0xF0) | (rom[6] >> 4);
 		if(loaded()) delete mapper;
-		switch(mapperNum)
+		mapper = create(image.data(), image.size());
+
+		if(loaded() && batterySaves && mapper->has_battery())
 		{
-		case 0:  mapper = new Mapper000(rom); break;
-		/*case 1:  mapper = new Mapper001(rom); break;
-		case 2:  mapper = new Mapper002(rom); break;
-		case 3:  mapper = new Mapper003(rom); break;
-		case 4:  mapper = new Mapper004(rom); break;*/
+			std::string path(filename);
+			size_t dot = path.find_last_of('.');
+			if(dot != std::string::npos && path.find_first_of("/\\", dot) == std::string::npos)
+				path.erase(dot);
+			path += ".sav";
+			if(!mapper->map_battery(path.c_str(), batteryFlushSeconds))
+				std::cerr << "Could not map save file " << path << ", saves will not be kept" << std::endl;
 		}
 	}
 
+	/*
+	* Give the calling thread a mapper of its own for the loaded cartridge, so it
+	* can run a console on its own copy of the chips. It never keeps a save file.
+	*/
+	void loadForThread()
+	{
+		if(loaded()) delete mapper;
+		mapper = create(image.data(), image.size());
+	}
+
+	/*
+	* Release the calling thread's cartridge, writing out its save file if it has one.
+	*/
+	void unload()
+	{
+		delete mapper;
+		mapper = nullptr;
+	}
+
 	bool loaded()
 	{
 		return mapper != nullptr;
 	}
+
+	uint32_t crc()
+	{
+		return romCrc;
+	}
 }
@@ -6,9 +6,35 @@
 
 namespace Cartridge
 {
-	extern Mapper* mapper;
+	extern thread_local Mapper* mapper; // Per thread, like the chips
 
+	/*
+	* An iNES header, checked against the size of the image it came with.
+	* Tagged so Mapper.h can take one without including this file.
+	*/
+	typedef struct header_s {
+		bool valid; // The image holds everything the header declares
+		const char* problem; // Why not, when not valid
+		bool magic; // "NES\x1A" is there, so the fields below were decoded
+		bool nes2; // NES 2.0 header
+		int mapper;
+		uint32_t prgSize;
+		uint32_t chrSize; // 0 for CHR RAM
+		uint32_t prgRamSize; // $6000-$7FFF, battery-backed or not; at least 8KB
+		bool trainer; // 512 bytes between the header and PRG ROM
+		bool battery;
+		PPU::mirroring_e mirroring;
+	} header_s;
+
+	header_s parseHeader(const uint8_t* data, size_t size);
+	bool supported(int mapperNumber);
+
+	void setBatterySaves(bool enabled, int flushSeconds = 5);
+	Mapper* create(const uint8_t* data, size_t size);
 	void load(const char *filename);
+	void loadForThread();
+	void unload();
 	bool loaded();
+	uint32_t crc();
 };
 
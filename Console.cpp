@@ -0,0 +1,112 @@
+#include "Console.h"
+#include "APU.h"
+#include "PPU.h"
+#include "CPU.h"
+#include "Timeline.h"
+
+namespace Console
+{
+	thread_local bool idleSkip = true;
+	thread_local uint16_t pollHead = 0; // Last status poll turned down for want of room, and its pass
+	thread_local uint32_t pollPass = 0;
+
+	/*
+	* Bring up every chip. A cartridge must already be loaded.
+	*/
+	void power()
+	{
+		APU::initialize();
+		PPU::initialize();
+		CPU::power();
+	}
+
+	/*
+	* Execute one CPU instruction, three dots after the last on the timeline.
+	* The PPU runs them when the CPU next looks or an event comes due.
+	* Returns false if the instruction jammed the CPU.
+	*/
+	bool step()
+	{
+		Timeline::advance(3);
+		return CPU::execute();
+	}
+
+	/*
+	* At the head of a loop that only waits, such as LDA $2002 / BPL or JMP *,
+	* run one pass of it. If the pass left the CPU as it found it, every pass
+	* after it will too until something the loop reads changes, so the PPU runs
+	* on by as many passes as fit before that could happen. The CPU goes first
+	* and the PPU catches up after, which the quiet dots make impossible to
+	* tell apart from stepping. Returns false, having done nothing, if there is
+	* no loop here or no room for it.
+	*/
+	bool skipIdle()
+	{
+		// A status poll spins through a whole frame of rendering without room to
+		// skip, so don't decode it again until there might be. Stale entries only
+		// cost a skip, never correctness.
+		uint16_t head = CPU::getProgramCounter();
+		if (head == pollHead && PPU::quietDots(true) < 2 * pollPass)
+			return false;
+
+		CPU::loop_s loop;
+		if (!CPU::findLoop(loop))
+			return false;
+
+		uint32_t pass = loop.instructions * 3;
+		uint32_t quiet = PPU::quietDots(loop.status);
+		if (quiet < 2 * pass)
+		{
+			if (loop.status)
+			{
+				pollHead = head;
+				pollPass = pass;
+			}
+			return false;
+		}
+
+		bool unchanged;
+		uint32_t dots = CPU::runPass(loop, unchanged) * 3;
+		if (unchanged)
+			dots = quiet - quiet % pass;
+		Timeline::advance(dots);
+		return true;
+	}
+
+	/*
+	* Step until the PPU finishes the frame in progress. A jammed CPU halts the
+	* whole console where it stands, so once one runs into a KIL this returns
+	* without finishing the frame, and from then on without doing anything.
+	*/
+	void runFrame()
+	{
+		if (CPU::jammed())
+			return;
+
+		uint32_t frame = PPU::getFrameCount();
+		uint16_t pc = CPU::getProgramCounter();
+		while (PPU::getFrameCount() == frame)
+		{
+			if (!step())
+			{
+				Timeline::catchUp(); // The PPU stops where the CPU did.
+				return;
+			}
+
+			// Loops are closed by jumping back, so only then look for one that waits.
+			uint16_t previous = pc;
+			pc = CPU::getProgramCounter();
+			if (pc <= previous && idleSkip && PPU::getFrameCount() == frame && skipIdle())
+				pc = CPU::getProgramCounter();
+		}
+	}
+
+	/*
+	* Whether runFrame() skips through loops that only wait. It makes no
+	* difference to anything but speed; turning it off is for checking that.
+	*/
+	void setIdleSkip(bool enabled)
+	{
+		idleSkip = enabled;
+	}
+}
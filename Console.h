@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+* Ties the CPU, PPU and APU together on one timeline.
+*/
+namespace Console
+{
+	void power();
+	bool step();
+	void runFrame();
+	void setIdleSkip(bool enabled);
+}
@@ -0,0 +1,73 @@
+#include "Controller.h"
+
+namespace Controller
+{
+	thread_local uint8_t buttons[2] = { 0, 0 }; // Held buttons, bit 0 = A ... bit 7 = Right
+	thread_local uint8_t shift[2] = { 0, 0 };
+	thread_local uint8_t strobe = 0;
+	thread_local void (*poll)() = nullptr;
+
+	void setButtons(int port, uint8_t value)
+	{
+		buttons[port] = value;
+	}
+
+	/*
+	* Just-in-time input: called whenever the game raises the strobe, right
+	* before the buttons are latched, to set them from the freshest input. Only
+	* for live play; movies and run-ahead need the buttons fixed per frame.
+	*/
+	void setPoller(void (*poller)())
+	{
+		poll = poller;
+	}
+
+	uint8_t getButtons(int port)
+	{
+		return buttons[port];
+	}
+
+	/*
+	* Shift out the next button, A first. After all eight have been read the
+	* register is filled with 1s, like an official controller.
+	* Bits 5-7 are open bus, which is normally the $40 of the address high byte.
+	*/
+	uint8_t read(int port)
+	{
+		if (strobe)
+			shift[port] = buttons[port];
+
+		uint8_t value = shift[port] & 1;
+		shift[port] = (shift[port] >> 1) | 0x80;
+		return 0x40 | value;
+	}
+
+	/*
+	* While bit 0 of $4016 is high both controllers continuously reload their shift registers.
+	*/
+	void write(uint8_t value)
+	{
+		strobe = value & 1;
+		if (strobe)
+		{
+			if (poll)
+				poll();
+			shift[0] = buttons[0];
+			shift[1] = buttons[1];
+		}
+	}
+
+	void save(state_s& state)
+	{
+		state.shift[0] = shift[0];
+		state.shift[1] = shift[1];
+		state.strobe = strobe;
+	}
+
+	void load(const state_s& state)
+	{
+		shift[0] = state.shift[0];
+		shift[1] = state.shift[1];
+		strobe = state.strobe;
+	}
+}
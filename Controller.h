@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+* Standard controllers on $4016/$4017.
+*/
+namespace Controller
+{
+	typedef enum {
+		BUTTON_A      = 0x01,
+		BUTTON_B      = 0x02,
+		BUTTON_SELECT = 0x04,
+		BUTTON_START  = 0x08,
+		BUTTON_UP     = 0x10,
+		BUTTON_DOWN   = 0x20,
+		BUTTON_LEFT   = 0x40,
+		BUTTON_RIGHT  = 0x80
+	} button_e;
+
+	/*
+	* Latched shift registers. The buttons currently held are input, not state.
+	*/
+	typedef struct {
+		uint8_t shift[2];
+		uint8_t strobe;
+	} state_s;
+
+	void setButtons(int port, uint8_t buttons);
+	void setPoller(void (*poller)());
+	uint8_t getButtons(int port);
+	uint8_t read(int port);
+	void write(uint8_t value);
+
+	void save(state_s& state);
+	void load(const state_s& state);
+}
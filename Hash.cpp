@@ -0,0 +1,62 @@
+#include "Hash.h"
+
+namespace Hash
+{
+	/*
+	* The byte-at-a-time lookup table for the reflected 0xEDB88320 polynomial,
+	* built on first use. A function-local static, so threads that all start
+	* hashing at once wait for one build instead of racing on it.
+	*/
+	const uint32_t* table()
+	{
+		static const struct table_s {
+			uint32_t entries[256];
+			table_s()
+			{
+				for (uint32_t i = 0; i < 256; ++i)
+				{
+					uint32_t c = i;
+					for (int k = 0; k < 8; ++k)
+						c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+					entries[i] = c;
+				}
+			}
+		} built;
+		return built.entries;
+	}
+
+	/*
+	* Standard CRC-32 (same as zlib), chainable by passing the previous result as crc.
+	*/
+	uint32_t crc32(const uint8_t* data, size_t length, uint32_t crc)
+	{
+		const uint32_t* lookup = table();
+		crc = ~crc;
+		for (size_t i = 0; i < length; ++i)
+			crc = lookup[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		return ~crc;
+	}
+
+	/*
+	* Adler-32, the checksum that closes a zlib stream.
+	*/
+	uint32_t adler32(const uint8_t* data, size_t length)
+	{
+		uint32_t a = 1, b = 0;
+		while (length)
+		{
+			// 5552 bytes is the most that can be summed before b could overflow.
+			size_t block = length < 5552 ? length : 5552;
+			for (size_t i = 0; i < block; ++i)
+			{
+				a += data[i];
+				b += a;
+			}
+			a %= 65521;
+			b %= 65521;
+			data += block;
+			length -= block;
+		}
+		return b << 16 | a;
+	}
+}
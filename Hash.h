@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace Hash
+{
+	uint32_t crc32(const uint8_t* data, size_t length, uint32_t crc = 0);
+	uint32_t adler32(const uint8_t* data, size_t length);
+}
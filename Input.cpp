@@ -0,0 +1,216 @@
+#include "Input.h"
+#include "Controller.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+namespace Input
+{
+	typedef struct {
+		SDL_Scancode key;
+		SDL_GameControllerButton pad;
+	} binding_s;
+
+	const char* buttonNames[8] = { "A", "B", "SELECT", "START", "UP", "DOWN", "LEFT", "RIGHT" };
+
+	/*
+	* By button bit, A first. Pads follow the NES layout, so the face button
+	* on the right is A and the one below it is B.
+	*/
+	binding_s bindings[2][8] = {
+		{
+			{ SDL_SCANCODE_X, SDL_CONTROLLER_BUTTON_B },
+			{ SDL_SCANCODE_Z, SDL_CONTROLLER_BUTTON_A },
+			{ SDL_SCANCODE_RSHIFT, SDL_CONTROLLER_BUTTON_BACK },
+			{ SDL_SCANCODE_RETURN, SDL_CONTROLLER_BUTTON_START },
+			{ SDL_SCANCODE_UP, SDL_CONTROLLER_BUTTON_DPAD_UP },
+			{ SDL_SCANCODE_DOWN, SDL_CONTROLLER_BUTTON_DPAD_DOWN },
+			{ SDL_SCANCODE_LEFT, SDL_CONTROLLER_BUTTON_DPAD_LEFT },
+			{ SDL_SCANCODE_RIGHT, SDL_CONTROLLER_BUTTON_DPAD_RIGHT }
+		},
+		{
+			{ SDL_SCANCODE_UNKNOWN, SDL_CONTROLLER_BUTTON_B },
+			{ SDL_SCANCODE_UNKNOWN, SDL_CONTROLLER_BUTTON_A },
+			{ SDL_SCANCODE_UNKNOWN, SDL_CONTROLLER_BUTTON_BACK },
+			{ SDL_SCANCODE_UNKNOWN, SDL_CONTROLLER_BUTTON_START },
+			{ SDL_SCANCODE_UNKNOWN, SDL_CONTROLLER_BUTTON_DPAD_UP },
+			{ SDL_SCANCODE_UNKNOWN, SDL_CONTROLLER_BUTTON_DPAD_DOWN },
+			{ SDL_SCANCODE_UNKNOWN, SDL_CONTROLLER_BUTTON_DPAD_LEFT },
+			{ SDL_SCANCODE_UNKNOWN, SDL_CONTROLLER_BUTTON_DPAD_RIGHT }
+		}
+	};
+
+	SDL_GameController* pads[2] = { nullptr, nullptr }; // Ports take pads in the order they are connected.
+	const Sint16 stickThreshold = 16000; // The left stick also works as the d-pad past this.
+
+	uint32_t pressTimestamp = 0; // When a bound button last went down, for latency measurement
+
+	/*
+	* Pads plugged in before startup also arrive as SDL_CONTROLLERDEVICEADDED,
+	* so a device that already has a port is left where it is.
+	*/
+	void openPad(int device)
+	{
+		if (!SDL_IsGameController(device))
+			return;
+		SDL_JoystickID id = SDL_JoystickGetDeviceInstanceID(device);
+		for (SDL_GameController* pad : pads)
+		{
+			if (pad && SDL_JoystickInstanceID(SDL_GameControllerGetJoystick(pad)) == id)
+				return;
+		}
+		for (SDL_GameController*& pad : pads)
+		{
+			if (!pad)
+			{
+				pad = SDL_GameControllerOpen(device);
+				return;
+			}
+		}
+	}
+
+	/*
+	* Needs SDL_INIT_GAMECONTROLLER. Pads already plugged in are opened here;
+	* later ones arrive as SDL_CONTROLLERDEVICEADDED.
+	*/
+	void initialize()
+	{
+		for (int device = 0; device < SDL_NumJoysticks(); ++device)
+			openPad(device);
+	}
+
+	/*
+	* Lines of "<port> <button> key <SDL scancode name>" or
+	* "<port> <button> pad <SDL controller button name>", e.g. "1 A key X" or
+	* "2 START pad start". Ports are 1 and 2; # starts a comment.
+	*/
+	bool loadMapping(const char* filename)
+	{
+		FILE* f;
+#ifdef _MSC_VER
+		fopen_s(&f, filename, "r");
+#else
+		f = fopen(filename, "r");
+#endif
+		if (!f)
+		{
+			std::cerr << "Could not open input mapping: " << filename << std::endl;
+			return false;
+		}
+
+		bool ok = true;
+		char line[256];
+		for (int number = 1; fgets(line, sizeof(line), f); ++number)
+		{
+			char button[16], kind[8], name[64];
+			int port;
+			if (line[0] == '#' || strspn(line, " \t\r\n") == strlen(line))
+				continue;
+			if (sscanf(line, "%d %15s %7s %63[^\r\n]", &port, button, kind, name) != 4 || port < 1 || port > 2)
+			{
+				std::cerr << filename << ":" << number << ": expected <port> <button> key|pad <name>" << std::endl;
+				ok = false;
+				continue;
+			}
+
+			int bit = 0;
+			while (bit < 8 && strcmp(button, buttonNames[bit]) != 0)
+				++bit;
+			binding_s* binding = bit < 8 ? &bindings[port - 1][bit] : nullptr;
+
+			if (binding && strcmp(kind, "key") == 0 && SDL_GetScancodeFromName(name) != SDL_SCANCODE_UNKNOWN)
+				binding->key = SDL_GetScancodeFromName(name);
+			else if (binding && strcmp(kind, "pad") == 0 && SDL_GameControllerGetButtonFromString(name) != SDL_CONTROLLER_BUTTON_INVALID)
+				binding->pad = SDL_GameControllerGetButtonFromString(name);
+			else
+			{
+				std::cerr << filename << ":" << number << ": unknown button, key or pad button" << std::endl;
+				ok = false;
+			}
+		}
+		fclose(f);
+		return ok;
+	}
+
+	bool isBoundKey(SDL_Scancode key)
+	{
+		for (const auto& port : bindings)
+			for (const binding_s& binding : port)
+				if (binding.key == key)
+					return true;
+		return false;
+	}
+
+	/*
+	* Track pads coming and going and note bound presses. False for events
+	* this module doesn't deal with.
+	*/
+	bool handleEvent(const SDL_Event& event)
+	{
+		switch (event.type)
+		{
+		case SDL_CONTROLLERDEVICEADDED:
+			openPad(event.cdevice.which);
+			return true;
+		case SDL_CONTROLLERDEVICEREMOVED:
+			for (SDL_GameController*& pad : pads)
+			{
+				if (pad && SDL_JoystickInstanceID(SDL_GameControllerGetJoystick(pad)) == event.cdevice.which)
+				{
+					SDL_GameControllerClose(pad);
+					pad = nullptr;
+				}
+			}
+			return true;
+		case SDL_KEYDOWN:
+			if (!event.key.repeat && isBoundKey(event.key.keysym.scancode))
+				pressTimestamp = event.key.timestamp;
+			return true;
+		case SDL_CONTROLLERBUTTONDOWN:
+			pressTimestamp = event.cbutton.timestamp;
+			return true;
+		case SDL_KEYUP:
+		case SDL_CONTROLLERBUTTONUP:
+		case SDL_CONTROLLERAXISMOTION:
+			return true;
+		}
+		return false;
+	}
+
+	/*
+	* Buttons held right now on a port, from SDL's current keyboard and pad state.
+	*/
+	uint8_t poll(int port)
+	{
+		const Uint8* keys = SDL_GetKeyboardState(NULL);
+		SDL_GameController* pad = pads[port];
+		uint8_t buttons = 0;
+
+		for (int bit = 0; bit < 8; ++bit)
+		{
+			const binding_s& binding = bindings[port][bit];
+			if ((binding.key != SDL_SCANCODE_UNKNOWN && keys[binding.key]) || (pad && SDL_GameControllerGetButton(pad, binding.pad)))
+				buttons |= 1 << bit;
+		}
+
+		if (pad)
+		{
+			Sint16 x = SDL_GameControllerGetAxis(pad, SDL_CONTROLLER_AXIS_LEFTX);
+			Sint16 y = SDL_GameControllerGetAxis(pad, SDL_CONTROLLER_AXIS_LEFTY);
+			buttons |= (y < -stickThreshold ? Controller::BUTTON_UP : 0) | (y > stickThreshold ? Controller::BUTTON_DOWN : 0)
+				| (x < -stickThreshold ? Controller::BUTTON_LEFT : 0) | (x > stickThreshold ? Controller::BUTTON_RIGHT : 0);
+		}
+		return buttons;
+	}
+
+	/*
+	* SDL timestamp (ms) of the latest bound press not yet taken, or 0.
+	*/
+	uint32_t takePress()
+	{
+		uint32_t timestamp = pressTimestamp;
+		pressTimestamp = 0;
+		return timestamp;
+	}
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "SDL.h"
+
+#include <cstdint>
+
+/*
+* SDL input for both controller ports: the keyboard and up to two game
+* controllers, through bindings that a mapping file can replace. Frontend
+* only; the cores see nothing but Controller::setButtons().
+*/
+namespace Input
+{
+	void initialize();
+	bool loadMapping(const char* filename);
+	bool handleEvent(const SDL_Event& event);
+	uint8_t poll(int port);
+	uint32_t takePress();
+}
@@ -0,0 +1,195 @@
+#include "Lockstep.h"
+#include "Console.h"
+#include "Savestate.h"
+#include "Hash.h"
+#include "Movie.h"
+#include "PPU.h"
+
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+namespace Lockstep
+{
+	void scanlineStep()
+	{
+		PPU::setBackend(PPU::SCANLINE);
+		Console::step();
+	}
+
+	void dotStep()
+	{
+		PPU::setBackend(PPU::DOT);
+		Console::step();
+	}
+
+	/*
+	* Every CPU/PPU implementation that can take part in a lockstep run:
+	* the switch-dispatched CPU with the scanline PPU, and with the dot PPU.
+	*/
+	const core_s cores[] = {
+		{ "switch", scanlineStep },
+		{ "dot", dotStep },
+	};
+
+	const core_s* findCore(const char* name)
+	{
+		for (const core_s& core : cores)
+		{
+			if (strcmp(core.name, name) == 0)
+				return &core;
+		}
+		return nullptr;
+	}
+
+	void listCores()
+	{
+		for (const core_s& core : cores)
+			std::cout << "  " << core.name << std::endl;
+	}
+
+	/*
+	* Fixed-size ring of the most recent instructions.
+	*/
+	class TraceWindow
+	{
+		std::vector<trace_s> entries;
+		size_t next = 0;
+		size_t count = 0;
+
+	public:
+		TraceWindow(int depth) : entries(depth > 0 ? depth : 1) {}
+
+		void push(const trace_s& entry)
+		{
+			entries[next] = entry;
+			next = (next + 1) % entries.size();
+			if (count < entries.size())
+				++count;
+		}
+
+		void print(const char* name) const
+		{
+			std::cout << "--- " << name << " (last " << count << " instructions) ---" << std::endl;
+			std::cout << " frame  PC   op  A  X  Y  P  SP" << std::endl;
+			for (size_t i = 0; i < count; ++i)
+			{
+				const trace_s& t = entries[(next + entries.size() - count + i) % entries.size()];
+				std::cout << std::setfill(' ') << std::dec << std::setw(6) << t.frame << std::hex << std::setfill('0')
+					<< "  " << std::setw(4) << (int)t.regs.PC
+					<< " " << std::setw(2) << (int)t.opcode
+					<< "  " << std::setw(2) << (int)t.regs.accum
+					<< " " << std::setw(2) << (int)t.regs.x_reg
+					<< " " << std::setw(2) << (int)t.regs.y_reg
+					<< " " << std::setw(2) << (int)t.regs.status
+					<< " " << std::setw(2) << (int)t.regs.SP << std::endl;
+			}
+			std::cout << std::dec << std::setfill(' ');
+		}
+	};
+
+	bool sameRegisters(const CPU::registers_s& a, const CPU::registers_s& b)
+	{
+		return a.PC == b.PC && a.SP == b.SP && a.accum == b.accum
+			&& a.x_reg == b.x_reg && a.y_reg == b.y_reg && a.status == b.status;
+	}
+
+	/*
+	* Run both cores from the current console state for the given number of frames,
+	* feeding both the same movie input if one is playing.
+	* Returns false on the first divergence. Afterwards the console is left in core a's state.
+	*/
+	bool run(const core_s& a, const core_s& b, uint32_t frames, int traceDepth)
+	{
+		const core_s* core[2] = { &a, &b };
+		Savestate::Snapshot states[2];
+		std::vector<uint8_t> framebuffers[2];
+		TraceWindow traces[2] = { TraceWindow(traceDepth), TraceWindow(traceDepth) };
+		CPU::registers_s regs[2];
+		uint32_t frameCount[2];
+		uint32_t ramCrc[2] = { 0, 0 };
+		uint32_t frameCrc[2] = { 0, 0 };
+
+		uint8_t* output = PPU::getFramebuffer();
+		PPU::backend_e backend = PPU::getBackend();
+		Savestate::save(states[0]);
+		states[1] = states[0];
+		for (int c = 0; c < 2; ++c)
+			framebuffers[c].assign(output, output + PPU_WIDTH * PPU_HEIGHT);
+
+		uint32_t frame = PPU::getFrameCount();
+		uint32_t lastFrame = frame + frames;
+		uint64_t instructions = 0;
+		bool diverged = false;
+
+		Movie::frame();
+		while (!diverged && frame < lastFrame)
+		{
+			for (int c = 0; c < 2; ++c)
+			{
+				Savestate::load(states[c]);
+				PPU::setFramebuffer(framebuffers[c].data());
+
+				trace_s entry;
+				entry.frame = PPU::getFrameCount();
+				entry.regs = CPU::getRegisters();
+				entry.opcode = CPU::peek(entry.regs.PC);
+				traces[c].push(entry);
+
+				core[c]->step();
+
+				regs[c] = CPU::getRegisters();
+				frameCount[c] = PPU::getFrameCount();
+				if (frameCount[c] != frame)
+				{
+					ramCrc[c] = Hash::crc32(CPU::getRam(), 0x800);
+					frameCrc[c] = Hash::crc32(framebuffers[c].data(), PPU_WIDTH * PPU_HEIGHT);
+				}
+				Savestate::save(states[c]);
+			}
+			++instructions;
+
+			if (!sameRegisters(regs[0], regs[1]))
+			{
+				std::cout << "Lockstep: registers diverged after instruction " << instructions << std::endl;
+				diverged = true;
+			}
+			else if (frameCount[0] != frameCount[1])
+			{
+				std::cout << "Lockstep: frame timing diverged after instruction " << instructions
+					<< " (" << frameCount[0] << " vs " << frameCount[1] << ")" << std::endl;
+				diverged = true;
+			}
+			else if (frameCount[0] != frame)
+			{
+				if (ramCrc[0] != ramCrc[1] || frameCrc[0] != frameCrc[1])
+				{
+					std::cout << "Lockstep: " << (ramCrc[0] != ramCrc[1] ? "RAM" : "framebuffer")
+						<< " diverged at end of frame " << frame << std::endl;
+					diverged = true;
+				}
+				frame = frameCount[0];
+				if (frame < lastFrame)
+					Movie::frame(); // Both cores see the same input for the next frame.
+			}
+		}
+
+		if (diverged)
+		{
+			traces[0].print(a.name);
+			traces[1].print(b.name);
+		}
+		else
+		{
+			std::cout << "Lockstep: " << a.name << " and " << b.name << " agree over "
+				<< frames << " frames (" << instructions << " instructions)" << std::endl;
+		}
+
+		Savestate::load(states[0]);
+		memcpy(output, framebuffers[0].data(), PPU_WIDTH * PPU_HEIGHT);
+		PPU::setFramebuffer(output);
+		PPU::setBackend(backend);
+		return !diverged;
+	}
+}
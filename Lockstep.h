@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+
+#include "CPU.h"
+
+/*
+* Differential execution: two cores run the same console side by side and are
+* compared after every instruction (registers) and every frame (RAM and
+* framebuffer CRCs). The first divergence stops the run and dumps the last few
+* instructions of each core.
+*/
+namespace Lockstep
+{
+	typedef struct {
+		const char* name;
+		void (*step)(); // Execute one instruction and the PPU dots that go with it.
+	} core_s;
+
+	typedef struct {
+		uint32_t frame;
+		uint8_t opcode;
+		CPU::registers_s regs; // Registers before the instruction executed.
+	} trace_s;
+
+	const core_s* findCore(const char* name);
+	void listCores();
+	bool run(const core_s& a, const core_s& b, uint32_t frames, int traceDepth);
+}
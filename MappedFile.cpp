@@ -0,0 +1,121 @@
+#include "MappedFile.h"
+
+#include <chrono>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+/*
+* Map the first `length` bytes of a file, creating or zero-extending it as
+* needed. Changes are flushed every flushSeconds while dirty.
+*/
+bool MappedFile::open(const std::string& path, size_t length, int flushSeconds)
+{
+	close();
+
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		file = nullptr;
+		return false;
+	}
+
+	// A mapping larger than the file grows it, zero-filled.
+	mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, (DWORD)length, NULL);
+	if (mapping)
+		data = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, length);
+	if (!data)
+	{
+		if (mapping)
+			CloseHandle(mapping);
+		CloseHandle(file);
+		mapping = nullptr;
+		file = nullptr;
+		return false;
+	}
+#else
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	void* view = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && ((size_t)info.st_size >= length || ftruncate(fd, length) == 0))
+		view = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (view == MAP_FAILED)
+	{
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+	data = (uint8_t*)view;
+#endif
+
+	size = length;
+	dirty = false;
+	stopping = false;
+	flusher = std::thread([this, flushSeconds] {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!wake.wait_for(lock, std::chrono::seconds(flushSeconds > 0 ? flushSeconds : 1), [this] { return stopping; }))
+		{
+			if (dirty.exchange(false))
+				flush(false);
+		}
+	});
+	return true;
+}
+
+/*
+* Hand the mapped pages to the OS for writing; with wait, also block until
+* they are on disk.
+*/
+void MappedFile::flush(bool wait)
+{
+#ifdef _WIN32
+	FlushViewOfFile(data, size);
+	if (wait)
+		FlushFileBuffers(file);
+#else
+	msync(data, size, wait ? MS_SYNC : MS_ASYNC);
+#endif
+}
+
+void MappedFile::close()
+{
+	if (!data)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_one();
+	flusher.join();
+	flush(true);
+
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+	CloseHandle(mapping);
+	CloseHandle(file);
+	mapping = nullptr;
+	file = nullptr;
+#else
+	munmap(data, size);
+	::close(fd);
+	fd = -1;
+#endif
+	data = nullptr;
+	size = 0;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+* A file mapped read/write into memory, e.g. battery-backed RAM kept in a
+* .sav file. Writers only call markDirty(); a background thread hands dirty
+* pages to the OS every few seconds with an asynchronous flush, so the file
+* survives a crash without a syscall per write. close() flushes synchronously.
+*/
+class MappedFile
+{
+	uint8_t* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	void* file = nullptr; // HANDLEs, kept out of the header to avoid windows.h
+	void* mapping = nullptr;
+#else
+	int fd = -1;
+#endif
+
+	std::atomic<bool> dirty{ false };
+	std::thread flusher;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	void flush(bool wait);
+
+public:
+	MappedFile() = default;
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile();
+
+	bool open(const std::string& path, size_t length, int flushSeconds);
+	void close();
+
+	uint8_t* get() { return data; }
+	void markDirty() { dirty.store(true, std::memory_order_relaxed); }
+};
@@ -1,19 +1,26 @@
 #pragma once
 #include "Mapper.h"
+#include "Cartridge.h"
 
-Mapper::Mapper(uint8_t* rom) : rom(rom)
+#include <cstring>
+
+Mapper::Mapper(uint8_t* rom, const Cartridge::header_s& header) : rom(rom), batteryBacked(header.battery)
 {
-	// Read infos from header
-	prgSize = rom[4] * 0x4000;
-	chrSize = rom[5] * 0x2000;
-	prgRamSize = rom[8] ? rom[8] * 0x2000 : 0x2000;
-	
-	this->prg = &rom[0] + 16;
-	this->prgRam = new uint8_t[prgRamSize];
+	// Sizes as Cartridge::parseHeader() read them, NES 2.0 fields included
+	prgSize = header.prgSize;
+	chrSize = header.chrSize;
+	prgRamSize = header.prgRamSize;
+
+	this->prg = &rom[0] + 16 + (header.trainer ? 512 : 0);
+	this->prgRam = new uint8_t[prgRamSize]();
+
+	// A trainer goes to $7000, where copiers loaded it
+	if(header.trainer)
+		memcpy(prgRam + 0x1000, &rom[0] + 16, 512);
 
 	// CHR ROM:
 	if(chrSize)
-		this->chr = &rom[0] + 16 + prgSize;
+		this->chr = prg + prgSize;
 	// CHR RAM:
 	else
 	{
@@ -21,14 +28,21 @@ Mapper::Mapper(uint8_t* rom) : rom(rom)
 		chrSize = 0x2000;
 		this->chr = new uint8_t[chrSize];
 	}
+
+	// Nametable arrangement, until the mapper changes it
+	set_mirroring(header.mirroring);
 }
 
 Mapper::~Mapper()
 {
-	delete rom;
-	delete prgRam;
+	delete[] rom;
+	if(battery)
+		delete battery;
+	else
+		delete[] prgRam;
+	delete[] shadow;
 	if(chrRam)
-		delete chr;
+		delete[] chr;
 }
 
 /* Access to memory */
@@ -41,11 +55,123 @@ uint8_t Mapper::read(uint16_t addr)
 		return prgRam[addr - 0x6000];
 }
 
+/* $6000-$7FFF; a store and a flag, the save file is flushed in the background */
+void Mapper::prg_ram_write(uint16_t addr, uint8_t v)
+{
+	prgRam[addr - 0x6000] = v;
+	if(battery && prgRam != shadow)
+		battery->markDirty();
+}
+
+bool Mapper::has_battery()
+{
+	return batteryBacked;
+}
+
+/* Swap prgRam for a mapping of the save file, which keeps whatever a previous run left in it */
+bool Mapper::map_battery(const char* path, int flushSeconds)
+{
+	MappedFile* file = new MappedFile();
+	if(!file->open(path, prgRamSize, flushSeconds))
+	{
+		delete file;
+		return false;
+	}
+
+	if(battery)
+		delete battery;
+	else
+		delete[] prgRam;
+	battery = file;
+	prgRam = battery->get();
+	return true;
+}
+
+/* Carry on in a private copy of the save; the file keeps what it has until end_speculation() */
+void Mapper::detach_battery()
+{
+	if(!shadow)
+		shadow = new uint8_t[prgRamSize];
+	if(prgRam != shadow)
+	{
+		memcpy(shadow, prgRam, prgRamSize);
+		prgRam = shadow;
+	}
+}
+
+void Mapper::begin_speculation()
+{
+	if(battery)
+		detach_battery();
+}
+
+/* Back to the file, as it was when speculation began: whatever ran since is dropped */
+void Mapper::end_speculation()
+{
+	if(battery)
+		prgRam = battery->get();
+}
+
 uint8_t Mapper::chr_read(uint16_t addr)
 {
 	return chr[chrMap[addr / 0x400] + (addr % 0x400)];
 }
 
+uint8_t Mapper::chr_write(uint16_t addr, uint8_t v)
+{
+	if(chrRam)
+		chr[chrMap[addr / 0x400] + (addr % 0x400)] = v;
+	return v;
+}
+
+/* Nametable mirroring, owned by the PPU and saved with it */
+void Mapper::set_mirroring(PPU::mirroring_e mode)
+{
+	PPU::setMirroring(mode);
+}
+
+/* Registers */
+uint32_t Mapper::register_size()
+{
+	return sizeof(prgMap) + sizeof(chrMap);
+}
+
+void Mapper::save_registers(uint8_t* out)
+{
+	memcpy(out, prgMap, sizeof(prgMap)); out += sizeof(prgMap);
+	memcpy(out, chrMap, sizeof(chrMap));
+}
+
+void Mapper::load_registers(const uint8_t* in)
+{
+	memcpy(prgMap, in, sizeof(prgMap)); in += sizeof(prgMap);
+	memcpy(chrMap, in, sizeof(chrMap));
+}
+
+/* Savestates */
+uint32_t Mapper::state_size()
+{
+	return register_size() + prgRamSize + (chrRam ? chrSize : 0);
+}
+
+void Mapper::save(uint8_t* out)
+{
+	save_registers(out); out += register_size();
+	memcpy(out, prgRam, prgRamSize); out += prgRamSize;
+	if(chrRam)
+		memcpy(out, chr, chrSize);
+}
+
+void Mapper::load(const uint8_t* in)
+{
+	load_registers(in); in += register_size();
+	if(battery)
+		detach_battery(); // A loaded state is not the player's save; only end_speculation() goes back to the file.
+	memcpy(prgRam, in, prgRamSize); in += prgRamSize;
+	if(chrRam)
+		memcpy(chr, in, chrSize);
+}
+
 /* PRG mapping functions */
 template <int pageKBs> void Mapper::map_prg(int slot, int bank)
 {
@@ -1,32 +1,61 @@
 #pragma once
 #include <cstdint>
 
+#include "MappedFile.h"
+#include "PPU.h"
+
 /* --- ADAPTED FROM https://github.com/AndreaOrru/LaiNES/blob/master/src/include/mapper.hpp */
 
+namespace Cartridge { struct header_s; }
+
 class Mapper
 {
 	uint8_t* rom;
 	bool chrRam = false;
+	bool batteryBacked;
+	MappedFile* battery = nullptr; // Backs prgRam when the cart's RAM is saved to a file
+	uint8_t* shadow = nullptr; // Private copy prgRam points at instead while the file must not see writes
+
+	void detach_battery();
 
 protected:
 	uint32_t prgMap[4];
-	uint32_t chrMap[4];
+	uint32_t chrMap[8];
 
 	uint8_t *prg, *chr, *prgRam;
 	uint32_t prgSize, chrSize, prgRamSize;
 
 	template<int pageKBs> void map_prg(int slot, int bank);
 	template<int pageKBs> void map_chr(int slot, int bank);
+	void set_mirroring(PPU::mirroring_e mode);
 
 public:
-	Mapper(uint8_t *rom);
-	~Mapper();
+	Mapper(uint8_t *rom, const Cartridge::header_s& header);
+	virtual ~Mapper();
 
 	uint8_t read(uint16_t addr);
 	virtual uint8_t write(uint16_t addr, uint8_t v) { return v; };
+	void prg_ram_write(uint16_t addr, uint8_t v);
+
+	/* Battery-backed PRG RAM (iNES flags 6 bit 1), kept in a memory-mapped save file */
+	bool has_battery();
+	bool map_battery(const char* path, int flushSeconds);
+	/* Frames run only to be rewound: writes and loads in between go to a private copy, the file keeps the real save */
+	void begin_speculation();
+	void end_speculation();
 
 	uint8_t chr_read(uint16_t addr);
-	virtual uint8_t chr_write(uint16_t addr, uint8_t v) { return v; };
+	virtual uint8_t chr_write(uint16_t addr, uint8_t v);
 
 	virtual void signal_scanline() {};
+
+	/* Registers only: bank mapping plus any control state, small enough to swap per instruction */
+	virtual uint32_t register_size();
+	virtual void save_registers(uint8_t* out);
+	virtual void load_registers(const uint8_t* in);
+
+	/* Savestates: registers plus any writable PRG/CHR RAM */
+	uint32_t state_size();
+	void save(uint8_t* out);
+	void load(const uint8_t* in);
 };
\ No newline at end of file
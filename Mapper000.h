@@ -4,9 +4,9 @@
 class Mapper000 : public Mapper
 {
 public:
-	Mapper000(uint8_t *rom) : Mapper(rom)
+	Mapper000(uint8_t *rom, const Cartridge::header_s& header) : Mapper(rom, header)
 	{
 		map_prg<32>(0, 0);
-		map_chr<4>(0, 0);
+		map_chr<8>(0, 0);
 	}
 };
\ No newline at end of file
@@ -1,12 +1,107 @@
 #pragma once
 #include "Mapper001.h"
 
+#include <cstring>
 
-Mapper001::Mapper001(uint8_t *rom) : Mapper(rom)
+Mapper001::Mapper001(uint8_t *rom, const Cartridge::header_s& header) : Mapper(rom, header)
 {
+	regs[0] = 0x0C;
+	writeN = tmpReg = regs[1] = regs[2] = regs[3] = 0;
+	apply();
 }
 
 
 Mapper001::~Mapper001()
 {
 }
+
+/* Rebuild the bank and nametable mapping from the registers */
+void Mapper001::apply()
+{
+	// 16KB PRG:
+	if(regs[0] & 0x08)
+	{
+		// 0x8000 swappable, 0xC000 fixed to the last bank:
+		if(regs[0] & 0x04)
+		{
+			map_prg<16>(0, regs[3] & 0xF);
+			map_prg<16>(1, -1);
+		}
+		// 0x8000 fixed to the first bank, 0xC000 swappable:
+		else
+		{
+			map_prg<16>(0, 0);
+			map_prg<16>(1, regs[3] & 0xF);
+		}
+	}
+	// 32KB PRG:
+	else
+		map_prg<32>(0, (regs[3] & 0xF) >> 1);
+
+	// 4KB CHR:
+	if(regs[0] & 0x10)
+	{
+		map_chr<4>(0, regs[1]);
+		map_chr<4>(1, regs[2]);
+	}
+	// 8KB CHR:
+	else
+		map_chr<8>(0, regs[1] >> 1);
+
+	switch(regs[0] & 0x03)
+	{
+	case 0: set_mirroring(PPU::SINGLE_SCREEN_LOWER); break;
+	case 1: set_mirroring(PPU::SINGLE_SCREEN_UPPER); break;
+	case 2: set_mirroring(PPU::VERTICAL); break;
+	case 3: set_mirroring(PPU::HORIZONTAL); break;
+	}
+}
+
+uint8_t Mapper001::write(uint16_t addr, uint8_t v)
+{
+	// PRG RAM write:
+	if(addr < 0x8000)
+		prg_ram_write(addr, v);
+	// Reset the shift register:
+	else if(v & 0x80)
+	{
+		writeN = 0;
+		tmpReg = 0;
+		regs[0] |= 0x0C;
+		apply();
+	}
+	// Shift one bit in, LSB first; the fifth write selects the register by address:
+	else
+	{
+		tmpReg = ((v & 1) << 4) | (tmpReg >> 1);
+		if(++writeN == 5)
+		{
+			regs[(addr >> 13) & 0x03] = tmpReg;
+			writeN = tmpReg = 0;
+			apply();
+		}
+	}
+	return v;
+}
+
+/* Registers: the base mapping plus the serial port and control registers */
+uint32_t Mapper001::register_size()
+{
+	return Mapper::register_size() + sizeof(regs) + 2;
+}
+
+void Mapper001::save_registers(uint8_t* out)
+{
+	Mapper::save_registers(out); out += Mapper::register_size();
+	memcpy(out, regs, sizeof(regs)); out += sizeof(regs);
+	out[0] = tmpReg;
+	out[1] = (uint8_t)writeN;
+}
+
+void Mapper001::load_registers(const uint8_t* in)
+{
+	Mapper::load_registers(in); in += Mapper::register_size();
+	memcpy(regs, in, sizeof(regs)); in += sizeof(regs);
+	tmpReg = in[0];
+	writeN = in[1];
+}
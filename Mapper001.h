@@ -1,10 +1,24 @@
 #pragma once
 #include "Mapper.h"
 
+/*
+* MMC1 (SxROM): PRG/CHR banking and mirroring through a 5-bit serial port.
+*/
 class Mapper001 : public Mapper
 {
+	int writeN;
+	uint8_t tmpReg;
+	uint8_t regs[4];
+
+	void apply();
+
 public:
-	Mapper001(uint8_t *rom);
+	Mapper001(uint8_t *rom, const Cartridge::header_s& header);
 	~Mapper001();
-};
 
+	uint8_t write(uint16_t addr, uint8_t v);
+
+	uint32_t register_size();
+	void save_registers(uint8_t* out);
+	void load_registers(const uint8_t* in);
+};
@@ -0,0 +1,143 @@
+#include "Movie.h"
+#include "Cartridge.h"
+#include "Controller.h"
+#include "Savestate.h"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace Movie
+{
+	const char magic[4] = { 'N', 'E', 'S', 'M' };
+	const uint32_t version = 3; // 2: PPU state holds 64 fetched sprites, 3: chip states carry their sizes
+
+	typedef enum {
+		IDLE,
+		RECORDING,
+		PLAYING
+	} mode_e;
+
+	mode_e mode = IDLE;
+	std::string path;
+	Savestate::Snapshot start;
+	std::vector<uint8_t> input; // Port 1 and port 2 buttons, interleaved per frame.
+	uint32_t position = 0;
+
+	/*
+	* Start recording from the current console state. Nothing is written until stop().
+	*/
+	bool record(const char* filename)
+	{
+		if (!Cartridge::loaded())
+			return false;
+
+		path = filename;
+		Savestate::save(start);
+		input.clear();
+		position = 0;
+		mode = RECORDING;
+		return true;
+	}
+
+	/*
+	* Load a movie, check it was made with this ROM, and rewind the console to its start.
+	*/
+	bool play(const char* filename)
+	{
+		std::ifstream in(filename, std::ios::binary);
+		char fileMagic[4];
+		uint32_t fileVersion, romCrc, frames;
+
+		in.read(fileMagic, sizeof(fileMagic));
+		in.read((char*)&fileVersion, sizeof(fileVersion));
+		in.read((char*)&romCrc, sizeof(romCrc));
+		in.read((char*)&frames, sizeof(frames));
+		if (!in || std::string(fileMagic, 4) != std::string(magic, 4) || fileVersion != version)
+		{
+			std::cerr << "Not a movie file: " << filename << std::endl;
+			return false;
+		}
+		if (!Cartridge::loaded() || romCrc != Cartridge::crc())
+		{
+			std::cerr << "Movie was recorded with a different ROM: " << filename << std::endl;
+			return false;
+		}
+		if (!Savestate::read(in, start) || start.mapper.size() != Cartridge::mapper->state_size())
+		{
+			std::cerr << "Movie start state is corrupt: " << filename << std::endl;
+			return false;
+		}
+
+		input.resize(frames * 2);
+		in.read((char*)input.data(), input.size());
+		if (!in)
+		{
+			std::cerr << "Movie is truncated: " << filename << std::endl;
+			return false;
+		}
+
+		Savestate::load(start);
+		position = 0;
+		mode = PLAYING;
+		return true;
+	}
+
+	/*
+	* End recording or playback. A recording is written out here.
+	*/
+	void stop()
+	{
+		if (mode == RECORDING)
+		{
+			std::ofstream out(path, std::ios::binary);
+			uint32_t romCrc = Cartridge::crc();
+			uint32_t frames = (uint32_t)(input.size() / 2);
+
+			out.write(magic, sizeof(magic));
+			out.write((const char*)&version, sizeof(version));
+			out.write((const char*)&romCrc, sizeof(romCrc));
+			out.write((const char*)&frames, sizeof(frames));
+			Savestate::write(out, start);
+			out.write((const char*)input.data(), input.size());
+		}
+		mode = IDLE;
+	}
+
+	bool recording()
+	{
+		return mode == RECORDING;
+	}
+
+	bool playing()
+	{
+		return mode == PLAYING;
+	}
+
+	uint32_t length()
+	{
+		return (uint32_t)(input.size() / 2);
+	}
+
+	/*
+	* Call once before emulating each frame. Playback sets the controllers from the
+	* movie (releasing everything once it runs out); recording logs what is held.
+	*/
+	void frame()
+	{
+		if (mode == PLAYING)
+		{
+			bool inRange = position < length();
+			Controller::setButtons(0, inRange ? input[position * 2] : 0);
+			Controller::setButtons(1, inRange ? input[position * 2 + 1] : 0);
+			++position;
+		}
+		else if (mode == RECORDING)
+		{
+			input.push_back(Controller::getButtons(0));
+			input.push_back(Controller::getButtons(1));
+			++position;
+		}
+	}
+}
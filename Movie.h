@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+* Input movies: per-frame controller input for both ports, tied to a ROM by its
+* CRC and starting from a full console snapshot so playback is deterministic.
+*
+* File layout (little-endian):
+*   "NESM", version, ROM CRC-32, frame count, start snapshot (each chip state
+*   behind its size in bytes), then 2 bytes per frame.
+*/
+namespace Movie
+{
+	bool record(const char* filename);
+	bool play(const char* filename);
+	void stop();
+
+	bool recording();
+	bool playing();
+	uint32_t length();
+
+	void frame();
+}
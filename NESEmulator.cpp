@@ -1,5 +1,7 @@
 #include "SDL.h"
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 #include <iostream>
 #include <string>
 #include <fstream>
@@ -9,20 +11,68 @@
 #include "APU.h"
 #include "PPU.h"
 #include "CPU.h"
+#include "Capture.h"
 #include "Cartridge.h"
+#include "Console.h"
+#include "Controller.h"
+#include "Input.h"
+#include "Movie.h"
+#include "Netplay.h"
+#include "Ntsc.h"
+#include "Palette.h"
+#include "Savestate.h"
+#include "Scaler.h"
 
 #define WIDTH 256
 #define HEIGHT 240
 
+/*
+* Just-in-time input: read the devices at the moment the game latches its
+* controllers rather than once at the start of the frame.
+*/
+void pollJustInTime()
+{
+	SDL_PumpEvents();
+	Controller::setButtons(0, Input::poll(0));
+	Controller::setButtons(1, Input::poll(1));
+}
+
+/*
+* Run-ahead: emulate the real frame without drawing it, snapshot, then run
+* `frames` more frames with the same input and show the last one. The console
+* is rewound to the snapshot afterwards, so what is on screen reacts to input
+* `frames` frames sooner than the game itself would.
+*/
+void runFrameAhead(int frames, Savestate::Snapshot& snapshot)
+{
+	if (frames <= 0)
+	{
+		Console::runFrame();
+		return;
+	}
+
+	PPU::setSkipRender(true);
+	Console::runFrame();
+	Savestate::save(snapshot);
+	Cartridge::mapper->begin_speculation(); // The frames ahead never reach the save file.
+	for (int i = 1; i < frames; ++i)
+		Console::runFrame();
+	PPU::setSkipRender(false);
+	Console::runFrame();
+	Savestate::load(snapshot);
+	Cartridge::mapper->end_speculation();
+}
+
 int main(int argc, char* argv[])
 {
 	SDL_Event evt;
 	bool running = true;
 
-	int* pixels = new int[WIDTH * HEIGHT];
-	int pitch = WIDTH * 4;
+	void* pixels;
+	int pitch;
 
-	SDL_Init(SDL_INIT_VIDEO);
+	SDL_Init(SDL_INIT_VIDEO | SDL_INIT_GAMECONTROLLER);
+	Input::initialize();
 
 	SDL_Window* window = SDL_CreateWindow
 	("NES Emulator", // window's title
@@ -30,52 +80,245 @@ int main(int argc, char* argv[])
 		WIDTH * 2, HEIGHT * 2, // window's length and height in pixels  
 		SDL_WINDOW_OPENGL);
 
-	SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+	// Frames are paced by V-Sync.
+	SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+
+	//std::string filename("C:\\MyWork\\Super_mario_brothers.nes");
+	std::string filename("C:\\MyWork\\ex1.dasm.rom");
+	const char* recordMovie = nullptr;
+	const char* playMovie = nullptr;
+	int runAhead = 0;
+	PPU::backend_e backend = PPU::SCANLINE;
+	bool ntsc = false;
+	const char* capture = nullptr;
+	Capture::format_e captureFormat = Capture::Y4M;
+	int captureDepth = 8;
+	bool measureLatency = false;
+	bool batterySaves = true;
+	int saveFlushSeconds = 5;
+	Savestate::Snapshot ahead;
+	uint16_t netplayPort = 0;
+	const char* netplayPeer = nullptr;
+	int netplayPlayer = 1;
+	int maxRollback = 8;
+	int inputDelay = 0;
+	Netplay::Udp link;
+	Netplay::Session* netplay = nullptr;
+	uint32_t lastIdle = 0;
 
-	// Pixel manipulation through texture of the surface.
+	// NESEmulator [rom] [--record movie | --play movie] [--run-ahead frames] [--ppu scanline|dot] [--no-sprite-limit] [--palette file.pal] [--ntsc]
+	//             [--scaler nearest|nearestN|scale2x|scale3x|xbr-lite] [--capture file|- [--capture-format y4m|raw] [--capture-depth frames]]
+	//             [--input-map file] [--pad-db gamecontrollerdb.txt] [--latency] [--no-save | --save-flush seconds]
+	//             [--netplay local-port host:port [--player 1|2] [--rollback frames] [--input-delay frames]]
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+			recordMovie = argv[++i];
+		else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc)
+			playMovie = argv[++i];
+		else if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc)
+			runAhead = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--palette") == 0 && i + 1 < argc)
+			Palette::load(argv[++i]);
+		else if (strcmp(argv[i], "--ppu") == 0 && i + 1 < argc)
+			backend = strcmp(argv[++i], "dot") == 0 ? PPU::DOT : PPU::SCANLINE;
+		else if (strcmp(argv[i], "--no-sprite-limit") == 0)
+			PPU::setSpriteLimit(false);
+		else if (strcmp(argv[i], "--ntsc") == 0)
+			ntsc = true;
+		else if (strcmp(argv[i], "--scaler") == 0 && i + 1 < argc)
+			Scaler::select(argv[++i]);
+		else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+			capture = argv[++i];
+		else if (strcmp(argv[i], "--capture-format") == 0 && i + 1 < argc)
+			captureFormat = strcmp(argv[++i], "raw") == 0 ? Capture::RAW : Capture::Y4M;
+		else if (strcmp(argv[i], "--capture-depth") == 0 && i + 1 < argc)
+			captureDepth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--input-map") == 0 && i + 1 < argc)
+			Input::loadMapping(argv[++i]);
+		else if (strcmp(argv[i], "--pad-db") == 0 && i + 1 < argc)
+			SDL_GameControllerAddMappingsFromFile(argv[++i]);
+		else if (strcmp(argv[i], "--latency") == 0)
+			measureLatency = true;
+		else if (strcmp(argv[i], "--no-save") == 0)
+			batterySaves = false;
+		else if (strcmp(argv[i], "--save-flush") == 0 && i + 1 < argc)
+			saveFlushSeconds = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--netplay") == 0 && i + 2 < argc)
+		{
+			netplayPort = (uint16_t)atoi(argv[++i]);
+			netplayPeer = argv[++i];
+		}
+		else if (strcmp(argv[i], "--player") == 0 && i + 1 < argc)
+			netplayPlayer = atoi(argv[++i]) == 2 ? 2 : 1;
+		else if (strcmp(argv[i], "--rollback") == 0 && i + 1 < argc)
+			maxRollback = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--input-delay") == 0 && i + 1 < argc)
+			inputDelay = atoi(argv[++i]);
+		else
+			filename = argv[i];
+	}
+
+	// The scaler sets the window size; the NTSC filter's wider frames are squeezed back into it when drawn.
+	int factor = Scaler::factor();
+	int frameWidth = ntsc ? NTSC_WIDTH : WIDTH;
+	std::vector<uint32_t> frame(frameWidth * HEIGHT);
+	SDL_SetWindowSize(window, WIDTH * factor, HEIGHT * factor);
+
+	// Pixel manipulation through texture of the surface, which takes the scaler's output as is.
 	SDL_Texture* buffer = SDL_CreateTexture(renderer,
 		SDL_PIXELFORMAT_RGBA8888,
 		SDL_TEXTUREACCESS_STREAMING,
-		WIDTH,
-		HEIGHT);
-	SDL_LockTexture(buffer,
-		NULL,      // NULL means the *whole texture* here.
-		(void**)(&pixels),
-		&pitch);
-
-	// Manipulate pixels here.
+		frameWidth * factor,
+		HEIGHT * factor);
 
-	SDL_UnlockTexture(buffer);
+	// Scaler time and frames left as they were, shown in the title once a second.
+	int statsFrames = 0, statsUnchanged = 0;
+	double statsMilliseconds = 0;
 
-	//std::string filename("C:\\MyWork\\Super_mario_brothers.nes");
-	std::string filename("C:\\MyWork\\ex1.dasm.rom");
+	// Input-to-photon latency: from a press's event timestamp to the present of
+	// the first frame that differs. Needs a ROM whose picture only changes in
+	// response to input, such as a controller test.
+	uint32_t pressTimestamp = 0;
+	uint32_t latencySamples = 0, latencyTotal = 0, latencyWorst = 0;
 
+	// Both sides of a netplay session must start from the same cartridge RAM, and a
+	// movie starts from its own, which must not overwrite the player's save.
+	Cartridge::setBatterySaves(batterySaves && !netplayPeer && !playMovie, saveFlushSeconds);
 	Cartridge::load(filename.c_str());
 
-	APU::initialize();
-	PPU::initialize();
-	CPU::power();
+	if (Cartridge::loaded())
+	{
+		Console::power();
+		PPU::setBackend(backend);
+		if (recordMovie)
+			Movie::record(recordMovie);
+		else if (playMovie)
+			Movie::play(playMovie);
+		if (capture && !Capture::open(capture, captureFormat, captureDepth))
+			std::cerr << "Could not open capture output: " << capture << std::endl;
+
+		if (netplayPeer)
+		{
+			std::string peer(netplayPeer);
+			size_t colon = peer.rfind(':');
+			if (colon != std::string::npos && link.open(netplayPort, peer.substr(0, colon).c_str(), (uint16_t)atoi(peer.c_str() + colon + 1)))
+				netplay = new Netplay::Session(link, netplayPlayer - 1, maxRollback, inputDelay);
+			else
+				std::cerr << "Could not set up netplay with " << netplayPeer << std::endl;
+		}
+
+		// Movies, run-ahead and netplay replay frames with the buttons they started with.
+		if (!recordMovie && !playMovie && runAhead == 0 && !netplay)
+			Controller::setPoller(pollJustInTime);
+	}
 
 	while(running)
 	{
-		SDL_PollEvent(&evt);
-		switch(evt.type)
+		// Drain everything that arrived since the last frame.
+		while (SDL_PollEvent(&evt))
+		{
+			if (evt.type == SDL_QUIT)
+				running = false;
+			else
+				Input::handleEvent(evt);
+		}
+		uint32_t press = Input::takePress();
+		if (!pressTimestamp)
+			pressTimestamp = press;
+
+		bool changed = false;
+		if (Cartridge::loaded())
 		{
-		case SDL_QUIT:
-			running = false;
-			break;
+			// Sampled at the start of the frame for movies; live play refreshes this when the game latches.
+			if (!Movie::playing())
+			{
+				Controller::setButtons(0, Input::poll(0));
+				Controller::setButtons(1, Input::poll(1));
+			}
+			if (netplay)
+			{
+				// The side that runs ahead of the other sits out a frame now and then, at most twice a second.
+				if (netplay->idleFrames() > 0 && netplay->frame() - lastIdle >= 30)
+				{
+					lastIdle = netplay->frame();
+					netplay->poll();
+				}
+				else
+				{
+					netplay->advance(Input::poll(0));
+				}
+			}
+			else
+			{
+				Movie::frame();
+				runFrameAhead(runAhead, ahead);
+			}
+			Capture::frame(PPU::getFramebuffer(), PPU::getMask());
+
+			// A frame identical to the last one leaves the texture alone, skipping the
+			// conversion, scaling and upload. The NTSC filter's output alternates with
+			// the subcarrier phase, so it always changes. Presenting still happens
+			// every time round, as that is what paces the loop.
+			changed = PPU::frameChanged();
+			if (!ntsc && !changed)
+			{
+				++statsUnchanged;
+			}
+			else
+			{
+				if (ntsc)
+					Ntsc::filter(PPU::getFramebuffer(), frame.data(), frameWidth * 4, PPU::getMask(), PPU::getFrameCount());
+				else
+					Palette::convert(PPU::getFramebuffer(), frame.data(), frameWidth * 4, PPU::getMask());
+
+				// Scale into the texture, NULL meaning the whole of it.
+				SDL_LockTexture(buffer, NULL, &pixels, &pitch);
+				Scaler::scale(frame.data(), frameWidth, HEIGHT, pixels, pitch);
+				SDL_UnlockTexture(buffer);
+				statsMilliseconds += Scaler::lastMilliseconds();
+			}
+
+			if (++statsFrames == 60)
+			{
+				int scaled = statsFrames - statsUnchanged;
+				char title[128];
+				snprintf(title, sizeof(title), "NES Emulator - %s %.3f ms, %d%% unchanged",
+					Scaler::name(Scaler::current()), scaled ? statsMilliseconds / scaled : 0.0, statsUnchanged * 100 / statsFrames);
+				SDL_SetWindowTitle(window, title);
+				statsFrames = statsUnchanged = 0;
+				statsMilliseconds = 0;
+			}
 		}
+
 		SDL_RenderClear(renderer);
 		SDL_RenderCopy(renderer, buffer, NULL, NULL);
 		SDL_RenderPresent(renderer);
 
-		if (Cartridge::loaded())
+		if (measureLatency && pressTimestamp && changed)
 		{
-			for (int i = 0; i < 3; ++i)
-				PPU::execute();
-			CPU::execute();
+			uint32_t latency = SDL_GetTicks() - pressTimestamp;
+			latencyTotal += latency;
+			latencyWorst = latency > latencyWorst ? latency : latencyWorst;
+			++latencySamples;
+			std::cout << "input-to-photon " << latency << " ms (mean " << latencyTotal / latencySamples
+				<< ", worst " << latencyWorst << " over " << latencySamples << ")" << std::endl;
 		}
+		if (changed)
+			pressTimestamp = 0;
+	}
+
+	if (netplay)
+	{
+		const Netplay::stats_s& stats = netplay->getStats();
+		std::cout << "netplay: " << stats.frames << " frames, " << stats.rollbacks << " rollbacks re-running "
+			<< stats.resimulated << " frames, " << stats.stalls << " stalls"
+			<< (stats.desynced ? ", desynced" : "") << std::endl;
+		delete netplay;
 	}
+	Movie::stop();
+	Capture::close();
+	Cartridge::unload();
 
 	SDL_DestroyWindow(window);
 	SDL_Quit();
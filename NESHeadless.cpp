@@ -0,0 +1,668 @@
+#include <stdio.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+
+#include "PPU.h"
+#include "CPU.h"
+#include "Cartridge.h"
+#include "Console.h"
+#include "Hash.h"
+#include "Lockstep.h"
+#include "Batch.h"
+#include "Controller.h"
+#include "Savestate.h"
+#include "Movie.h"
+#include "Capture.h"
+#include "Screenshot.h"
+#include "Palette.h"
+#include "Ntsc.h"
+#include "Scaler.h"
+#include "Scheduler.h"
+#include "Observation.h"
+#include "Netplay.h"
+
+/*
+* Command-line runner without a window, for batch runs and validation.
+*/
+void usage()
+{
+	std::cout << "Usage: NESHeadless <rom> [options]\n"
+		<< "  --frames N          Run N frames (default 60, or the movie length)\n"
+		<< "  --movie FILE        Play back controller input from a movie\n"
+		<< "  --render-every N    Only compose every Nth frame and the last one (0 = last only)\n"
+		<< "  --ppu MODE          PPU backend: scanline (default) or dot\n"
+		<< "  --no-sprite-limit   Draw every sprite on a line instead of the first 8\n"
+		<< "  --no-idle-skip      Step through loops that only wait instead of skipping them\n"
+		<< "  --dump PREFIX       Write each composed frame that changed to PREFIX<frame>.png; with --batch,\n"
+		<< "                      every lane's composed frames to PREFIX<lane>_<frame>.png\n"
+		<< "  --dump-format F     png (default, indexed) or ppm\n"
+		<< "  --capture FILE      Stream every frame to FILE, or - for standard output\n"
+		<< "  --capture-format F  y4m (default) or raw RGBA\n"
+		<< "  --capture-depth N   Frames that can queue up for the capture writer (default 8)\n"
+		<< "  --lockstep A,B      Run cores A and B side by side and stop at the first divergence\n"
+		<< "  --trace N           Instructions to show per core on divergence (default 32)\n"
+		<< "  --batch N           Run N lanes (up to " << BATCH_LANES << ") with the batch interpreter and compare\n"
+		<< "                      against N scalar consoles run one after another\n"
+		<< "  --consoles N        Run N consoles on the work-stealing scheduler and compare each against\n"
+		<< "                      a scalar console\n"
+		<< "  --schedule MODE     barrier (default; every console finishes a frame before the next) or free\n"
+		<< "  --bench-scheduler   With --consoles, repeat the run at 1, 2, 4 ... threads up to --threads\n"
+		<< "  --no-pin            Leave scheduler threads unpinned\n"
+		<< "  --serve NAME        Run on commands from another process through the shared-memory ring\n"
+		<< "                      NAME (see nes_observation.h) until it sends quit\n"
+		<< "  --serve-slots N     Observations the ring holds (default 8)\n"
+		<< "  --netplay-test      Play both sides of a rollback netplay session over a simulated link, then\n"
+		<< "                      check them against one console given the same input\n"
+		<< "  --netplay-latency N Frames each packet takes to arrive (default 4)\n"
+		<< "  --netplay-loss P    Percentage of packets lost (default 0)\n"
+		<< "  --rollback N        Most frames a netplay session re-runs at once (default 8)\n"
+		<< "  --input-delay N     Frames local netplay input is held back (default 0)\n"
+		<< "  --battery           Keep battery-backed RAM in the ROM's .sav file (off by default)\n"
+		<< "  --expect FB,RAM     Fail unless the final framebuffer and RAM CRCs (hex) are these\n"
+		<< "  --bench-palette N   Afterwards, time N palette-to-RGBA conversions of the last frame\n"
+		<< "  --bench-ntsc N      Afterwards, time N NTSC filter passes over the last frame\n"
+		<< "  --bench-scalers N   Afterwards, time N passes of each scaler over the last frame\n"
+		<< "  --threads N         Worker threads for the NTSC filter, scalers, batch screenshots and scheduler\n"
+		<< "                      (default: one per hardware thread)\n"
+		<< "Cores:" << std::endl;
+	Lockstep::listCores();
+}
+
+/*
+* Time the output stage on its own: a plain per-pixel table lookup against
+* Palette::convert, both into the same RGBA buffer.
+*/
+void benchPalette(int iterations)
+{
+	std::vector<uint32_t> pixels(PPU_WIDTH * PPU_HEIGHT);
+	const uint8_t* indices = PPU::getFramebuffer();
+	uint8_t mask = PPU::getMask();
+	uint8_t keep = (mask & 0x01) ? 0x30 : 0x3F;
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+	{
+		const uint32_t* lut = Palette::table(mask);
+		for (int p = 0; p < PPU_WIDTH * PPU_HEIGHT; ++p)
+			pixels[p] = lut[indices[p] & keep];
+	}
+	double lookup = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	uint32_t lookupCrc = Hash::crc32((const uint8_t*)pixels.data(), pixels.size() * 4);
+
+	begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+		Palette::convert(indices, pixels.data(), PPU_WIDTH * 4, mask);
+	double convert = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	uint32_t convertCrc = Hash::crc32((const uint8_t*)pixels.data(), pixels.size() * 4);
+
+	std::cout << "palette: lookup " << lookup * 1e6 / iterations << " us/frame, convert "
+		<< convert * 1e6 / iterations << " us/frame ("
+		<< PPU_WIDTH * PPU_HEIGHT * (double)iterations / convert / 1e6 << " Mpixel/s)"
+		<< (lookupCrc == convertCrc ? "" : ", OUTPUT DIFFERS") << std::endl;
+}
+
+/*
+* Time the NTSC filter on its own.
+*/
+void benchNtsc(int iterations)
+{
+	std::vector<uint32_t> pixels(NTSC_WIDTH * PPU_HEIGHT);
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; ++i)
+		Ntsc::filter(PPU::getFramebuffer(), pixels.data(), NTSC_WIDTH * 4, PPU::getMask(), PPU::getFrameCount());
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	std::cout << "ntsc: " << seconds * 1000.0 / iterations << " ms/frame ("
+		<< iterations / seconds << " fps)" << std::endl;
+}
+
+/*
+* Time each scaler on the last frame, after the palette stage.
+*/
+void benchScalers(int iterations)
+{
+	std::vector<uint32_t> frame(PPU_WIDTH * PPU_HEIGHT);
+	Palette::convert(PPU::getFramebuffer(), frame.data(), PPU_WIDTH * 4, PPU::getMask());
+
+	for (int mode = Scaler::NEAREST; mode <= Scaler::XBR_LITE; ++mode)
+	{
+		Scaler::select((Scaler::scaler_e)mode);
+		int factor = Scaler::factor();
+		std::vector<uint32_t> pixels(PPU_WIDTH * factor * PPU_HEIGHT * factor);
+
+		double total = 0;
+		for (int i = 0; i < iterations; ++i)
+		{
+			Scaler::scale(frame.data(), PPU_WIDTH, PPU_HEIGHT, pixels.data(), PPU_WIDTH * factor * 4);
+			total += Scaler::lastMilliseconds();
+		}
+
+		std::cout << "scaler " << Scaler::name((Scaler::scaler_e)mode) << ": " << total / iterations << " ms/frame, output "
+			<< std::hex << std::setfill('0') << std::setw(8) << Hash::crc32((const uint8_t*)pixels.data(), pixels.size() * 4)
+			<< std::dec << std::endl;
+	}
+}
+
+/*
+* Run the batch interpreter, then the same work as independent scalar consoles,
+* and report aggregate throughput of both. Every lane must end up identical to
+* its scalar counterpart. Leaves the console in the last scalar console's state.
+*/
+bool runBatch(int lanes, uint32_t frames, const char* movie, int renderEvery, const char* dumpPrefix, Screenshot::format_e dumpFormat)
+{
+	if (lanes > BATCH_LANES)
+		lanes = BATCH_LANES;
+	PPU::setBackend(PPU::SCANLINE); // Lanes always run the scanline backend.
+
+	Savestate::Snapshot start;
+	Savestate::save(start);
+
+	auto begin = std::chrono::steady_clock::now();
+	Batch::begin(lanes);
+	for (uint32_t i = 0; i < frames; ++i)
+	{
+		Movie::frame();
+		for (int lane = 0; lane < lanes; ++lane)
+		{
+			Batch::setButtons(lane, 0, Controller::getButtons(0));
+			Batch::setButtons(lane, 1, Controller::getButtons(1));
+		}
+		Batch::runFrame();
+
+		// Every lane's frame goes to the encoders straight from the lane's framebuffer.
+		bool observed = i + 1 == frames || (renderEvery > 0 && (i + 1) % renderEvery == 0);
+		if (dumpPrefix && observed)
+		{
+			for (int lane = 0; lane < lanes; ++lane)
+			{
+				std::string name = dumpPrefix + std::to_string(lane) + "_" + std::to_string(i + 1) + (dumpFormat == Screenshot::PNG ? ".png" : ".ppm");
+				Screenshot::add(name, Batch::getFramebuffer(lane), Batch::getMask(lane), dumpFormat);
+			}
+			if (!Screenshot::flush())
+			{
+				std::cerr << "Could not write frame dump under " << dumpPrefix << std::endl;
+				Batch::end();
+				return false;
+			}
+		}
+	}
+	double batchSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	std::vector<uint32_t> laneCrc(lanes);
+	for (int lane = 0; lane < lanes; ++lane)
+		laneCrc[lane] = Hash::crc32(Batch::getRam(lane), 0x800) ^ Hash::crc32(Batch::getFramebuffer(lane), PPU_WIDTH * PPU_HEIGHT);
+	uint64_t vectorized = Batch::vectorInstructions();
+	uint64_t total = vectorized + Batch::scalarInstructions();
+	Batch::end();
+
+	bool match = true;
+	begin = std::chrono::steady_clock::now();
+	for (int lane = 0; lane < lanes; ++lane)
+	{
+		if (movie)
+			Movie::play(movie);
+		else
+			Savestate::load(start);
+
+		for (uint32_t i = 0; i < frames; ++i)
+		{
+			Movie::frame();
+			Console::runFrame();
+		}
+		match &= laneCrc[lane] == (Hash::crc32(CPU::getRam(), 0x800) ^ Hash::crc32(PPU::getFramebuffer(), PPU_WIDTH * PPU_HEIGHT));
+	}
+	double scalarSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	std::cout << "batch:  " << lanes << " lanes, " << lanes * frames / batchSeconds << " frames/s aggregate, "
+		<< (total ? 100.0 * vectorized / total : 0) << "% of instructions vectorized" << std::endl;
+	std::cout << "scalar: " << lanes << " consoles, " << lanes * frames / scalarSeconds << " frames/s aggregate" << std::endl;
+	std::cout << "lanes " << (match ? "match" : "DO NOT match") << " scalar consoles" << std::endl;
+	return match;
+}
+
+/*
+* Run copies of the current console on the work-stealing scheduler, then one
+* console on this thread as the reference every copy must match. Reports
+* throughput, per-task overhead (finding work and swapping consoles in and
+* out) and, when sweeping thread counts, scaling efficiency against one thread.
+* Movie input is fed between frames, so movies force BARRIER mode.
+*/
+bool runScheduler(int count, uint32_t frames, const char* movie, Scheduler::mode_e mode, bool sweep)
+{
+	if (movie)
+		mode = Scheduler::BARRIER;
+
+	Savestate::Snapshot start;
+	Savestate::save(start);
+
+	std::vector<int> threadCounts;
+	int maxThreads = Scheduler::threads();
+	if (sweep)
+		for (int threads = 1; threads < maxThreads; threads *= 2)
+			threadCounts.push_back(threads);
+	threadCounts.push_back(maxThreads);
+
+	std::vector<uint32_t> consoleCrc(count);
+	double singleThreadRate = 0;
+	for (int threads : threadCounts)
+	{
+		if (movie)
+			Movie::play(movie);
+		else
+			Savestate::load(start);
+		Scheduler::setThreads(threads);
+		Scheduler::begin(count);
+
+		Scheduler::stats_s total = {};
+		for (uint32_t i = 0; i < (movie ? frames : 1); ++i)
+		{
+			if (movie)
+			{
+				Movie::frame();
+				for (int console = 0; console < count; ++console)
+				{
+					Scheduler::setButtons(console, 0, Controller::getButtons(0));
+					Scheduler::setButtons(console, 1, Controller::getButtons(1));
+				}
+			}
+			Scheduler::run(movie ? 1 : frames, mode);
+
+			Scheduler::stats_s stats = Scheduler::getStats();
+			total.tasks += stats.tasks;
+			total.steals += stats.steals;
+			total.swaps += stats.swaps;
+			total.seconds += stats.seconds;
+			total.busySeconds += stats.busySeconds;
+			total.overheadSeconds += stats.overheadSeconds;
+		}
+
+		for (int console = 0; console < count; ++console)
+			consoleCrc[console] = Hash::crc32(Scheduler::getRam(console), 0x800) ^ Hash::crc32(Scheduler::getFramebuffer(console), PPU_WIDTH * PPU_HEIGHT);
+		Scheduler::end();
+
+		double rate = total.seconds > 0 ? total.tasks / total.seconds : 0;
+		if (threads == 1)
+			singleThreadRate = rate;
+		std::cout << "scheduler: " << threads << " threads, " << count << " consoles, " << rate << " frames/s aggregate";
+		if (singleThreadRate > 0)
+			std::cout << ", " << 100.0 * rate / (singleThreadRate * threads) << "% scaling efficiency";
+		std::cout << std::endl << "           " << (total.tasks ? total.overheadSeconds * 1e6 / total.tasks : 0) << " us overhead per "
+			<< (total.tasks ? total.busySeconds * 1e6 / total.tasks : 0) << " us frame, "
+			<< total.steals << " steals, " << total.swaps << " console swaps" << std::endl;
+	}
+
+	if (movie)
+		Movie::play(movie);
+	else
+		Savestate::load(start);
+	for (uint32_t i = 0; i < frames; ++i)
+	{
+		Movie::frame();
+		Console::runFrame();
+	}
+	uint32_t reference = Hash::crc32(CPU::getRam(), 0x800) ^ Hash::crc32(PPU::getFramebuffer(), PPU_WIDTH * PPU_HEIGHT);
+
+	bool match = true;
+	for (int console = 0; console < count; ++console)
+		match &= consoleCrc[console] == reference;
+	std::cout << "consoles " << (match ? "match" : "DO NOT match") << " a scalar console" << std::endl;
+	return match;
+}
+
+/*
+* Scripted input for the netplay test: each player holds a pseudo-random
+* combination for 8 frames at a time.
+*/
+uint8_t netplayInput(int player, uint32_t frame)
+{
+	uint32_t x = (frame >> 3) * 2654435761u ^ (player + 1) * 0x9E3779B9u;
+	x ^= x >> 15;
+	x *= 0x2C1B3C6D;
+	x ^= x >> 12;
+	return (uint8_t)x;
+}
+
+/*
+* Both sides of a netplay session on this thread, swapped in and out around
+* each host frame, over a loopback link with artificial latency and loss.
+* Once both have run all frames and heard all of each other's input, each
+* must match a console run once with the real input of both players. Reports
+* what rollback cost: snapshot save and load times, and frames re-run.
+*/
+bool runNetplayTest(uint32_t frames, int latency, int lossPercent, int maxRollback, int inputDelay)
+{
+	Savestate::Snapshot start;
+	Savestate::save(start);
+	Savestate::Snapshot consoles[2] = { start, start };
+
+	Netplay::Loopback link(latency, lossPercent);
+	Netplay::Session first(link.end(0), 0, maxRollback, inputDelay);
+	Netplay::Session second(link.end(1), 1, maxRollback, inputDelay);
+	Netplay::Session* sessions[2] = { &first, &second };
+	inputDelay = first.getInputDelay();
+
+	// A session can wait on its peer indefinitely if the link loses everything.
+	uint32_t hostFrames = 0, limit = frames * 4 + 1000;
+	auto begin = std::chrono::steady_clock::now();
+	while ((first.frame() < frames || second.frame() < frames || first.confirmedFrame() < frames || second.confirmedFrame() < frames)
+		&& hostFrames < limit)
+	{
+		for (int side = 0; side < 2; ++side)
+		{
+			Netplay::Session& session = *sessions[side];
+			Savestate::load(consoles[side]);
+			if (session.frame() < frames)
+				session.advance(netplayInput(side, session.frame() + inputDelay));
+			else
+				session.poll();
+			Savestate::save(consoles[side]);
+		}
+		link.tick();
+		++hostFrames;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	uint32_t sideCrc[2];
+	for (int side = 0; side < 2; ++side)
+		sideCrc[side] = Hash::crc32(consoles[side].cpu.ram, sizeof(consoles[side].cpu.ram));
+
+	Savestate::load(start);
+	for (uint32_t i = 0; i < frames; ++i)
+	{
+		Controller::setButtons(0, i < (uint32_t)inputDelay ? 0 : netplayInput(0, i));
+		Controller::setButtons(1, i < (uint32_t)inputDelay ? 0 : netplayInput(1, i));
+		Console::runFrame();
+	}
+	uint32_t reference = Hash::crc32(CPU::getRam(), 0x800);
+
+	std::cout << "netplay: " << latency << " frames latency, " << lossPercent << "% loss, rollback window "
+		<< maxRollback << ", input delay " << inputDelay << ", " << hostFrames << " host frames in "
+		<< seconds * 1000.0 << " ms" << std::endl;
+	bool match = hostFrames < limit;
+	for (int side = 0; side < 2; ++side)
+	{
+		const Netplay::stats_s& stats = sessions[side]->getStats();
+		std::cout << "  side " << side + 1 << ": " << stats.rollbacks << " rollbacks, " << stats.resimulated
+			<< " frames re-run (at most " << stats.maxResimulated << " at once), " << stats.stalls << " stalls" << std::endl;
+		std::cout << "          save " << (stats.saves ? stats.saveSeconds * 1e6 / stats.saves : 0) << " us, load "
+			<< (stats.loads ? stats.loadSeconds * 1e6 / stats.loads : 0) << " us, re-run "
+			<< (stats.resimulated ? stats.resimSeconds * 1e6 / stats.resimulated : 0) << " us/frame, worst rollback "
+			<< stats.maxRollbackSeconds * 1000.0 << " ms" << std::endl;
+		if (stats.desynced)
+			std::cout << "  side " << side + 1 << " saw a desync at frame " << stats.desyncFrame << std::endl;
+		match &= !stats.desynced && sideCrc[side] == reference;
+	}
+	std::cout << "peers " << (match ? "match" : "DO NOT match") << " a console given the same input" << std::endl;
+
+	// Leave the first side's console running, for the final CRCs.
+	Savestate::load(consoles[0]);
+	return match;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* filename = nullptr;
+	uint32_t frames = 0;
+	const char* movie = nullptr;
+	std::string lockstep;
+	int traceDepth = 32;
+	int batch = 0;
+	int consoles = 0;
+	Scheduler::mode_e scheduleMode = Scheduler::BARRIER;
+	bool benchScheduler = false;
+	const char* serve = nullptr;
+	int serveSlots = 8;
+	bool netplayTest = false;
+	int netplayLatency = 4;
+	int netplayLoss = 0;
+	int maxRollback = 8;
+	int inputDelay = 0;
+	int renderEvery = 1;
+	int benchIterations = 0;
+	int ntscIterations = 0;
+	int scalerIterations = 0;
+	const char* dumpPrefix = nullptr;
+	Screenshot::format_e dumpFormat = Screenshot::PNG;
+	const char* capture = nullptr;
+	Capture::format_e captureFormat = Capture::Y4M;
+	int captureDepth = 8;
+	PPU::backend_e backend = PPU::SCANLINE;
+	bool expect = false;
+	uint32_t expectFramebuffer = 0, expectRam = 0;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			frames = strtoul(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--movie") == 0 && i + 1 < argc)
+			movie = argv[++i];
+		else if (strcmp(argv[i], "--lockstep") == 0 && i + 1 < argc)
+			lockstep = argv[++i];
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			traceDepth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--render-every") == 0 && i + 1 < argc)
+			renderEvery = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--expect") == 0 && i + 1 < argc && sscanf(argv[i + 1], "%x,%x", &expectFramebuffer, &expectRam) == 2)
+		{
+			expect = true;
+			++i;
+		}
+		else if (strcmp(argv[i], "--no-idle-skip") == 0)
+			Console::setIdleSkip(false);
+		else if (strcmp(argv[i], "--no-sprite-limit") == 0)
+			PPU::setSpriteLimit(false);
+		else if (strcmp(argv[i], "--battery") == 0)
+			Cartridge::setBatterySaves(true);
+		else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc)
+			dumpPrefix = argv[++i];
+		else if (strcmp(argv[i], "--dump-format") == 0 && i + 1 < argc && (strcmp(argv[i + 1], "png") == 0 || strcmp(argv[i + 1], "ppm") == 0))
+			dumpFormat = strcmp(argv[++i], "ppm") == 0 ? Screenshot::PPM : Screenshot::PNG;
+		else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+			capture = argv[++i];
+		else if (strcmp(argv[i], "--capture-format") == 0 && i + 1 < argc && (strcmp(argv[i + 1], "y4m") == 0 || strcmp(argv[i + 1], "raw") == 0))
+			captureFormat = strcmp(argv[++i], "raw") == 0 ? Capture::RAW : Capture::Y4M;
+		else if (strcmp(argv[i], "--capture-depth") == 0 && i + 1 < argc)
+			captureDepth = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+			batch = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--consoles") == 0 && i + 1 < argc)
+			consoles = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--schedule") == 0 && i + 1 < argc && (strcmp(argv[i + 1], "barrier") == 0 || strcmp(argv[i + 1], "free") == 0))
+			scheduleMode = strcmp(argv[++i], "free") == 0 ? Scheduler::FREE : Scheduler::BARRIER;
+		else if (strcmp(argv[i], "--bench-scheduler") == 0)
+			benchScheduler = true;
+		else if (strcmp(argv[i], "--no-pin") == 0)
+			Scheduler::setPinning(false);
+		else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+			serve = argv[++i];
+		else if (strcmp(argv[i], "--serve-slots") == 0 && i + 1 < argc)
+			serveSlots = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--netplay-test") == 0)
+			netplayTest = true;
+		else if (strcmp(argv[i], "--netplay-latency") == 0 && i + 1 < argc)
+			netplayLatency = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--netplay-loss") == 0 && i + 1 < argc)
+			netplayLoss = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--rollback") == 0 && i + 1 < argc)
+			maxRollback = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--input-delay") == 0 && i + 1 < argc)
+			inputDelay = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--bench-palette") == 0 && i + 1 < argc)
+			benchIterations = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--bench-ntsc") == 0 && i + 1 < argc)
+			ntscIterations = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--bench-scalers") == 0 && i + 1 < argc)
+			scalerIterations = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			int threads = atoi(argv[++i]);
+			Ntsc::setThreads(threads);
+			Scaler::setThreads(threads);
+			Screenshot::setThreads(threads);
+			Scheduler::setThreads(threads);
+		}
+		else if (strcmp(argv[i], "--ppu") == 0 && i + 1 < argc && (strcmp(argv[i + 1], "scanline") == 0 || strcmp(argv[i + 1], "dot") == 0))
+			backend = strcmp(argv[++i], "dot") == 0 ? PPU::DOT : PPU::SCANLINE;
+		else if (argv[i][0] != '-' && !filename)
+			filename = argv[i];
+		else
+		{
+			usage();
+			return 2;
+		}
+	}
+
+	if (!filename)
+	{
+		usage();
+		return 2;
+	}
+
+	Cartridge::load(filename);
+	if (!Cartridge::loaded())
+	{
+		std::cerr << "Unsupported or unreadable ROM: " << filename << std::endl;
+		return 1;
+	}
+	Console::power();
+	PPU::setBackend(backend);
+
+	if (movie && !Movie::play(movie))
+		return 1;
+	if (frames == 0)
+		frames = Movie::playing() ? Movie::length() : 60;
+
+	if (capture)
+	{
+		if (!Capture::open(capture, captureFormat, captureDepth))
+		{
+			std::cerr << "Could not open capture output: " << capture << std::endl;
+			return 1;
+		}
+		renderEvery = 1; // Every frame goes to the capture.
+
+		// Standard output belongs to the video stream, so reports go to standard error.
+		if (strcmp(capture, "-") == 0)
+			std::cout.rdbuf(std::cerr.rdbuf());
+	}
+
+	uint32_t observedFrames = 0, unchangedFrames = 0;
+	auto begin = std::chrono::steady_clock::now();
+	if (!lockstep.empty())
+	{
+		size_t comma = lockstep.find(',');
+		const Lockstep::core_s* a = Lockstep::findCore(lockstep.substr(0, comma).c_str());
+		const Lockstep::core_s* b = comma == std::string::npos ? a : Lockstep::findCore(lockstep.substr(comma + 1).c_str());
+		if (!a || !b)
+		{
+			usage();
+			return 2;
+		}
+		if (!Lockstep::run(*a, *b, frames, traceDepth))
+			return 1;
+	}
+	else if (batch > 0)
+	{
+		if (!runBatch(batch, frames, movie, renderEvery, dumpPrefix, dumpFormat))
+			return 1;
+	}
+	else if (serve)
+	{
+		if (!Observation::create(serve, serveSlots))
+		{
+			std::cerr << "Could not create shared memory " << serve << std::endl;
+			return 1;
+		}
+		Observation::serve();
+		Observation::close();
+	}
+	else if (netplayTest)
+	{
+		if (!runNetplayTest(frames, netplayLatency, netplayLoss, maxRollback, inputDelay))
+			return 1;
+	}
+	else if (consoles > 0)
+	{
+		if (!runScheduler(consoles, frames, movie, scheduleMode, benchScheduler))
+			return 1;
+	}
+	else
+	{
+		for (uint32_t i = 0; i < frames; ++i)
+		{
+			bool observed = i + 1 == frames || (renderEvery > 0 && (i + 1) % renderEvery == 0);
+			PPU::setSkipRender(!observed);
+			Movie::frame();
+			Console::runFrame();
+			if (CPU::jammed())
+			{
+				frames = i + 1; // The console has halted; no frame would ever finish.
+				break;
+			}
+
+			// Unchanged frames are counted but not encoded again.
+			if (observed)
+			{
+				Capture::frame(PPU::getFramebuffer(), PPU::getMask());
+				++observedFrames;
+				if (!PPU::frameChanged())
+					++unchangedFrames;
+				else if (dumpPrefix && !Screenshot::write(dumpPrefix + std::to_string(PPU::getFrameCount()) + (dumpFormat == Screenshot::PNG ? ".png" : ".ppm"),
+					PPU::getFramebuffer(), PPU::getMask(), dumpFormat))
+				{
+					std::cerr << "Could not write frame dump under " << dumpPrefix << std::endl;
+					return 1;
+				}
+			}
+		}
+		PPU::setSkipRender(false);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	uint32_t framebufferCrc = Hash::crc32(PPU::getFramebuffer(), PPU_WIDTH * PPU_HEIGHT);
+	uint32_t ramCrc = Hash::crc32(CPU::getRam(), 0x800);
+	std::cout << "frame " << PPU::getFrameCount() << std::hex << std::setfill('0')
+		<< " framebuffer " << std::setw(8) << framebufferCrc
+		<< " ram " << std::setw(8) << ramCrc << std::endl;
+	std::cout << std::dec << frames << " frames in " << seconds * 1000.0 << " ms ("
+		<< (seconds > 0 ? frames / seconds : 0) << " fps)" << std::endl;
+	if (Capture::active())
+	{
+		Capture::close();
+		std::cout << Capture::getFrameCount() << " frames captured, " << Capture::getStallCount()
+			<< " waited for a free buffer" << std::endl;
+	}
+	if (observedFrames > 0)
+		std::cout << unchangedFrames << " of " << observedFrames << " composed frames unchanged ("
+			<< unchangedFrames * 100.0 / observedFrames << "% skipped)" << std::endl;
+
+	const CPU::fault_s& fault = CPU::getFault();
+	if (fault.faulted)
+		std::cout << (fault.jammed ? "CPU jammed" : "Unemulated opcode") << std::hex << std::setfill('0')
+			<< ": $" << std::setw(2) << (int)fault.opcode << " at $" << std::setw(4) << fault.PC << std::dec << std::endl;
+
+	if (expect && (framebufferCrc != expectFramebuffer || ramCrc != expectRam))
+	{
+		std::cout << std::hex << "FAIL: expected framebuffer " << std::setw(8) << expectFramebuffer
+			<< " ram " << std::setw(8) << expectRam << std::dec << std::endl;
+		return 1;
+	}
+	if (fault.jammed)
+		return 1;
+
+	if (benchIterations > 0)
+		benchPalette(benchIterations);
+	if (ntscIterations > 0)
+		benchNtsc(ntscIterations);
+	if (scalerIterations > 0)
+		benchScalers(scalerIterations);
+
+	Cartridge::unload();
+	return 0;
+}
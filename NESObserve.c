@@ -0,0 +1,137 @@
+/*
+* A consumer of nes_observation.h in plain C, linked only against the
+* nes_observation library: steps a ring served by NESHeadless --serve, checks
+* that a reset replays the same frames, and tells the emulator to quit.
+*/
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "nes_observation.h"
+
+static void usage(void)
+{
+	printf("Usage: nes_observe <name> [options]\n"
+		"  --frames N       Frames to step (default 60)\n"
+		"  --timeout MS     How long to wait for the ring to appear and for each command (default 10000)\n"
+		"  --expect FB,RAM  Fail unless the last slot's framebuffer and RAM CRCs (hex) are these\n");
+}
+
+static void sleepMs(int ms)
+{
+#ifdef _WIN32
+	Sleep(ms);
+#else
+	struct timespec wait = { ms / 1000, (ms % 1000) * 1000000L };
+	nanosleep(&wait, NULL);
+#endif
+}
+
+static uint32_t crc32(const uint8_t* data, size_t length)
+{
+	uint32_t crc = 0xFFFFFFFFu;
+	for (size_t i = 0; i < length; ++i)
+	{
+		crc ^= data[i];
+		for (int bit = 0; bit < 8; ++bit)
+			crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+	}
+	return ~crc;
+}
+
+/*
+* Step, then read the newest slot's CRCs. The emulator is idle until the next
+* command, so the slot can't be reused while it is read. Returns 0, or -1 if
+* the emulator timed out.
+*/
+static int step(nes_obs* obs, uint32_t frames, int timeout, uint32_t* framebufferCrc, uint32_t* ramCrc)
+{
+	const nes_obs_slot* slot;
+
+	if (nes_obs_step(obs, frames, 0, 0, timeout) != 0 || !(slot = nes_obs_latest(obs)))
+		return -1;
+	*framebufferCrc = crc32(slot->framebuffer, sizeof(slot->framebuffer));
+	*ramCrc = crc32(slot->ram, sizeof(slot->ram));
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* name = NULL;
+	uint32_t frames = 60;
+	int timeout = 10000;
+	int expect = 0;
+	unsigned int expectFramebuffer = 0, expectRam = 0;
+	uint32_t framebufferCrc, ramCrc, replayFramebufferCrc, replayRamCrc;
+	nes_obs* obs = NULL;
+	int waited, failed = 0;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			frames = (uint32_t)strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc)
+			timeout = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--expect") == 0 && i + 1 < argc && sscanf(argv[i + 1], "%x,%x", &expectFramebuffer, &expectRam) == 2)
+		{
+			expect = 1;
+			++i;
+		}
+		else if (argv[i][0] != '-' && !name)
+			name = argv[i];
+		else
+		{
+			usage();
+			return 2;
+		}
+	}
+	if (!name || frames == 0)
+	{
+		usage();
+		return 2;
+	}
+
+	// The emulator may still be starting up.
+	for (waited = 0; !(obs = nes_obs_open(name)) && waited < timeout; waited += 20)
+		sleepMs(20);
+	if (!obs)
+	{
+		fprintf(stderr, "No observation ring named %s\n", name);
+		return 1;
+	}
+	printf("%s: %u slots\n", name, nes_obs_get_header(obs)->slot_count);
+
+	if (step(obs, frames, timeout, &framebufferCrc, &ramCrc) != 0
+		|| nes_obs_reset(obs, timeout) != 0
+		|| step(obs, frames, timeout, &replayFramebufferCrc, &replayRamCrc) != 0)
+	{
+		fprintf(stderr, "FAIL: the emulator did not answer\n");
+		nes_obs_close(obs);
+		return 1;
+	}
+	printf("step %u framebuffer %08x ram %08x\n", frames, framebufferCrc, ramCrc);
+
+	if (replayFramebufferCrc != framebufferCrc || replayRamCrc != ramCrc)
+	{
+		fprintf(stderr, "FAIL: after a reset, framebuffer %08x ram %08x\n", replayFramebufferCrc, replayRamCrc);
+		failed = 1;
+	}
+	if (expect && (framebufferCrc != expectFramebuffer || ramCrc != expectRam))
+	{
+		fprintf(stderr, "FAIL: expected framebuffer %08x ram %08x\n", expectFramebuffer, expectRam);
+		failed = 1;
+	}
+
+	if (nes_obs_quit(obs, timeout) != 0)
+		failed = 1;
+	nes_obs_close(obs);
+	return failed;
+}
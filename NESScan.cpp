@@ -0,0 +1,572 @@
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "APU.h"
+#include "Cartridge.h"
+#include "Console.h"
+#include "Controller.h"
+#include "CPU.h"
+#include "Hash.h"
+#include "PPU.h"
+
+/*
+* nes_scan: index a ROM collection. Walks a directory tree on every core,
+* maps each .nes file, checks its header, hashes PRG and CHR, and boots it for
+* a few frames to see whether it gets as far as drawing something. Each thread
+* keeps one console and reuses it from ROM to ROM, so the cost per file is the
+* read and the frames, not setting up.
+*
+* The index is tab-separated text, one ROM per line, sorted by path.
+*/
+void usage()
+{
+	std::cout << "Usage: nes_scan <directory> [options]\n"
+		<< "  --frames N    Frames to boot each ROM for (default 60, 0 = headers and hashes only)\n"
+		<< "  --threads N   Worker threads (default: one per hardware thread)\n"
+		<< "  --out FILE    Write the index to FILE instead of standard output\n"
+		<< "  --self-test   Scan built-in images whose headers differ (trainer, NES 2.0, junk) and check they agree\n"
+		<< "Columns: path size status mapper prg_kb chr_kb mirroring battery rom_crc prg_crc chr_crc frames detail\n"
+		<< "Status: boots, blank (the last frame is one colour), jam (the CPU hit a KIL),\n"
+		<< "        unemulated (an unstable unofficial opcode), unsupported (mapper), invalid (header)" << std::endl;
+}
+
+/*
+* A whole file mapped read-only, or read into memory where mapping fails.
+*/
+class ReadOnlyFile
+{
+	const uint8_t* view = nullptr;
+	size_t length = 0;
+	std::vector<uint8_t> copy;
+	bool mapped = false;
+
+public:
+	ReadOnlyFile(const ReadOnlyFile&) = delete;
+	ReadOnlyFile& operator=(const ReadOnlyFile&) = delete;
+
+	ReadOnlyFile(const std::string& path)
+	{
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+		LARGE_INTEGER size;
+		if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+		{
+			// The view keeps the mapping alive once both handles are closed.
+			HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			if (mapping)
+			{
+				view = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				CloseHandle(mapping);
+			}
+			if (view)
+			{
+				length = (size_t)size.QuadPart;
+				mapped = true;
+			}
+			else
+			{
+				copy.resize((size_t)size.QuadPart);
+				DWORD got = 0;
+				if (!ReadFile(file, copy.data(), (DWORD)copy.size(), &got, NULL))
+					got = 0;
+				copy.resize(got);
+				view = copy.data();
+				length = copy.size();
+			}
+		}
+		CloseHandle(file);
+#else
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat info;
+		if (fstat(fd, &info) == 0 && info.st_size > 0)
+		{
+#ifdef MAP_POPULATE
+			int flags = MAP_PRIVATE | MAP_POPULATE; // Read it all in now rather than fault page by page
+#else
+			int flags = MAP_PRIVATE;
+#endif
+			void* address = mmap(nullptr, info.st_size, PROT_READ, flags, fd, 0);
+			if (address != MAP_FAILED)
+			{
+				view = (const uint8_t*)address;
+				length = info.st_size;
+				mapped = true;
+			}
+			else
+			{
+				copy.resize(info.st_size);
+				ssize_t got = pread(fd, copy.data(), copy.size(), 0);
+				copy.resize(got > 0 ? got : 0);
+				view = copy.data();
+				length = copy.size();
+			}
+		}
+		close(fd);
+#endif
+	}
+
+	~ReadOnlyFile()
+	{
+		if (!mapped)
+			return;
+#ifdef _WIN32
+		UnmapViewOfFile(view);
+#else
+		munmap((void*)view, length);
+#endif
+	}
+
+	const uint8_t* data() const { return view; }
+	size_t size() const { return length; }
+};
+
+/*
+* Directories still to list and files still to scan, shared by the workers.
+* Files go first, so a deep tree doesn't pile up unscanned paths.
+*/
+class WorkQueue
+{
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::deque<std::string> directories, files;
+	int listing = 0; // Workers listing a directory, which may add more work
+
+public:
+	void addDirectory(const std::string& path)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		directories.push_back(path);
+		wake.notify_one();
+	}
+
+	void addFiles(std::vector<std::string>& found)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (std::string& path : found)
+			files.push_back(std::move(path));
+		wake.notify_all();
+	}
+
+	/*
+	* The next job, or false once there is nothing left and nobody is still
+	* listing. isDirectory says which kind it is.
+	*/
+	bool take(std::string& path, bool& isDirectory)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		wake.wait(lock, [this] { return !files.empty() || !directories.empty() || listing == 0; });
+		if (!files.empty())
+		{
+			path = std::move(files.front());
+			files.pop_front();
+			isDirectory = false;
+			return true;
+		}
+		if (!directories.empty())
+		{
+			path = std::move(directories.front());
+			directories.pop_front();
+			isDirectory = true;
+			++listing;
+			return true;
+		}
+		return false;
+	}
+
+	void doneListing()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		--listing;
+		wake.notify_all();
+	}
+};
+
+typedef struct {
+	std::string path;
+	uint64_t size;
+	const char* status;
+	Cartridge::header_s header;
+	uint32_t romCrc, prgCrc, chrCrc;
+	uint32_t frames; // Frames run before the verdict
+	std::string detail;
+} record_s;
+
+bool hasNesExtension(const char* name)
+{
+	size_t length = strlen(name);
+	if (length < 4 || name[length - 4] != '.')
+		return false;
+	const char* extension = name + length - 3;
+	return (extension[0] | 0x20) == 'n' && (extension[1] | 0x20) == 'e' && (extension[2] | 0x20) == 's';
+}
+
+/*
+* Queue a directory's subdirectories and .nes files. Symbolic links are not
+* followed, so a link cycle cannot make the walk endless.
+*/
+void listDirectory(const std::string& path, WorkQueue& queue, std::atomic<uint64_t>& directoryCount)
+{
+	std::vector<std::string> files;
+	++directoryCount;
+#ifdef _WIN32
+	WIN32_FIND_DATAA entry;
+	HANDLE find = FindFirstFileA((path + "\\*").c_str(), &entry);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+	do
+	{
+		if (strcmp(entry.cFileName, ".") == 0 || strcmp(entry.cFileName, "..") == 0 || (entry.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+			continue;
+		std::string child = path + "\\" + entry.cFileName;
+		if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			queue.addDirectory(child);
+		else if (hasNesExtension(entry.cFileName))
+			files.push_back(child);
+	} while (FindNextFileA(find, &entry));
+	FindClose(find);
+#else
+	DIR* directory = opendir(path.c_str());
+	if (!directory)
+		return;
+	while (struct dirent* entry = readdir(directory))
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		std::string child = path + "/" + entry->d_name;
+		unsigned char type = entry->d_type;
+		if (type == DT_UNKNOWN)
+		{
+			// Some filesystems leave the type to stat.
+			struct stat info;
+			if (lstat(child.c_str(), &info) != 0)
+				continue;
+			type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_LNK;
+		}
+		if (type == DT_DIR)
+			queue.addDirectory(child);
+		else if (type == DT_REG && hasNesExtension(entry->d_name))
+			files.push_back(child);
+	}
+	closedir(directory);
+#endif
+	queue.addFiles(files);
+}
+
+/*
+* Header, hashes and, for a supported mapper, a boot on this thread's console.
+*/
+void scanImage(const uint8_t* data, size_t size, uint32_t frames, record_s& record)
+{
+	record.size = size;
+	record.header = Cartridge::parseHeader(data, size);
+	record.romCrc = record.prgCrc = record.chrCrc = 0;
+	record.frames = 0;
+	if (!record.header.valid)
+	{
+		record.status = "invalid";
+		record.detail = data ? record.header.problem : "empty or unreadable";
+		return;
+	}
+
+	const uint8_t* prg = data + 16 + (record.header.trainer ? 512 : 0);
+	record.romCrc = Hash::crc32(data + 16, size - 16); // As Cartridge::crc() has it, for movies
+	record.prgCrc = Hash::crc32(prg, record.header.prgSize);
+	record.chrCrc = record.header.chrSize ? Hash::crc32(prg + record.header.prgSize, record.header.chrSize) : 0;
+	if (!Cartridge::supported(record.header.mapper))
+	{
+		record.status = "unsupported";
+		return;
+	}
+	if (frames == 0)
+	{
+		record.status = "boots";
+		record.detail = "not run";
+		return;
+	}
+
+	// Power on from nothing: chip state cleared before the mapper wires the nametables,
+	// and CPU flags too, which power() leaves as the thread's last ROM had them.
+	static const PPU::state_s blankPpu = {};
+	static const APU::state_s blankApu = {};
+	static const Controller::state_s blankController = {};
+	PPU::load(blankPpu);
+	APU::load(blankApu);
+	Controller::load(blankController);
+	CPU::setRegisters(CPU::registers_s());
+	Cartridge::mapper = Cartridge::create(data, size);
+	CPU::power();
+
+	record.status = "boots";
+	for (uint32_t i = 0; i < frames; ++i)
+	{
+		PPU::setSkipRender(i + 1 < frames);
+		Console::runFrame();
+		++record.frames;
+
+		CPU::fault_s fault = CPU::getFault();
+		if (!fault.faulted && CPU::jammed()) // Reached a KIL as the frame ended, so has yet to run it
+		{
+			CPU::registers_s regs = CPU::getRegisters();
+			fault = { true, true, regs.PC, CPU::peek(regs.PC) };
+		}
+		if (fault.faulted)
+		{
+			char detail[64];
+			snprintf(detail, sizeof(detail), "opcode %02X at %04X", fault.opcode, fault.PC);
+			record.status = fault.jammed ? "jam" : "unemulated";
+			record.detail = detail;
+			break;
+		}
+	}
+	PPU::setSkipRender(false);
+
+	if (strcmp(record.status, "boots") == 0)
+	{
+		const uint8_t* framebuffer = PPU::getFramebuffer();
+		if (std::all_of(framebuffer, framebuffer + PPU_WIDTH * PPU_HEIGHT, [framebuffer](uint8_t pixel) { return pixel == framebuffer[0]; }))
+			record.status = "blank";
+	}
+	Cartridge::unload();
+}
+
+void scanFile(const std::string& path, uint32_t frames, record_s& record)
+{
+	ReadOnlyFile file(path);
+	record.path = path;
+	scanImage(file.data(), file.size(), frames, record);
+}
+
+void writeRecord(std::ostream& out, const record_s& record)
+{
+	static const char* mirroring[] = { "horizontal", "vertical", "single-lower", "single-upper", "four-screen" };
+	char hashes[32];
+	snprintf(hashes, sizeof(hashes), "%08x\t%08x\t%08x", record.romCrc, record.prgCrc, record.chrCrc);
+
+	// Tabs and line breaks in names would break the columns.
+	std::string path = record.path;
+	std::replace_if(path.begin(), path.end(), [](char c) { return c == '\t' || c == '\n' || c == '\r'; }, ' ');
+
+	const Cartridge::header_s& header = record.header;
+	out << path << '\t' << record.size << '\t' << record.status << '\t';
+	if (header.magic)
+		out << header.mapper << '\t' << header.prgSize / 1024 << '\t' << header.chrSize / 1024 << '\t'
+			<< mirroring[header.mirroring] << '\t' << (header.battery ? "yes" : "no") << '\t';
+	else
+		out << "-\t-\t-\t-\t-\t";
+	out << hashes << '\t' << record.frames << '\t' << (record.detail.empty() ? "-" : record.detail) << '\n';
+}
+
+/*
+* Scan images made here that differ only in their headers: plain iNES, with a
+* trainer, NES 2.0 with a submapper in byte 8, and iNES with "DiskDude!" junk.
+* The program draws a tile and loops; everywhere else is KIL, so reading PRG
+* from the wrong offset jams or leaves the screen blank. Every variant must
+* boot, hash and size its PRG RAM as the plain one does.
+*/
+bool selfTest()
+{
+	static const uint8_t program[] = {
+		0x78, 0xA2, 0xFF, 0x9A, // SEI, LDX #$FF, TXS
+		0x2C, 0x02, 0x20, 0x10, 0xFB, 0x2C, 0x02, 0x20, 0x10, 0xFB, // Two V-Blanks for the PPU to warm up
+		0xA9, 0x3F, 0x8D, 0x06, 0x20, 0xA9, 0x00, 0x8D, 0x06, 0x20, // Palette: black, white
+		0xA9, 0x0F, 0x8D, 0x07, 0x20, 0xA9, 0x30, 0x8D, 0x07, 0x20,
+		0xA9, 0x20, 0x8D, 0x06, 0x20, 0xA9, 0x00, 0x8D, 0x06, 0x20, // Tile 1 in the top left corner
+		0xA9, 0x01, 0x8D, 0x07, 0x20,
+		0xA9, 0x00, 0x8D, 0x05, 0x20, 0x8D, 0x05, 0x20, // No scroll
+		0xA9, 0x0A, 0x8D, 0x01, 0x20, // Background on, left column included
+		0x4C, 0x3E, 0x80 // JMP to itself
+	};
+
+	std::vector<uint8_t> prg(0x4000, 0x02), chr(0x2000, 0x00);
+	memcpy(prg.data(), program, sizeof(program));
+	const uint8_t vectors[] = { 0x3E, 0x80, 0x00, 0x80, 0x3E, 0x80 }; // NMI and IRQ never fire
+	memcpy(prg.data() + 0x3FFA, vectors, sizeof(vectors));
+	memset(chr.data() + 0x10, 0xFF, 8);
+
+	auto image = [&](const char* header, bool trainer) {
+		std::vector<uint8_t> data(header, header + 16);
+		if (trainer)
+			data.insert(data.end(), 512, 0x02);
+		data.insert(data.end(), prg.begin(), prg.end());
+		data.insert(data.end(), chr.begin(), chr.end());
+		return data;
+	};
+	const char* names[] = { "plain", "trainer", "nes2", "diskdude" };
+	std::vector<uint8_t> images[] = {
+		image("NES\x1A\x01\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00", false),
+		image("NES\x1A\x01\x01\x04\x00\x00\x00\x00\x00\x00\x00\x00\x00", true),
+		image("NES\x1A\x01\x01\x00\x08\x10\x00\x07\x00\x00\x00\x00\x00", false),
+		image("NES\x1A\x01\x01\x00" "DiskDude!", false)
+	};
+
+	APU::initialize();
+	PPU::initialize();
+	bool passed = true;
+	record_s plain;
+	uint32_t plainStateSize = 0;
+	for (int i = 0; i < 4; ++i)
+	{
+		record_s record;
+		record.path = names[i];
+		scanImage(images[i].data(), images[i].size(), 10, record);
+		writeRecord(std::cout, record);
+
+		Mapper* mapper = Cartridge::create(images[i].data(), images[i].size());
+		uint32_t stateSize = mapper ? mapper->state_size() : 0;
+		bool trainerLoaded = !mapper || !record.header.trainer || mapper->read(0x7000) == 0x02;
+		delete mapper;
+		if (i == 0)
+		{
+			plain = record;
+			plainStateSize = stateSize;
+		}
+
+		const char* problem = nullptr;
+		if (strcmp(record.status, "boots") != 0 || record.header.mapper != 0 || record.prgCrc != plain.prgCrc || record.chrCrc != plain.chrCrc)
+			problem = "does not boot and hash as the plain image does";
+		else if (stateSize != plainStateSize)
+			problem = "has a different PRG RAM size from the plain image";
+		else if (!trainerLoaded)
+			problem = "does not have its trainer at $7000";
+		if (problem)
+		{
+			std::cout << "FAIL: " << names[i] << ' ' << problem << std::endl;
+			passed = false;
+		}
+	}
+	std::cout << "self-test " << (passed ? "passed" : "FAILED") << std::endl;
+	return passed;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* root = nullptr;
+	const char* outPath = nullptr;
+	uint32_t frames = 60;
+	int threadCount = (int)std::thread::hardware_concurrency();
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+			frames = strtoul(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			threadCount = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+			outPath = argv[++i];
+		else if (strcmp(argv[i], "--self-test") == 0)
+			return selfTest() ? 0 : 1;
+		else if (argv[i][0] != '-' && !root)
+			root = argv[i];
+		else
+		{
+			usage();
+			return 2;
+		}
+	}
+	if (!root)
+	{
+		usage();
+		return 2;
+	}
+	if (threadCount < 1)
+		threadCount = 1;
+
+	WorkQueue queue;
+	queue.addDirectory(root);
+	std::atomic<uint64_t> directoryCount(0);
+	std::vector<std::vector<record_s>> results(threadCount);
+
+	auto begin = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threadCount; ++t)
+	{
+		workers.emplace_back([&, t] {
+			APU::initialize(); // Chip memory for this thread's console, reused for every ROM
+			PPU::initialize();
+
+			std::string path;
+			bool isDirectory;
+			while (queue.take(path, isDirectory))
+			{
+				if (isDirectory)
+				{
+					listDirectory(path, queue, directoryCount);
+					queue.doneListing();
+				}
+				else
+				{
+					results[t].emplace_back();
+					scanFile(path, frames, results[t].back());
+				}
+			}
+		});
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	std::vector<const record_s*> records;
+	for (const std::vector<record_s>& list : results)
+		for (const record_s& record : list)
+			records.push_back(&record);
+	std::sort(records.begin(), records.end(), [](const record_s* a, const record_s* b) { return a->path < b->path; });
+
+	std::ofstream file;
+	if (outPath)
+	{
+		file.open(outPath, std::ios::binary);
+		if (!file)
+		{
+			std::cerr << "Could not write " << outPath << std::endl;
+			return 1;
+		}
+	}
+	std::ostream& out = outPath ? file : std::cout;
+	out << "#path\tsize\tstatus\tmapper\tprg_kb\tchr_kb\tmirroring\tbattery\trom_crc\tprg_crc\tchr_crc\tframes\tdetail\n";
+
+	uint64_t bytes = 0;
+	const char* statuses[] = { "boots", "blank", "jam", "unemulated", "unsupported", "invalid" };
+	size_t counts[6] = {};
+	for (const record_s* record : records)
+	{
+		writeRecord(out, *record);
+		bytes += record->size;
+		for (int s = 0; s < 6; ++s)
+			counts[s] += strcmp(record->status, statuses[s]) == 0;
+	}
+	out.flush();
+
+	std::cerr << records.size() << " ROMs in " << directoryCount.load() << " directories, " << bytes / 1048576.0 << " MB in "
+		<< seconds << " s (" << (seconds > 0 ? records.size() / seconds : 0) << " ROMs/s, "
+		<< (seconds > 0 ? bytes / 1048576.0 / seconds : 0) << " MB/s) on " << threadCount << " threads" << std::endl;
+	for (int s = 0; s < 6; ++s)
+		std::cerr << "  " << statuses[s] << ": " << counts[s] << std::endl;
+	return out ? 0 : 1;
+}
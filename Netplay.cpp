@@ -0,0 +1,431 @@
+#include "Netplay.h"
+#include "Cartridge.h"
+#include "Console.h"
+#include "Controller.h"
+#include "CPU.h"
+#include "Hash.h"
+#include "PPU.h"
+
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace Netplay
+{
+	const uint32_t magic = 0x54454E4E; // "NNET"
+
+	/*
+	* Udp
+	*/
+	Udp::Udp() : socket(-1), remoteLength(0)
+	{
+	}
+
+	Udp::~Udp()
+	{
+		if (socket == -1)
+			return;
+#ifdef _WIN32
+		closesocket((SOCKET)socket);
+		WSACleanup();
+#else
+		::close((int)socket);
+#endif
+	}
+
+	/*
+	* Bind localPort on every interface and resolve the peer. Returns false if
+	* either fails.
+	*/
+	bool Udp::open(uint16_t localPort, const char* remoteHost, uint16_t remotePort)
+	{
+#ifdef _WIN32
+		WSADATA data;
+		if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+			return false;
+#endif
+		struct addrinfo hints = {};
+		struct addrinfo* found = nullptr;
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+		if (getaddrinfo(remoteHost, std::to_string(remotePort).c_str(), &hints, &found) != 0 || !found || found->ai_addrlen > sizeof(remote))
+		{
+			if (found)
+				freeaddrinfo(found);
+			return false;
+		}
+		memcpy(remote, found->ai_addr, found->ai_addrlen);
+		remoteLength = (int)found->ai_addrlen;
+		int family = found->ai_family;
+		freeaddrinfo(found);
+
+		// Bound to the peer's address family on the wildcard address.
+		hints.ai_family = family;
+		hints.ai_flags = AI_PASSIVE;
+		if (getaddrinfo(nullptr, std::to_string(localPort).c_str(), &hints, &found) != 0 || !found)
+			return false;
+#ifdef _WIN32
+		SOCKET fd = ::socket(family, SOCK_DGRAM, IPPROTO_UDP);
+		u_long nonBlocking = 1;
+		bool ready = fd != INVALID_SOCKET && ioctlsocket(fd, FIONBIO, &nonBlocking) == 0 && bind(fd, found->ai_addr, (int)found->ai_addrlen) == 0;
+		if (!ready && fd != INVALID_SOCKET)
+			closesocket(fd);
+#else
+		int fd = ::socket(family, SOCK_DGRAM, 0);
+		bool ready = fd >= 0 && fcntl(fd, F_SETFL, O_NONBLOCK) == 0 && bind(fd, found->ai_addr, found->ai_addrlen) == 0;
+		if (!ready && fd >= 0)
+			::close(fd);
+#endif
+		freeaddrinfo(found);
+		if (!ready)
+			return false;
+		socket = (intptr_t)fd;
+		return true;
+	}
+
+	void Udp::send(const packet_s& packet)
+	{
+		if (socket != -1)
+			sendto(socket, (const char*)&packet, sizeof(packet), 0, (const struct sockaddr*)remote, remoteLength);
+	}
+
+	bool Udp::receive(packet_s& packet)
+	{
+		if (socket == -1)
+			return false;
+		// Anything that is not a whole packet is skipped.
+		for (;;)
+		{
+			int size = (int)recv(socket, (char*)&packet, sizeof(packet), 0);
+			if (size < 0)
+				return false;
+			if (size == (int)sizeof(packet))
+				return true;
+		}
+	}
+
+	/*
+	* Loopback
+	*/
+	Loopback::Loopback(int latency, int lossPercent) : now(0), latency(latency), lossPercent(lossPercent), random(0x2545F491)
+	{
+		for (int side = 0; side < 2; ++side)
+		{
+			ends[side].link = this;
+			ends[side].side = side;
+		}
+	}
+
+	Transport& Loopback::end(int side)
+	{
+		return ends[side];
+	}
+
+	/*
+	* One host frame passes.
+	*/
+	void Loopback::tick()
+	{
+		++now;
+	}
+
+	void Loopback::End::send(const packet_s& packet)
+	{
+		// xorshift32
+		link->random ^= link->random << 13;
+		link->random ^= link->random >> 17;
+		link->random ^= link->random << 5;
+		if ((int)(link->random % 100) < link->lossPercent)
+			return;
+		link->queues[1 - side].push_back({ link->now + link->latency, packet });
+	}
+
+	bool Loopback::End::receive(packet_s& packet)
+	{
+		std::deque<flight_s>& queue = link->queues[side];
+		if (queue.empty() || queue.front().due > link->now)
+			return false;
+		packet = queue.front().packet;
+		queue.pop_front();
+		return true;
+	}
+
+	/*
+	* Session
+	*/
+	Session::Session(Transport& transport, int localPort, int maxRollback, int inputDelay)
+		: transport(transport), localPort(localPort & 1),
+		maxRollback(maxRollback < 1 ? 1 : maxRollback > 32 ? 32 : maxRollback),
+		inputDelay(inputDelay < 0 ? 0 : inputDelay > 15 ? 15 : inputDelay),
+		current(0), remoteCount(0), acked(0), rollbackFrom(UINT32_MAX), remoteFrame(0), remoteAdvantage(0),
+		lastCheckFrame(0), peerCheckFrame(0), peerChecksum(0), stats()
+	{
+		memset(localInput, 0, sizeof(localInput));
+		memset(remoteInput, 0, sizeof(remoteInput));
+		memset(remoteKnown, 0, sizeof(remoteKnown));
+		memset(usedInput, 0, sizeof(usedInput));
+		memset(checksums, 0, sizeof(checksums));
+		memset(checksumFrames, 0xFF, sizeof(checksumFrames));
+		snapshots.resize(this->maxRollback + 1);
+		snapshotFrames.assign(this->maxRollback + 1, UINT32_MAX);
+		localCount = this->inputDelay; // The first frames run with nothing held.
+		checkedCount = 0;
+	}
+
+	/*
+	* Run the next frame with buttons held on this side's port, after
+	* applying whatever the peer has sent. Returns false without running
+	* anything (and without taking the buttons) while stalled: the peer's input
+	* is more than maxRollback frames behind, so a misprediction could no
+	* longer be undone.
+	*/
+	bool Session::advance(uint8_t buttons)
+	{
+		update();
+		if ((int32_t)(current - remoteCount) >= maxRollback || localCount - acked >= sizeof(packet_s::inputs))
+		{
+			++stats.stalls;
+			send(); // Keep acknowledging, or the peer may stall too.
+			return false;
+		}
+
+		localInput[localCount % HISTORY] = buttons;
+		++localCount;
+		send();
+
+		saveSnapshot(current);
+		runFrame(current, true);
+		++current;
+		++stats.frames;
+		return true;
+	}
+
+	/*
+	* Take in the peer's packets, correct any misprediction, and resend what
+	* the peer has not acknowledged. advance() does this itself; call it on
+	* host frames that don't advance, to keep the link moving.
+	*/
+	void Session::poll()
+	{
+		update();
+		send();
+	}
+
+	void Session::update()
+	{
+		receive();
+		if (rollbackFrom != UINT32_MAX)
+			rollback();
+		updateChecksums();
+	}
+
+	void Session::receive()
+	{
+		packet_s packet;
+		uint32_t rom = Cartridge::crc();
+		while (transport.receive(packet))
+		{
+			if (packet.magic != magic || packet.rom != rom || packet.count > sizeof(packet.inputs))
+				continue;
+
+			// Packets can arrive out of order; only ever move forward.
+			if ((int32_t)(packet.frame - remoteFrame) >= 0)
+			{
+				remoteFrame = packet.frame;
+				remoteAdvantage = packet.advantage;
+			}
+			if (packet.ack > acked && packet.ack <= localCount)
+				acked = packet.ack;
+			if (packet.checkFrame > peerCheckFrame)
+			{
+				peerCheckFrame = packet.checkFrame;
+				peerChecksum = packet.checksum;
+			}
+
+			for (uint32_t i = 0; i < packet.count; ++i)
+			{
+				uint32_t inputFrame = packet.first + i;
+				uint32_t slot = inputFrame % HISTORY;
+				// Far enough ahead would overwrite the newest confirmed input, which predictions use.
+				if (inputFrame < remoteCount || inputFrame >= remoteCount + HISTORY / 2 || remoteKnown[slot])
+					continue;
+
+				remoteInput[slot] = packet.inputs[i];
+				remoteKnown[slot] = true;
+				if (inputFrame < current && usedInput[slot] != packet.inputs[i] && inputFrame < rollbackFrom)
+					rollbackFrom = inputFrame;
+			}
+			while (remoteKnown[remoteCount % HISTORY])
+			{
+				remoteKnown[remoteCount % HISTORY] = false; // The slot is next reused HISTORY frames on.
+				++remoteCount;
+			}
+		}
+		compareChecksums();
+	}
+
+	void Session::send()
+	{
+		packet_s packet = {};
+		packet.magic = magic;
+		packet.rom = Cartridge::crc();
+		packet.frame = current;
+		packet.advantage = (int32_t)(current - remoteFrame);
+		packet.ack = remoteCount;
+		packet.first = acked;
+		packet.checkFrame = lastCheckFrame;
+		packet.checksum = lastCheckFrame ? checksums[lastCheckFrame % HISTORY] : 0;
+
+		uint32_t count = localCount - acked;
+		packet.count = (uint16_t)(count < sizeof(packet.inputs) ? count : sizeof(packet.inputs));
+		for (uint32_t i = 0; i < packet.count; ++i)
+			packet.inputs[i] = localInput[(acked + i) % HISTORY];
+		transport.send(packet);
+	}
+
+	/*
+	* Rewind to the first mispredicted frame and re-run every frame since,
+	* with the corrected input and without composing the picture.
+	*/
+	void Session::rollback()
+	{
+		uint32_t from = rollbackFrom;
+		rollbackFrom = UINT32_MAX;
+		Savestate::Snapshot& snapshot = snapshots[from % snapshots.size()];
+		if (snapshotFrames[from % snapshots.size()] != from)
+			return; // Outside the window; cannot happen while stalls are honoured.
+
+		auto begin = std::chrono::steady_clock::now();
+		Savestate::load(snapshot);
+		auto loaded = std::chrono::steady_clock::now();
+		for (uint32_t replay = from; replay < current; ++replay)
+		{
+			if (replay != from)
+				saveSnapshot(replay);
+			runFrame(replay, false);
+		}
+		auto end = std::chrono::steady_clock::now();
+
+		double loadSeconds = std::chrono::duration<double>(loaded - begin).count();
+		double resimSeconds = std::chrono::duration<double>(end - loaded).count();
+		uint32_t frames = current - from;
+		++stats.rollbacks;
+		++stats.loads;
+		stats.loadSeconds += loadSeconds;
+		stats.resimulated += frames;
+		stats.resimSeconds += resimSeconds;
+		if (frames > stats.maxResimulated)
+			stats.maxResimulated = frames;
+		if (loadSeconds + resimSeconds > stats.maxRollbackSeconds)
+			stats.maxRollbackSeconds = loadSeconds + resimSeconds;
+	}
+
+	/*
+	* Run one frame with this side's input and the peer's, or the prediction
+	* of it: whatever they held in the newest frame heard from them.
+	*/
+	void Session::runFrame(uint32_t number, bool render)
+	{
+		uint32_t slot = number % HISTORY;
+		uint8_t remote;
+		if (number < remoteCount || remoteKnown[slot])
+			remote = remoteInput[slot];
+		else
+			remote = remoteCount > 0 ? remoteInput[(remoteCount - 1) % HISTORY] : 0;
+		usedInput[slot] = remote;
+
+		Controller::setButtons(localPort, localInput[slot]);
+		Controller::setButtons(1 - localPort, remote);
+		PPU::setSkipRender(!render);
+		Console::runFrame();
+		PPU::setSkipRender(false);
+	}
+
+	void Session::saveSnapshot(uint32_t number)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		Savestate::save(snapshots[number % snapshots.size()]);
+		snapshotFrames[number % snapshots.size()] = number;
+		stats.saveSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		++stats.saves;
+	}
+
+	/*
+	* Checksum the RAM of every snapshot that has become final: all input
+	* before it is confirmed and any rollback has been applied. The peer gets
+	* the newest one and compares it against its own for the same frame.
+	*/
+	void Session::updateChecksums()
+	{
+		uint32_t confirmed = remoteCount < current ? remoteCount : (current > 0 ? current - 1 : 0);
+		for (; checkedCount <= confirmed; ++checkedCount)
+		{
+			uint32_t index = checkedCount % snapshots.size();
+			if (checkedCount == 0 || snapshotFrames[index] != checkedCount)
+				continue;
+			checksums[checkedCount % HISTORY] = Hash::crc32(snapshots[index].cpu.ram, sizeof(snapshots[index].cpu.ram));
+			checksumFrames[checkedCount % HISTORY] = checkedCount;
+			lastCheckFrame = checkedCount;
+		}
+		compareChecksums();
+	}
+
+	void Session::compareChecksums()
+	{
+		uint32_t slot = peerCheckFrame % HISTORY;
+		if (stats.desynced || peerCheckFrame == 0 || checksumFrames[slot] != peerCheckFrame)
+			return;
+		if (checksums[slot] != peerChecksum)
+		{
+			stats.desynced = true;
+			stats.desyncFrame = peerCheckFrame;
+		}
+	}
+
+	/*
+	* Frames this side should skip to let the peer catch up, as in GGPO: half
+	* the difference between how far each side is ahead of what it has heard
+	* from the other. Equal latency both ways cancels out.
+	*/
+	int Session::idleFrames() const
+	{
+		int advantage = (int)(int32_t)(current - remoteFrame);
+		int idle = (advantage - remoteAdvantage) / 2;
+		return idle > 0 ? idle : 0;
+	}
+
+	uint32_t Session::frame() const
+	{
+		return current;
+	}
+
+	/*
+	* Frames below this ran with the peer's real input and are final.
+	*/
+	uint32_t Session::confirmedFrame() const
+	{
+		return remoteCount < current ? remoteCount : current;
+	}
+
+	int Session::getInputDelay() const
+	{
+		return inputDelay;
+	}
+
+	const stats_s& Session::getStats() const
+	{
+		return stats;
+	}
+}
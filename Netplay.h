@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#include "Savestate.h"
+
+/*
+* Two-player netplay with rollback. Each side runs the whole console with its
+* own input and a prediction of the other's: the remote player is assumed to
+* keep holding what they last sent. When their real input for a frame arrives
+* and differs from what was predicted, the console is rewound to that frame and
+* re-run to the present with rendering skipped, all within one host frame.
+*
+* Sessions run on the calling thread's console and save it into a ring of
+* snapshots once a frame, so both sides must start from the same state: same
+* ROM, just powered on, battery saves off.
+*/
+namespace Netplay
+{
+	/*
+	* One datagram. Every packet repeats all local input the peer has not yet
+	* acknowledged, so a lost packet costs nothing but latency.
+	*/
+	typedef struct {
+		uint32_t magic;
+		uint32_t rom; // ROM CRC-32; packets for another game are dropped
+		uint32_t frame; // Sender's current frame
+		int32_t advantage; // How many frames the sender is ahead of what it has heard from us
+		uint32_t ack; // Frames of our input the sender has, contiguous from 0
+		uint32_t first; // Frame of inputs[0]
+		uint32_t checkFrame; // Frame whose starting RAM CRC is in checksum; 0 = none yet
+		uint32_t checksum;
+		uint16_t count;
+		uint8_t inputs[64];
+	} packet_s;
+
+	/*
+	* Carries packets to the peer. Unreliable and unordered, like UDP.
+	*/
+	class Transport
+	{
+	public:
+		virtual ~Transport() {}
+		virtual void send(const packet_s& packet) = 0;
+		virtual bool receive(packet_s& packet) = 0; // Non-blocking; false when nothing is waiting
+	};
+
+	/*
+	* A UDP socket talking to one peer, which may be on the same machine.
+	*/
+	class Udp : public Transport
+	{
+		intptr_t socket;
+		uint8_t remote[128]; // sockaddr_storage of the peer
+		int remoteLength;
+
+	public:
+		Udp();
+		~Udp();
+		bool open(uint16_t localPort, const char* remoteHost, uint16_t remotePort);
+		void send(const packet_s& packet) override;
+		bool receive(packet_s& packet) override;
+	};
+
+	/*
+	* Both ends of an in-process link, for testing. Packets take latency host
+	* frames (ticks) to arrive, and lossPercent of them never do. Loss is drawn
+	* from a fixed seed, so a run repeats exactly.
+	*/
+	class Loopback
+	{
+		class End : public Transport
+		{
+		public:
+			Loopback* link;
+			int side;
+			void send(const packet_s& packet) override;
+			bool receive(packet_s& packet) override;
+		};
+
+		typedef struct {
+			uint64_t due;
+			packet_s packet;
+		} flight_s;
+
+		End ends[2];
+		std::deque<flight_s> queues[2]; // Packets on their way to each side
+		uint64_t now;
+		int latency;
+		int lossPercent;
+		uint32_t random;
+
+	public:
+		Loopback(int latency, int lossPercent);
+		Transport& end(int side);
+		void tick();
+	};
+
+	typedef struct {
+		uint32_t frames; // Frames run for the first time
+		uint32_t stalls; // Host frames spent waiting for the peer, beyond the rollback window
+		uint32_t rollbacks;
+		uint32_t resimulated; // Frames re-run by rollbacks
+		uint32_t maxResimulated; // Most frames re-run in one host frame
+		uint32_t saves, loads;
+		double saveSeconds, loadSeconds;
+		double resimSeconds; // Re-running frames, not counting the load
+		double maxRollbackSeconds; // Longest load and re-run in one host frame
+		bool desynced;
+		uint32_t desyncFrame;
+	} stats_s;
+
+	class Session
+	{
+		static const uint32_t HISTORY = 128; // Frames of input kept; bounds maxRollback + inputDelay
+
+		Transport& transport;
+		int localPort;
+		int maxRollback;
+		int inputDelay;
+
+		uint32_t current; // Next frame to run
+		uint32_t localCount; // Local input known for frames below this
+		uint32_t remoteCount; // Remote input known for every frame below this
+		uint32_t acked; // Frames of local input the peer has
+		uint32_t rollbackFrom; // Earliest mispredicted frame, or UINT32_MAX
+		uint32_t remoteFrame; // The peer's current frame as last reported
+		int32_t remoteAdvantage;
+
+		uint8_t localInput[HISTORY];
+		uint8_t remoteInput[HISTORY];
+		bool remoteKnown[HISTORY];
+		uint8_t usedInput[HISTORY]; // Remote input each frame last ran with
+
+		std::vector<Savestate::Snapshot> snapshots; // Console at the start of each recent frame
+		std::vector<uint32_t> snapshotFrames;
+		uint32_t checksums[HISTORY]; // RAM CRC at the start of each confirmed frame
+		uint32_t checksumFrames[HISTORY];
+		uint32_t checkedCount; // Frames below this have been considered for a checksum
+		uint32_t lastCheckFrame; // Newest confirmed checksum, sent to the peer
+		uint32_t peerCheckFrame, peerChecksum;
+
+		stats_s stats;
+
+		void update();
+		void receive();
+		void send();
+		void rollback();
+		void runFrame(uint32_t number, bool render);
+		void saveSnapshot(uint32_t number);
+		void updateChecksums();
+		void compareChecksums();
+
+	public:
+		/*
+		* localPort is the controller port this side plays on (0 or 1). Local
+		* input is applied inputDelay frames after it is given, which hides
+		* that much latency without rolling back.
+		*/
+		Session(Transport& transport, int localPort, int maxRollback = 8, int inputDelay = 0);
+
+		bool advance(uint8_t buttons);
+		void poll();
+		int idleFrames() const;
+
+		uint32_t frame() const;
+		uint32_t confirmedFrame() const;
+		int getInputDelay() const;
+		const stats_s& getStats() const;
+	};
+}
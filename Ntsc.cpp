@@ -0,0 +1,188 @@
+#include "Ntsc.h"
+#include "PPU.h"
+#include "WorkerPool.h"
+
+#include <cmath>
+#include <memory>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace Ntsc
+{
+	const int samplesPerPixel = 8; // The PPU's master clock runs at 8 samples per dot.
+	const int rowSamples = PPU_WIDTH * samplesPerPixel;
+
+	/*
+	* Signal levels from the NESdev wiki's NTSC video article, relative to sync.
+	*/
+	const float black = 0.518f, white = 1.962f, attenuation = 0.746f;
+	const float hue = 3.9f; // Decoder phase relative to the colour burst, in twelfths of a cycle
+	const float levels[8] = {
+		0.350f, 0.518f, 0.962f, 1.550f, // Signal low
+		1.094f, 1.506f, 1.962f, 1.962f  // Signal high
+	};
+
+	float samples[64][12][samplesPerPixel]; // Signal for each index, by subcarrier phase of its first sample
+	int samplesEmphasis = -1; // Emphasis bits the table was built for
+	float cosine[12], sine[12];
+	alignas(32) int windowBegin[NTSC_WIDTH + 8], windowEnd[NTSC_WIDTH + 8];
+
+	std::unique_ptr<WorkerPool> pool;
+	int threadCount = 0;
+
+	bool inColorPhase(int color, int phase)
+	{
+		return (color + phase) % 12 < 6;
+	}
+
+	/*
+	* Build the per-index signal for one set of emphasis bits, and the decoder's
+	* fixed tables the first time through.
+	*/
+	void buildTables(int emphasis)
+	{
+		for (int index = 0; index < 64; ++index)
+		{
+			int color = index & 0x0F;
+			int level = color > 13 ? 1 : (index >> 4) & 3; // Columns $E/$F are forced to black.
+			float low = levels[level + 4 * (color == 0x0)];
+			float high = levels[level + 4 * (color < 0xD)];
+
+			for (int phase = 0; phase < 12; ++phase)
+			{
+				for (int k = 0; k < samplesPerPixel; ++k)
+				{
+					int p = (phase + k) % 12;
+					float signal = inColorPhase(color, p) ? high : low;
+					if (((emphasis & 1) && inColorPhase(0, p)) || ((emphasis & 2) && inColorPhase(4, p)) || ((emphasis & 4) && inColorPhase(8, p)))
+						signal *= attenuation;
+					samples[index][phase][k] = (signal - black) / (white - black) / 12.0f;
+				}
+			}
+		}
+
+		if (samplesEmphasis < 0)
+		{
+			for (int p = 0; p < 12; ++p)
+			{
+				cosine[p] = (float)cos(3.14159265358979 * (p + hue) / 6);
+				sine[p] = (float)sin(3.14159265358979 * (p + hue) / 6);
+			}
+			for (int x = 0; x < NTSC_WIDTH + 8; ++x)
+			{
+				int center = (x < NTSC_WIDTH ? x : NTSC_WIDTH - 1) * rowSamples / NTSC_WIDTH;
+				windowBegin[x] = center - 6 < 0 ? 0 : center - 6;
+				windowEnd[x] = center + 6 > rowSamples ? rowSamples : center + 6;
+			}
+		}
+		samplesEmphasis = emphasis;
+	}
+
+	/*
+	* Encode one row into the signal, kept as running sums of luma and of the
+	* two chroma products so that each output pixel's window is three subtractions.
+	*/
+	void encodeRow(const uint8_t* in, uint8_t keep, int phase, float* luma, float* inPhase, float* quadrature)
+	{
+		luma[0] = inPhase[0] = quadrature[0] = 0.0f;
+		int p = phase;
+		for (int x = 0; x < PPU_WIDTH; ++x)
+		{
+			const float* signal = samples[in[x] & keep][p];
+			for (int k = 0; k < samplesPerPixel; ++k)
+			{
+				int s = x * samplesPerPixel + k;
+				luma[s + 1] = luma[s] + signal[k];
+				inPhase[s + 1] = inPhase[s] + signal[k] * cosine[(p + k) % 12];
+				quadrature[s + 1] = quadrature[s] + signal[k] * sine[(p + k) % 12];
+			}
+			p = (p + samplesPerPixel) % 12;
+		}
+	}
+
+	inline uint32_t pack(float y, float i, float q)
+	{
+		auto clamp = [](float v) { return v < 0.0f ? 0u : v > 255.0f ? 255u : (uint32_t)v; };
+		uint32_t r = clamp((y + 0.946882f * i + 0.623557f * q) * 255.0f);
+		uint32_t g = clamp((y - 0.274788f * i - 0.635691f * q) * 255.0f);
+		uint32_t b = clamp((y - 1.108545f * i + 1.709007f * q) * 255.0f);
+		return r << 24 | g << 16 | b << 8 | 0xFF;
+	}
+
+	/*
+	* Decode a row: YIQ over each output pixel's window, then to RGBA.
+	*/
+	void decodeRow(const float* luma, const float* inPhase, const float* quadrature, uint32_t* out)
+	{
+		int x = 0;
+#if defined(__AVX2__)
+		// Eight output pixels at a time: gather the window ends from the running
+		// sums, then the YIQ to RGB matrix and packing in vector registers.
+		const __m256 scale = _mm256_set1_ps(255.0f);
+		const __m256i zero = _mm256_setzero_si256(), full = _mm256_set1_epi32(255);
+		for (; x + 8 <= NTSC_WIDTH; x += 8)
+		{
+			__m256i begin = _mm256_load_si256((const __m256i*)&windowBegin[x]);
+			__m256i end = _mm256_load_si256((const __m256i*)&windowEnd[x]);
+			__m256 y = _mm256_sub_ps(_mm256_i32gather_ps(luma, end, 4), _mm256_i32gather_ps(luma, begin, 4));
+			__m256 i = _mm256_sub_ps(_mm256_i32gather_ps(inPhase, end, 4), _mm256_i32gather_ps(inPhase, begin, 4));
+			__m256 q = _mm256_sub_ps(_mm256_i32gather_ps(quadrature, end, 4), _mm256_i32gather_ps(quadrature, begin, 4));
+
+			auto channel = [&](float ci, float cq) {
+				__m256 v = _mm256_add_ps(y, _mm256_add_ps(_mm256_mul_ps(i, _mm256_set1_ps(ci)), _mm256_mul_ps(q, _mm256_set1_ps(cq))));
+				__m256i c = _mm256_cvttps_epi32(_mm256_mul_ps(v, scale));
+				return _mm256_min_epi32(_mm256_max_epi32(c, zero), full);
+			};
+			__m256i r = channel(0.946882f, 0.623557f);
+			__m256i g = channel(-0.274788f, -0.635691f);
+			__m256i b = channel(-1.108545f, 1.709007f);
+
+			__m256i rgba = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 24), _mm256_slli_epi32(g, 16)),
+				_mm256_or_si256(_mm256_slli_epi32(b, 8), full));
+			_mm256_storeu_si256((__m256i*)&out[x], rgba);
+		}
+#endif
+		for (; x < NTSC_WIDTH; ++x)
+		{
+			int begin = windowBegin[x], end = windowEnd[x];
+			out[x] = pack(luma[end] - luma[begin], inPhase[end] - inPhase[begin], quadrature[end] - quadrature[begin]);
+		}
+	}
+
+	/*
+	* Threads to split rows across, counting the caller; 0 is one per hardware thread.
+	*/
+	void setThreads(int count)
+	{
+		pool.reset(new WorkerPool(count));
+		threadCount = pool->size();
+	}
+
+	/*
+	* Filter a PPU_WIDTH x PPU_HEIGHT frame of palette indices into NTSC_WIDTH x
+	* PPU_HEIGHT RGBA pixels. The frame number sets the subcarrier phase, which
+	* shifts from frame to frame as on hardware.
+	*/
+	void filter(const uint8_t* indices, void* pixels, int pitch, uint8_t mask, uint32_t frame)
+	{
+		if (!pool)
+			setThreads(0);
+		if (samplesEmphasis != mask >> 5)
+			buildTables(mask >> 5);
+
+		uint8_t keep = (mask & 0x01) ? 0x30 : 0x3F;
+		int chunks = threadCount * 4;
+		pool->run(chunks, [&](int chunk) {
+			alignas(32) float luma[rowSamples + 1], inPhase[rowSamples + 1], quadrature[rowSamples + 1];
+			for (int y = chunk * PPU_HEIGHT / chunks; y < (chunk + 1) * PPU_HEIGHT / chunks; ++y)
+			{
+				// 341 dots of 8 samples move the subcarrier 4 of its 12 phases per scanline.
+				int phase = (y * 4 + (frame & 1) * 4 + 8) % 12;
+				encodeRow(&indices[y * PPU_WIDTH], keep, phase, luma, inPhase, quadrature);
+				decodeRow(luma, inPhase, quadrature, (uint32_t*)((uint8_t*)pixels + y * pitch));
+			}
+		});
+	}
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+#define NTSC_WIDTH 602 // Seven output pixels per three PPU pixels, as in blargg's nes_ntsc
+
+/*
+* Composite video simulation: each PPU pixel becomes eight samples of the
+* NTSC signal the 2C02 would put out, which are then decoded back to RGB with
+* a one-colour-cycle window. Luma and chroma bleed into each other the way
+* they do on a TV, giving the usual fringes and artifact colours.
+*
+* Output is RGBA8888 like Palette::convert, NTSC_WIDTH x PPU_HEIGHT.
+*/
+namespace Ntsc
+{
+	void setThreads(int count);
+	void filter(const uint8_t* indices, void* pixels, int pitch, uint8_t mask, uint32_t frame);
+}
@@ -0,0 +1,109 @@
+#include "Observation.h"
+#include "ObservationRing.h"
+#include "Console.h"
+#include "Controller.h"
+#include "CPU.h"
+#include "PPU.h"
+#include "Savestate.h"
+
+#include <cstring>
+
+using namespace ObservationRing;
+
+namespace
+{
+	const uint32_t slotOffset = 256;
+}
+
+namespace Observation
+{
+	nes_obs* server = nullptr;
+
+	/*
+	* Create the shared-memory object, failing if one of that name exists.
+	*/
+	bool create(const char* name, int slots)
+	{
+		close();
+		if (slots < 1)
+			slots = 1;
+
+		server = map(name, slotOffset + (size_t)slots * sizeof(nes_obs_slot));
+		if (!server)
+			return false;
+
+		nes_obs_header* header = server->header;
+		memset(header, 0, slotOffset);
+		header->version = NES_OBS_VERSION;
+		header->slot_count = slots;
+		header->slot_size = sizeof(nes_obs_slot);
+		header->slot_offset = slotOffset;
+		word(header->magic).store(NES_OBS_MAGIC, std::memory_order_release); // Last, so a consumer never sees half a header
+		return true;
+	}
+
+	/*
+	* Run commands until the consumer sends NES_OBS_QUIT. RESET returns to the
+	* state the console was in when serve() was called.
+	*/
+	void serve()
+	{
+		if (!server)
+			return;
+
+		nes_obs_header* header = server->header;
+		Savestate::Snapshot start;
+		Savestate::save(start);
+		uint8_t* framebuffer = PPU::getFramebuffer();
+
+		uint32_t handled = word(header->request).load(std::memory_order_acquire);
+		bool quit = false;
+		while (!quit)
+		{
+			waitChange(header->request, handled, -1);
+			handled = word(header->request).load(std::memory_order_acquire);
+
+			switch (header->command)
+			{
+			case NES_OBS_STEP:
+				Controller::setButtons(0, header->buttons[0]);
+				Controller::setButtons(1, header->buttons[1]);
+				for (uint32_t i = 0; i < header->frames; ++i)
+				{
+					uint64_t step = header->steps + 1;
+					nes_obs_slot* target = slot(server, step);
+					word(target->step).store(0, std::memory_order_relaxed); // Being rewritten
+					std::atomic_thread_fence(std::memory_order_release);
+
+					PPU::setFramebuffer(target->framebuffer);
+					Console::runFrame();
+					memcpy(target->ram, CPU::getRam(), sizeof(target->ram));
+					target->frame = PPU::getFrameCount();
+					target->mask = PPU::getMask();
+
+					word(target->step).store(step, std::memory_order_release);
+					word(header->steps).store(step, std::memory_order_release);
+				}
+				break;
+			case NES_OBS_RESET:
+				Savestate::load(start);
+				break;
+			case NES_OBS_QUIT:
+				quit = true;
+				break;
+			}
+			ring(header->done, handled);
+		}
+
+		// The last slot is about to go away with the mapping.
+		PPU::setFramebuffer(framebuffer);
+		memcpy(framebuffer, slot(server, header->steps ? header->steps : 1)->framebuffer, PPU_WIDTH * PPU_HEIGHT);
+	}
+
+	void close()
+	{
+		if (server)
+			unmap(server);
+		server = nullptr;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "nes_observation.h"
+
+/*
+* The emulator side of nes_observation.h: owns the shared-memory ring and runs
+* the console on the consumer's commands. Frames are composed straight into
+* the slot they are published in; only the 2KB of work RAM is copied per step.
+*/
+namespace Observation
+{
+	bool create(const char* name, int slots);
+	void serve();
+	void close();
+}
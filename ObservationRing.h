@@ -0,0 +1,50 @@
+#pragma once
+
+#include "nes_observation.h"
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+/*
+* A mapping of the shared-memory object, on either side.
+*/
+struct nes_obs
+{
+	nes_obs_header* header = nullptr;
+	size_t size = 0;
+	std::string name;
+	bool owner = false; // The emulator side, which removes the object when done
+#ifdef _WIN32
+	HANDLE mapping = NULL;
+#endif
+};
+
+/*
+* What both sides of nes_observation.h share: mapping the object and the
+* doorbells. Lives in the nes_observation library with the consumer API, so
+* the emulator side builds on the same code a consumer links.
+*/
+namespace ObservationRing
+{
+	inline std::atomic<uint32_t>& word(uint32_t& field)
+	{
+		return *reinterpret_cast<std::atomic<uint32_t>*>(&field);
+	}
+
+	inline std::atomic<uint64_t>& word(uint64_t& field)
+	{
+		return *reinterpret_cast<std::atomic<uint64_t>*>(&field);
+	}
+
+	bool waitChange(uint32_t& field, uint32_t seen, int timeoutMs);
+	void ring(uint32_t& field, uint32_t value);
+
+	nes_obs* map(const char* name, size_t size);
+	void unmap(nes_obs* obs);
+	nes_obs_slot* slot(const nes_obs* obs, uint64_t step);
+}
@@ -0,0 +1,17 @@
+# Runs NESHeadless --serve and nes_observe side by side, for the observation.* tests.
+#   cmake -DSERVER=NESHeadless -DCONSUMER=nes_observe -DRING=name -DROM=rom -DFRAMES=n -DEXPECT=fb,ram -P ObservationTest.cmake
+# Commands given to one execute_process run at the same time, the consumer's standard
+# output piped into the emulator, which doesn't read it; the consumer reports failures on
+# standard error. Both check the CRCs: the consumer those of the slot it read, the
+# emulator those of the console once the consumer has told it to quit.
+execute_process(
+	COMMAND "${CONSUMER}" "${RING}" --frames "${FRAMES}" --expect "${EXPECT}"
+	COMMAND "${SERVER}" "${ROM}" --serve "${RING}" --expect "${EXPECT}"
+	RESULTS_VARIABLE results
+	OUTPUT_VARIABLE output
+	ERROR_VARIABLE output
+	TIMEOUT 300)
+message("${output}")
+if(NOT results STREQUAL "0;0")
+	message(FATAL_ERROR "Exit codes (consumer;emulator): ${results}")
+endif()
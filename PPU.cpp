@@ -1,79 +1,1161 @@
 #include "PPU.h"
+#include "Cartridge.h"
+#include "Timeline.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
 
 namespace PPU
 {
-	uint8_t* registers; // Registers for status, etc.
-	uint8_t* vram; // Video RAM
-	uint8_t* oam; // Object Attribute Memory
+	// Per thread, like every chip's state, so that each thread can run a console of its own.
+	thread_local uint8_t* registers; // Registers for status, etc.
+	thread_local uint8_t* vram; // Video RAM
+	thread_local uint8_t* oam; // Object Attribute Memory
+	thread_local uint8_t* framebuffer; // Palette indices, one byte per pixel
+
+	thread_local uint16_t dot = 0; // 0-340
+	thread_local uint16_t scanline = 0; // 0-261, 240 is post-render, 241-260 are V-Blank, 261 is pre-render
+	thread_local uint32_t frame = 0;
+	thread_local bool nmiPending = false; // Raised at the start of V-Blank, taken by the CPU before its next instruction.
+	thread_local uint16_t sprite0Dot = 0; // Dot at which sprite 0 hits on this scanline, 0 if it doesn't.
+
+	/*
+	* Internal scroll latches, named as on the NESdev wiki:
+	* v is the current VRAM address (0yyyNNYYYYYXXXXX), t the address being
+	* assembled by $2000/$2005/$2006 writes, fineX the 3-bit horizontal scroll,
+	* and w the shared first/second write toggle of $2005 and $2006.
+	*/
+	thread_local uint16_t v = 0;
+	thread_local uint16_t t = 0;
+	thread_local uint8_t fineX = 0;
+	thread_local uint8_t w = 0;
+	thread_local uint8_t dataBuffer = 0; // $2007 reads below the palette return the previous read.
+
+	/*
+	* Which 1KB page of nametable memory at $2000-$2FFF backs each of the four
+	* logical nametables. Only four-screen carts use pages 2 and 3.
+	*/
+	thread_local uint8_t nametablePage[4] = { 0, 0, 1, 1 };
+
+	thread_local pipeline_s pipe = {}; // Dot backend only
+
+	thread_local backend_e backend = SCANLINE;
+	thread_local uint64_t caughtUp = 0; // Timeline time the PPU has run to
+
+	const uint32_t vblankDot = 241 * 341 + 1;
+
+	thread_local bool skipRender = false;
+
+	/*
+	* Tables kept per line. They are most of the PPU's state by size but are
+	* only touched once a line, so they live on the heap, which keeps the
+	* thread-local block small enough for the shared library's initial-exec
+	* TLS model to fit in the static TLS a dlopen()ed library gets.
+	*
+	* Dirty tracking keeps a hash of each line as last composed and whether
+	* the line came out different this time. The sprite lists hold every OAM
+	* entry covering each line, in OAM order and without the 8-sprite limit, so
+	* evaluating a line is a lookup. They are rebuilt in one pass over OAM on the
+	* first evaluation after OAM or the sprite height changes, which for most
+	* games is once per frame after DMA.
+	*/
+	typedef struct {
+		uint64_t hashes[PPU_HEIGHT];
+		bool dirty[PPU_HEIGHT];
+		uint8_t sprites[PPU_HEIGHT + 1][64];
+		uint8_t spriteCount[PPU_HEIGHT + 1];
+	} lines_s;
+	thread_local std::unique_ptr<lines_s> lineTables;
+
+	inline lines_s& lines()
+	{
+		if (!lineTables)
+			lineTables.reset(new lines_s());
+		return *lineTables;
+	}
+
+	// Dirty tracking: the verdict for the whole frame.
+	thread_local int dirtyCount = 0;
+	thread_local bool hashesValid = false;
+	thread_local bool frameDirty = true;
+	thread_local uint8_t composedMask = 0;
+
+	thread_local int spriteListHeight = 0; // Of the sprite lists; 0 while they are stale
+	thread_local bool spriteLimit = true;
+
+	void scheduleEvents();
+
+	/*
+	* Dots the timeline has moved on since the PPU last caught up.
+	*/
+	inline uint32_t owedDots()
+	{
+		return uint32_t(Timeline::now() - caughtUp);
+	}
+
+	thread_local state_s* attached = nullptr; // Set while running directly on a caller's state.
+	thread_local uint8_t *homeRegisters, *homeVram, *homeOam;
 
 	void initialize()
 	{
-		registers = new uint8_t[0x2000]; // why is this 2000?
-		vram = new uint8_t[0x4000];
-		oam = new uint8_t[0x256];
+		registers = new uint8_t[8]();
+		vram = new uint8_t[0x4000]();
+		oam = new uint8_t[0x100]();
+		framebuffer = new uint8_t[PPU_WIDTH * PPU_HEIGHT]();
+		caughtUp = Timeline::now();
+		scheduleEvents();
+	}
+
+	/*
+	* Step v past a $2007 access, across a row when $2000 bit 2 is set.
+	*/
+	inline void incrementAddress()
+	{
+		v = (v + ((registers[0] & 0x04) ? 32 : 1)) & 0x7FFF;
 	}
 
 	uint8_t readRegister(uint16_t addr)
 	{
-		return registers[(addr - 0x2000) % 8]; // Read from non-mirrored address.
+		if (owedDots())
+			sync(); // The PPU catches up before the CPU looks.
+
+		switch (addr & 7) // Registers mirror every 8 bytes up to $3FFF.
+		{
+		case 2:
+		{
+			uint8_t value = registers[2];
+			registers[2] &= ~0x80; // Reading status acknowledges V-Blank.
+			w = 0;
+			return value;
+		}
+		case 4:
+			return oam[registers[3]];
+		case 7:
+		{
+			uint16_t addr = v & 0x3FFF;
+			uint8_t value;
+			if (addr < 0x3F00)
+			{
+				value = dataBuffer;
+				dataBuffer = readRam(addr);
+			}
+			else
+			{
+				value = readRam(addr); // Palette reads skip the buffer...
+				dataBuffer = readRam(addr - 0x1000); // ...which takes the nametable byte underneath.
+			}
+			incrementAddress();
+			return value;
+		}
+		default:
+			return registers[addr & 7]; // Write-only, return what was last written.
+		}
 	}
 
 	void writeRegister(uint16_t addr, uint8_t value)
 	{
-		registers[(addr - 0x2000) % 8] = value; // Write to non-mirrored address.
+		if (owedDots())
+			sync();
+
+		switch (addr & 7)
+		{
+		case 0:
+			// Enabling NMI during V-Blank fires one immediately.
+			if ((value & 0x80) && !(registers[0] & 0x80) && (registers[2] & 0x80))
+				nmiPending = true;
+
+			t = (t & ~0x0C00) | ((value & 0x03) << 10); // Base nametable
+			registers[0] = value;
+			break;
+		case 1:
+			registers[1] = value;
+			scheduleEvents(); // Rendering decides whether an odd frame is a dot short.
+			break;
+		case 2:
+			break; // Read-only
+		case 4:
+			oam[registers[3]++] = value;
+			spriteListHeight = 0;
+			break;
+		case 5:
+			if (!w)
+			{
+				t = (t & ~0x001F) | (value >> 3);
+				fineX = value & 0x07;
+			}
+			else
+			{
+				t = (t & ~0x73E0) | ((value & 0x07) << 12) | ((value & 0xF8) << 2);
+			}
+			w ^= 1;
+			break;
+		case 6:
+			if (!w)
+			{
+				t = (t & 0x00FF) | ((value & 0x3F) << 8);
+			}
+			else
+			{
+				t = (t & 0xFF00) | value;
+				v = t;
+			}
+			w ^= 1;
+			break;
+		case 7:
+			writeRam(v & 0x3FFF, value);
+			incrementAddress();
+			break;
+		default:
+			registers[addr & 7] = value;
+			break;
+		}
+	}
+
+	/*
+	* Location in vram of a nametable byte ($2000-$3EFF, $3000 and up mirroring $2000).
+	*/
+	inline uint16_t nametableAddress(uint16_t addr)
+	{
+		return 0x2000 | (nametablePage[(addr >> 10) & 3] << 10) | (addr & 0x3FF);
+	}
+
+	/*
+	* Location in vram of a palette byte. The sprite palettes' transparent
+	* entries ($3F10/$3F14/$3F18/$3F1C) are the background ones.
+	*/
+	inline uint16_t paletteAddress(uint16_t addr)
+	{
+		uint16_t index = addr & 0x1F;
+		return 0x3F00 | (index & ~(((index & 0x03) == 0) << 4));
 	}
 
 	uint8_t readRam(uint16_t addr)
 	{
-		if(addr < 0x3000 || addr >= 0x3F00 && addr < 0x3F20)
-		{
-			return vram[addr]; // All addressable locations
-		}
-		else if(addr >= 0x3000 && addr < 0x3F00)
+		addr &= 0x3FFF;
+		if(addr < 0x2000)
 		{
-			return vram[addr - 0x1000]; // Read from non-mirrored address.
+			return Cartridge::mapper->chr_read(addr); // Pattern tables live on the cartridge.
 		}
-		else if(addr >= 0x3F20 && addr < 0x4000)
+		else if(addr < 0x3F00)
 		{
-			return vram[(addr - 0x20) % 0x20]; // Read Palette RAM indexes every 0x20 increments.
+			return vram[nametableAddress(addr)];
 		}
 		else
 		{
-			throw "Could not read from PPU RAM at: " + addr;
+			return vram[paletteAddress(addr)];
 		}
 	}
 
 	void writeRam(uint16_t addr, uint8_t value)
 	{
-		if(addr < 0x3000 || addr >= 0x3F00 && addr < 0x3F20)
+		addr &= 0x3FFF;
+		if(addr < 0x2000)
 		{
-			vram[addr] = value; // All addressable locations
+			Cartridge::mapper->chr_write(addr, value);
 		}
-		else if(addr >= 0x3000 && addr < 0x3F00)
+		else if(addr < 0x3F00)
 		{
-			vram[addr - 0x1000] = value; // Write to non-mirrored address.
-		}
-		else if(addr >= 0x3F20 && addr < 0x4000)
-		{
-			vram[(addr - 0x20) % 0x20] = value; // Write to Palette RAM indexes every 0x20 increments.
+			vram[nametableAddress(addr)] = value;
 		}
 		else
 		{
-			throw "Could not write to PPU RAM at: " + addr;
+			vram[paletteAddress(addr)] = value;
 		}
 	}
 
+	/*
+	* Point the four logical nametables at physical pages. Called with the iNES
+	* header's arrangement when a cartridge loads, and by mappers that switch it.
+	*/
+	void setMirroring(mirroring_e mode)
+	{
+		static const uint8_t pages[5][4] = {
+			{ 0, 0, 1, 1 }, // HORIZONTAL
+			{ 0, 1, 0, 1 }, // VERTICAL
+			{ 0, 0, 0, 0 }, // SINGLE_SCREEN_LOWER
+			{ 1, 1, 1, 1 }, // SINGLE_SCREEN_UPPER
+			{ 0, 1, 2, 3 }  // FOUR_SCREEN
+		};
+		memcpy(nametablePage, pages[mode], sizeof(nametablePage));
+	}
+
 	/*
 	* Copy the block pointed to by data into OAM.
 	* This is the result of setting the DMA register at $4014.
 	*/
 	void dma(uint8_t* data)
 	{
-		memcpy(&oam, &data, 256); // Size of uint8 is implied.
+		if (owedDots())
+			sync();
+
+		memcpy(oam, data, 256);
+		spriteListHeight = 0;
+	}
+
+	bool renderingEnabled()
+	{
+		return (registers[1] & 0x18) != 0;
+	}
+
+	void buildSpriteLists(int height)
+	{
+		lines_s& tables = lines();
+		memset(tables.spriteCount, 0, sizeof(tables.spriteCount));
+		for (int i = 0; i < 64; ++i)
+		{
+			int top = oam[i * 4] + 1; // Sprite data is delayed by one scanline.
+			for (int line = top; line < top + height && line <= PPU_HEIGHT; ++line)
+				tables.sprites[line][tables.spriteCount[line]++] = i;
+		}
+		spriteListHeight = height;
+	}
+
+	/*
+	* Find the sprites on a scanline, in OAM order, up to the hardware limit of 8
+	* (or all of them with the limit lifted). Sets the overflow flag when more
+	* than 8 cover the line either way, since that is what the CPU sees.
+	*/
+	int evaluateSprites(int line, uint8_t* selected)
+	{
+		int height = (registers[0] & 0x20) ? 16 : 8;
+		int limit = spriteLimit ? 8 : 64;
+		int found = 0;
+
+		if (attached)
+		{
+			// Attached states switch too often for the lists to pay off; scan OAM.
+			int total = 0;
+			for (int i = 0; i < 64; ++i)
+			{
+				int row = line - (oam[i * 4] + 1);
+				if (row < 0 || row >= height)
+					continue;
+
+				if (++total > 8)
+					registers[2] |= 0x20;
+				if (found < limit)
+					selected[found++] = i;
+				else
+					break;
+			}
+			return found;
+		}
+
+		if (spriteListHeight != height)
+			buildSpriteLists(height);
+
+		lines_s& tables = lines();
+		int total = line <= PPU_HEIGHT ? tables.spriteCount[line] : 0;
+		if (total > 8)
+			registers[2] |= 0x20;
+		found = total < limit ? total : limit;
+		memcpy(selected, tables.sprites[line], found);
+		return found;
+	}
+
+	/*
+	* Address of the low pattern byte for sprite i's row on a scanline.
+	*/
+	uint16_t spriteRow(int i, int line)
+	{
+		uint8_t* sprite = &oam[i * 4];
+		int height = (registers[0] & 0x20) ? 16 : 8;
+		int row = line - (sprite[0] + 1);
+
+		if (sprite[2] & 0x80) row = height - 1 - row; // Vertical flip
+
+		uint16_t pattern;
+		if (height == 16)
+			pattern = ((sprite[1] & 1) << 12) | ((sprite[1] & 0xFE) << 4) | ((row & 8) << 1);
+		else
+			pattern = ((registers[0] & 0x08) << 9) | (sprite[1] << 4);
+		return pattern + (row & 7);
+	}
+
+	/*
+	* Two-bit colour of pixel x of sprite i on a scanline, 0 if transparent.
+	*/
+	uint8_t spriteColor(int i, int line, int x)
+	{
+		uint16_t pattern = spriteRow(i, line);
+		int column = x - oam[i * 4 + 3];
+
+		if (oam[i * 4 + 2] & 0x40) column = 7 - column; // Horizontal flip
+
+		int bit = 7 - column;
+		return ((readRam(pattern) >> bit) & 1) | (((readRam(pattern + 8) >> bit) & 1) << 1);
+	}
+
+	/*
+	* Background tile data for the tile `column` tiles right of the one v points
+	* at, wrapping into the horizontally adjacent nametable.
+	*/
+	void backgroundTile(int column, uint8_t& low, uint8_t& high, uint8_t& palette)
+	{
+		int coarseX = (v & 0x001F) + column;
+		uint16_t addr = (v & ~0x041F) | ((v & 0x0400) ^ ((coarseX & 0x20) << 5)) | (coarseX & 0x1F);
+		uint16_t patterns = (registers[0] & 0x10) << 8;
+		uint8_t index = vram[nametableAddress(addr)];
+		uint8_t attribute = vram[nametableAddress(0x23C0 | (addr & 0x0C00) | ((addr >> 4) & 0x38) | ((addr >> 2) & 0x07))];
+		int fineY = (addr >> 12) & 0x07;
+
+		palette = (attribute >> (((addr >> 4) & 0x04) | (addr & 0x02))) & 3;
+		low = readRam(patterns + index * 16 + fineY);
+		high = readRam(patterns + index * 16 + fineY + 8);
+	}
+
+	/*
+	* Move v down one pixel row, wrapping from row 29 into the vertically
+	* adjacent nametable.
+	*/
+	void incrementY()
+	{
+		if ((v & 0x7000) != 0x7000)
+		{
+			v += 0x1000;
+			return;
+		}
+
+		v &= ~0x7000;
+		int coarseY = (v & 0x03E0) >> 5;
+		if (coarseY == 29)
+		{
+			coarseY = 0;
+			v ^= 0x0800;
+		}
+		else if (coarseY == 31)
+		{
+			coarseY = 0; // Attribute rows wrap without switching nametables.
+		}
+		else
+		{
+			++coarseY;
+		}
+		v = (v & ~0x03E0) | (coarseY << 5);
+	}
+
+	/*
+	* Work out where sprite 0 will hit on this scanline, if anywhere, without
+	* composing any pixels. Runs whether or not the scanline is rendered, so
+	* skipping rendering never changes what the CPU sees in $2002.
+	*/
+	void predictSprite0(int line, const uint8_t* selected, int count)
+	{
+		sprite0Dot = 0;
+		if ((registers[1] & 0x18) != 0x18 || count == 0 || selected[0] != 0 || (registers[2] & 0x40))
+			return;
+
+		int left = (registers[1] & 0x06) == 0x06 ? 0 : 8; // Either layer clipped in the leftmost 8 pixels
+		for (int x = oam[3]; x < oam[3] + 8 && x < 255; ++x)
+		{
+			if (x < left || !spriteColor(0, line, x))
+				continue;
+
+			uint8_t low, high, palette;
+			backgroundTile((x + fineX) / 8, low, high, palette);
+			int bit = 7 - ((x + fineX) & 7);
+			if (((low >> bit) & 1) | ((high >> bit) & 1))
+			{
+				sprite0Dot = x + 1;
+				return;
+			}
+		}
+	}
+
+	/*
+	* Compose one visible scanline into the framebuffer as palette indices.
+	*/
+	void renderScanline(int line, const uint8_t* selected, int count)
+	{
+		uint8_t background[PPU_WIDTH] = { 0 }; // Palette RAM offset, 0 if transparent
+		uint8_t sprites[PPU_WIDTH] = { 0 }; // Palette RAM offset, 0 if transparent
+		bool behind[PPU_WIDTH] = { false };
+
+		if (registers[1] & 0x08)
+		{
+			// Fine X scroll shifts the line left, pulling in part of a 33rd tile.
+			for (int tile = 0; tile < 33; ++tile)
+			{
+				uint8_t low, high, palette;
+				backgroundTile(tile, low, high, palette);
+				for (int px = 0; px < 8; ++px)
+				{
+					int x = tile * 8 + px - fineX;
+					if (x < 0 || x >= PPU_WIDTH)
+						continue;
+
+					uint8_t color = ((low >> (7 - px)) & 1) | (((high >> (7 - px)) & 1) << 1);
+					background[x] = color ? palette * 4 + color : 0;
+				}
+			}
+			if (!(registers[1] & 0x02))
+				memset(background, 0, 8);
+		}
+
+		if (registers[1] & 0x10)
+		{
+			// Earlier OAM entries win, so only fill pixels nothing has claimed yet.
+			for (int s = 0; s < count; ++s)
+			{
+				uint8_t* sprite = &oam[selected[s] * 4];
+				for (int x = sprite[3]; x < sprite[3] + 8 && x < PPU_WIDTH; ++x)
+				{
+					if (sprites[x] || (x < 8 && !(registers[1] & 0x04)))
+						continue;
+
+					uint8_t color = spriteColor(selected[s], line, x);
+					if (color)
+					{
+						sprites[x] = 0x10 + (sprite[2] & 0x03) * 4 + color;
+						behind[x] = (sprite[2] & 0x20) != 0;
+					}
+				}
+			}
+		}
+
+		uint8_t* row = &framebuffer[line * PPU_WIDTH];
+		for (int x = 0; x < PPU_WIDTH; ++x)
+		{
+			uint8_t index = (sprites[x] && (!behind[x] || !background[x])) ? sprites[x] : background[x];
+			row[x] = vram[paletteAddress(index)] & 0x3F;
+		}
+	}
+
+	/*
+	* Called once a visible line is fully composed. The frame's verdict is
+	* settled on the last line; a change of greyscale or emphasis alters every
+	* pixel's colour without touching the indices, so it counts too.
+	*/
+	void finishLine(int line)
+	{
+		uint64_t words[PPU_WIDTH / 8];
+		memcpy(words, &framebuffer[line * PPU_WIDTH], PPU_WIDTH);
+		uint64_t hash = 0;
+		for (uint64_t word : words)
+			hash = (hash ^ word) * 0x9E3779B97F4A7C15ull ^ (hash >> 29);
+
+		if (line == 0)
+			dirtyCount = 0;
+		lines_s& tables = lines();
+		tables.dirty[line] = !hashesValid || hash != tables.hashes[line];
+		dirtyCount += tables.dirty[line];
+		tables.hashes[line] = hash;
+
+		if (line == PPU_HEIGHT - 1)
+		{
+			frameDirty = dirtyCount || !hashesValid || registers[1] != composedMask;
+			composedMask = registers[1];
+			hashesValid = true;
+		}
+	}
+
+	/*
+	* Scanline backend: one dot.
+	*
+	* Timing (V-Blank and NMI, sprite 0 hit, sprite overflow, mapper scanline
+	* signals) always runs. Composing pixels can be skipped for frames nobody
+	* will look at.
+	*/
+	inline void scanlineDot()
+	{
+		if (++dot > 340)
+		{
+			dot = 0;
+			if (++scanline > 261)
+			{
+				scanline = 0;
+				++frame;
+			}
+		}
+
+		if (scanline < 240)
+		{
+			if (dot == 1 && renderingEnabled())
+			{
+				uint8_t selected[64];
+				int count = evaluateSprites(scanline, selected);
+				predictSprite0(scanline, selected, count);
+			}
+			if (dot == sprite0Dot && dot != 0)
+			{
+				registers[2] |= 0x40;
+			}
+			if (dot == 256 && !skipRender)
+			{
+				uint8_t selected[64];
+				int count = renderingEnabled() ? evaluateSprites(scanline, selected) : 0;
+				renderScanline(scanline, selected, count);
+				finishLine(scanline);
+			}
+		}
+		else if (scanline == 241 && dot == 1)
+		{
+			registers[2] |= 0x80; // V-Blank started
+			if (registers[0] & 0x80)
+				nmiPending = true;
+		}
+		else if (scanline == 261 && dot == 1)
+		{
+			registers[2] &= ~0xE0; // Clear V-Blank, sprite 0 hit and overflow
+			sprite0Dot = 0;
+		}
+
+		if ((scanline < 240 || scanline == 261) && renderingEnabled())
+		{
+			// Scroll bookkeeping, done in one go where the hardware spreads it over the line.
+			if (dot == 256)
+				incrementY();
+			else if (dot == 257)
+				v = (v & ~0x041F) | (t & 0x041F); // Reload coarse X and the horizontal nametable.
+			else if (dot == 260)
+				Cartridge::mapper->signal_scanline();
+			else if (dot == 280 && scanline == 261)
+				v = (v & ~0x7BE0) | (t & 0x7BE0); // Reload fine Y, coarse Y and the vertical nametable.
+		}
+	}
+
+	/*
+	* Dot backend: move the next background tile from the fetch latches into
+	* the low byte of the shifters.
+	*/
+	inline void reloadShifters()
+	{
+		pipe.patternLow = (pipe.patternLow & 0xFF00) | pipe.lowLatch;
+		pipe.patternHigh = (pipe.patternHigh & 0xFF00) | pipe.highLatch;
+		pipe.attributeLow = (pipe.attributeLow & 0xFF00) | ((pipe.attributeLatch & 1) ? 0xFF : 0x00);
+		pipe.attributeHigh = (pipe.attributeHigh & 0xFF00) | ((pipe.attributeLatch & 2) ? 0xFF : 0x00);
+	}
+
+	inline void incrementX()
+	{
+		if ((v & 0x001F) == 31)
+			v = (v & ~0x001F) ^ 0x0400; // Wrap into the horizontally adjacent nametable.
+		else
+			++v;
+	}
+
+	/*
+	* Dot backend: the eight-dot background fetch cadence. Each fetch happens on
+	* the dot it does on hardware, so a write to $2000/$2005/$2006 between
+	* fetches changes the very next one.
+	*/
+	inline void fetchBackground()
+	{
+		switch (dot & 7)
+		{
+		case 1:
+			reloadShifters();
+			pipe.nametableLatch = vram[nametableAddress(v)];
+			break;
+		case 3:
+		{
+			uint8_t attribute = vram[nametableAddress(0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07))];
+			pipe.attributeLatch = (attribute >> (((v >> 4) & 0x04) | (v & 0x02))) & 3;
+			break;
+		}
+		case 5:
+			pipe.lowLatch = readRam(((registers[0] & 0x10) << 8) + pipe.nametableLatch * 16 + ((v >> 12) & 7));
+			break;
+		case 7:
+			pipe.highLatch = readRam(((registers[0] & 0x10) << 8) + pipe.nametableLatch * 16 + ((v >> 12) & 7) + 8);
+			break;
+		case 0:
+			incrementX();
+			break;
+		}
+	}
+
+	inline uint8_t reverseBits(uint8_t b)
+	{
+		b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+		b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+		return (b & 0xAA) >> 1 | (b & 0x55) << 1;
+	}
+
+	/*
+	* Dot backend: evaluate and fetch the sprites for the next scanline.
+	* Hardware spreads this over dots 65-320; it is done at once on dot 257.
+	*/
+	void fetchSprites(int line)
+	{
+		uint8_t selected[64];
+		pipe.spriteCount = evaluateSprites(line, selected);
+		pipe.spriteZero = pipe.spriteCount && selected[0] == 0;
+
+		for (int s = 0; s < pipe.spriteCount; ++s)
+		{
+			uint8_t* sprite = &oam[selected[s] * 4];
+			uint16_t pattern = spriteRow(selected[s], line);
+			pipe.spriteLow[s] = readRam(pattern);
+			pipe.spriteHigh[s] = readRam(pattern + 8);
+			if (sprite[2] & 0x40)
+			{
+				pipe.spriteLow[s] = reverseBits(pipe.spriteLow[s]);
+				pipe.spriteHigh[s] = reverseBits(pipe.spriteHigh[s]);
+			}
+			pipe.spriteAttributes[s] = sprite[2];
+			pipe.spriteX[s] = sprite[3];
+		}
+	}
+
+	/*
+	* Dot backend: output the pixel for the current dot from the shifters and
+	* this line's sprites.
+	*/
+	inline void composePixel()
+	{
+		int x = dot - 1;
+		uint8_t background = 0;
+		uint8_t sprite = 0;
+		bool behind = false;
+
+		if ((registers[1] & 0x08) && (x >= 8 || (registers[1] & 0x02)))
+		{
+			uint16_t mux = 0x8000 >> fineX;
+			uint8_t color = ((pipe.patternLow & mux) ? 1 : 0) | ((pipe.patternHigh & mux) ? 2 : 0);
+			uint8_t palette = ((pipe.attributeLow & mux) ? 1 : 0) | ((pipe.attributeHigh & mux) ? 2 : 0);
+			background = color ? palette * 4 + color : 0;
+		}
+
+		if ((registers[1] & 0x10) && (x >= 8 || (registers[1] & 0x04)))
+		{
+			// Earlier OAM entries win; sprite 0, if present, is always the first.
+			for (int s = 0; s < pipe.spriteCount; ++s)
+			{
+				int column = x - pipe.spriteX[s];
+				if (column < 0 || column > 7)
+					continue;
+
+				uint8_t color = ((pipe.spriteLow[s] >> (7 - column)) & 1) | (((pipe.spriteHigh[s] >> (7 - column)) & 1) << 1);
+				if (!color)
+					continue;
+
+				if (s == 0 && pipe.spriteZero && background && x != 255)
+					registers[2] |= 0x40;
+				sprite = 0x10 + (pipe.spriteAttributes[s] & 0x03) * 4 + color;
+				behind = (pipe.spriteAttributes[s] & 0x20) != 0;
+				break;
+			}
+		}
+
+		if (!skipRender)
+		{
+			uint8_t index = (sprite && (!behind || !background)) ? sprite : background;
+			framebuffer[scanline * PPU_WIDTH + x] = vram[paletteAddress(index)] & 0x3F;
+		}
+	}
+
+	/*
+	* Dot backend: one dot of the 341 x 262 pipeline.
+	*/
+	inline void pipelineDot()
+	{
+		if (++dot > 340)
+		{
+			dot = 0;
+			if (++scanline > 261)
+			{
+				scanline = 0;
+				++frame;
+			}
+		}
+		else if (dot == 340 && scanline == 261 && (frame & 1) && renderingEnabled())
+		{
+			// Odd frames skip the last dot of the pre-render line.
+			dot = 0;
+			scanline = 0;
+			++frame;
+		}
+
+		if (scanline < 240 || scanline == 261)
+		{
+			if (renderingEnabled())
+			{
+				if ((dot >= 2 && dot <= 257) || (dot >= 321 && dot <= 337))
+				{
+					pipe.patternLow <<= 1;
+					pipe.patternHigh <<= 1;
+					pipe.attributeLow <<= 1;
+					pipe.attributeHigh <<= 1;
+					fetchBackground();
+				}
+
+				if (dot == 256)
+				{
+					incrementY();
+				}
+				else if (dot == 257)
+				{
+					v = (v & ~0x041F) | (t & 0x041F);
+					if (scanline < 240)
+						fetchSprites(scanline + 1);
+					else
+						pipe.spriteCount = 0; // Nothing is drawn on the first line.
+				}
+				else if (dot == 260)
+				{
+					Cartridge::mapper->signal_scanline();
+				}
+				else if (scanline == 261 && dot >= 280 && dot <= 304)
+				{
+					v = (v & ~0x7BE0) | (t & 0x7BE0);
+				}
+			}
+
+			if (scanline < 240 && dot >= 1 && dot <= 256)
+			{
+				composePixel();
+				if (dot == 256 && !skipRender)
+					finishLine(scanline);
+			}
+			else if (scanline == 261 && dot == 1)
+			{
+				registers[2] &= ~0xE0;
+			}
+		}
+		else if (scanline == 241 && dot == 1)
+		{
+			registers[2] |= 0x80;
+			if (registers[0] & 0x80)
+				nmiPending = true;
+		}
+	}
+
+	/*
+	* Dot backend: run a stretch of dots. Lines 240-260 only do anything at the
+	* start of V-Blank, so they are crossed in at most two jumps.
+	*/
+	void runDots(uint32_t dots)
+	{
+		while (dots)
+		{
+			if (scanline >= 240 && scanline < 261)
+			{
+				uint32_t position = scanline * 341 + dot;
+				uint32_t target = position < vblankDot ? vblankDot - 1 : 261 * 341 - 1;
+				uint32_t jump = target - position < dots ? target - position : dots;
+				if (jump)
+				{
+					position += jump;
+					scanline = position / 341;
+					dot = position % 341;
+					dots -= jump;
+					continue;
+				}
+			}
+			pipelineDot();
+			--dots;
+		}
+	}
+
+	/*
+	* Scanline backend: the next dot on this line at which scanlineDot() does
+	* anything, 341 meaning the move to the next line.
+	*/
+	inline uint16_t nextScanlineAction()
+	{
+		static const uint16_t actions[] = { 1, 256, 257, 260, 280, 341 };
+		uint16_t next = 341;
+		if (scanline < 240 || scanline == 261)
+		{
+			for (uint16_t action : actions)
+			{
+				if (action > dot)
+				{
+					next = action;
+					break;
+				}
+			}
+			if (scanline < 240 && sprite0Dot > dot && sprite0Dot < next)
+				next = sprite0Dot;
+		}
+		else if (scanline == 241 && dot < 1)
+		{
+			next = 1;
+		}
+		return next;
+	}
+
+	/*
+	* Scanline backend: run a stretch of dots, stepping over the ones where
+	* nothing happens.
+	*/
+	void runScanlineDots(uint32_t dots)
+	{
+		while (dots)
+		{
+			uint32_t idle = nextScanlineAction() - dot - 1;
+			if (idle >= dots)
+			{
+				dot += dots;
+				return;
+			}
+			dot += idle;
+			dots -= idle + 1;
+			scanlineDot();
+		}
+	}
+
+	/*
+	* Dots in this frame: the dot backend skips one on odd frames while rendering.
+	*/
+	inline uint32_t frameDots()
+	{
+		return 262 * 341 - (backend == DOT && (frame & 1) && renderingEnabled() ? 1 : 0);
+	}
+
+	/*
+	* Schedule the next points at which the CPU could tell the PPU was behind
+	* without touching it: the NMI at the start of V-Blank and the end of the
+	* frame. Register accesses and savestates catch up on their own. Mapper
+	* scanline signals are delivered inside the run; with no IRQ line into the
+	* CPU yet, nothing can observe them sooner.
+	*/
+	void scheduleEvents()
+	{
+		uint32_t position = scanline * 341 + dot;
+		if (position < vblankDot)
+			Timeline::schedule(Timeline::VBLANK, caughtUp + vblankDot - position);
+		else
+			Timeline::cancel(Timeline::VBLANK);
+		Timeline::schedule(Timeline::FRAME_END, caughtUp + frameDots() - position);
+	}
+
+	/*
+	* Run the dots owed to the timeline, then schedule the next events.
+	*/
+	void sync()
+	{
+		uint32_t dots = owedDots();
+		caughtUp = Timeline::now();
+		if (backend == DOT)
+			runDots(dots);
+		else
+			runScanlineDots(dots);
+		scheduleEvents();
+	}
+
+	/*
+	* How many dots can run before the CPU could see a difference: the next
+	* event, and with status set, a change to $2002 or a read of it that would
+	* change something itself. The scanline backend finds sprite 0 and overflow
+	* at dot 1 of each line, so status only stays quiet to the next line while
+	* rendering; the dot backend could hit sprite 0 on any dot and is never
+	* quiet then.
+	*/
+	uint32_t quietDots(bool status)
+	{
+		if (backend == DOT)
+		{
+			uint32_t position = scanline * 341 + dot + owedDots();
+			if (status && renderingEnabled() && (position < 240 * 341 || position >= 261 * 341))
+				return 0; // Known without catching up, which would cost the time being saved
+		}
+		if (owedDots())
+			sync();
+		if (nmiPending || (status && ((registers[2] & 0x80) || w)))
+			return 0;
+
+		uint32_t position = scanline * 341 + dot;
+		uint32_t event = position < vblankDot ? vblankDot : frameDots();
+		if (status)
+		{
+			if (position >= vblankDot && position < 261 * 341 + 1)
+				event = 261 * 341 + 1; // Flags cleared
+			if (renderingEnabled() && (scanline < 240 || scanline == 261))
+			{
+				if (backend == DOT)
+					return 0;
+
+				uint32_t next = scanline == 261 ? event : scanline * 341 + (dot < 1 ? 1 : 342);
+				if (scanline < 240 && sprite0Dot > dot)
+					next = std::min(next, scanline * 341u + sprite0Dot);
+				event = std::min(event, next);
+			}
+		}
+		return event - position - 1;
+	}
+
+	/*
+	* Select the PPU model. Takes effect on the next dot; switching is safe at
+	* any time, although the dot backend's first scanline after a switch draws
+	* from empty shifters.
+	*/
+	void setBackend(backend_e mode)
+	{
+		if (mode == backend)
+			return;
+
+		sync();
+		backend = mode;
+		scheduleEvents();
+	}
+
+	backend_e getBackend()
+	{
+		return backend;
+	}
+
+	/*
+	* Draw every sprite on a line instead of the first 8, to get rid of the
+	* flicker games use to work around the limit. The overflow flag and sprite 0
+	* still behave as on hardware.
+	*/
+	void setSpriteLimit(bool enabled)
+	{
+		spriteLimit = enabled;
+	}
+
+	/*
+	* Returns true once per NMI raised, for the CPU to service.
+	*/
+	bool pollNmi()
+	{
+		bool pending = nmiPending;
+		nmiPending = false;
+		return pending;
+	}
+
+	/*
+	* Skip composing pixels. Timing and everything the CPU can observe are unaffected.
+	*/
+	void setSkipRender(bool skip)
+	{
+		skipRender = skip;
+	}
+
+	uint32_t getFrameCount()
+	{
+		return frame;
+	}
+
+	/*
+	* $2001 as last written: greyscale and colour emphasis for the output stage.
+	*/
+	uint8_t getMask()
+	{
+		return registers[1];
+	}
+
+	uint8_t* getFramebuffer()
+	{
+		return framebuffer;
+	}
+
+	/*
+	* Whether the last frame composed differs from the one composed before it,
+	* so a frontend can keep showing what it already has. Frames skipped with
+	* setSkipRender() are not composed and don't count.
+	*/
+	bool frameChanged()
+	{
+		return frameDirty;
+	}
+
+	bool lineChanged(int line)
+	{
+		return !hashesValid || lines().dirty[line];
+	}
+
+	/*
+	* Redirect output to a caller-owned buffer of PPU_WIDTH * PPU_HEIGHT bytes.
+	*/
+	void setFramebuffer(uint8_t* buffer)
+	{
+		framebuffer = buffer;
+		hashesValid = false;
+		frameDirty = true;
+	}
+
+	void loadScalars(const state_s& state)
+	{
+		dot = state.dot;
+		scanline = state.scanline;
+		frame = state.frame;
+		nmiPending = state.nmiPending != 0;
+		sprite0Dot = state.sprite0Dot;
+		v = state.v;
+		t = state.t;
+		fineX = state.fineX;
+		w = state.w;
+		dataBuffer = state.dataBuffer;
+		memcpy(nametablePage, state.nametablePage, sizeof(nametablePage));
+		pipe = state.pipeline;
+		caughtUp = Timeline::now(); // Nothing owed
+		scheduleEvents();
+	}
+
+	void saveScalars(state_s& state)
+	{
+		if (owedDots())
+			sync();
+
+		state.dot = dot;
+		state.scanline = scanline;
+		state.frame = frame;
+		state.nmiPending = nmiPending;
+		state.sprite0Dot = sprite0Dot;
+		state.v = v;
+		state.t = t;
+		state.fineX = fineX;
+		state.w = w;
+		state.dataBuffer = dataBuffer;
+		memcpy(state.nametablePage, nametablePage, sizeof(state.nametablePage));
+		state.pipeline = pipe;
+	}
+
+	/*
+	* Run directly on the memory inside a state instead of copying it in, so that
+	* switching between many consoles costs a few pointer writes. Call detach()
+	* before attaching another state or using save()/load().
+	*/
+	void attach(state_s& state)
+	{
+		if (owedDots())
+			sync();
+
+		homeRegisters = registers;
+		homeVram = vram;
+		homeOam = oam;
+		registers = state.registers;
+		vram = state.vram;
+		oam = state.oam;
+		loadScalars(state);
+		attached = &state;
+		spriteListHeight = 0;
+	}
+
+	void detach()
+	{
+		if (!attached)
+			return;
+
+		saveScalars(*attached);
+		registers = homeRegisters;
+		vram = homeVram;
+		oam = homeOam;
+		attached = nullptr;
+		spriteListHeight = 0;
+	}
+
+	void save(state_s& state)
+	{
+		memcpy(state.registers, registers, sizeof(state.registers));
+		memcpy(state.vram, vram, sizeof(state.vram));
+		memcpy(state.oam, oam, sizeof(state.oam));
+		saveScalars(state);
 	}
 
-	void execute()
+	void load(const state_s& state)
 	{
+		if (owedDots())
+			sync();
 
+		memcpy(registers, state.registers, sizeof(state.registers));
+		memcpy(vram, state.vram, sizeof(state.vram));
+		memcpy(oam, state.oam, sizeof(state.oam));
+		spriteListHeight = 0;
+		loadScalars(state);
 	}
 }
\ No newline at end of file
@@ -1,14 +1,85 @@
 #pragma once
 
 #include <iostream>
+#include <cstdint>
+
+#define PPU_WIDTH 256
+#define PPU_HEIGHT 240
 
 namespace PPU
 {
+	typedef enum {
+		HORIZONTAL,
+		VERTICAL,
+		SINGLE_SCREEN_LOWER,
+		SINGLE_SCREEN_UPPER,
+		FOUR_SCREEN
+	} mirroring_e;
+
+	typedef enum {
+		SCANLINE, // Whole scanlines composed at once; fast, but mid-line writes land at the line's end
+		DOT // The 341 x 262 fetch and shift-register pipeline, dot by dot
+	} backend_e;
+
+	/*
+	* Dot backend internals: background shifters and fetch latches, and the
+	* sprites fetched for the current line. Sized for all 64 so the sprite
+	* limit can be lifted; only 8 are used while it holds.
+	*/
+	typedef struct {
+		uint16_t patternLow, patternHigh;
+		uint16_t attributeLow, attributeHigh;
+		uint8_t nametableLatch, attributeLatch, lowLatch, highLatch;
+		uint8_t spriteCount;
+		uint8_t spriteZero; // The first sprite on the line is sprite 0.
+		uint8_t spriteLow[64], spriteHigh[64], spriteAttributes[64], spriteX[64];
+	} pipeline_s;
+
+	/*
+	* Everything needed to resume the PPU exactly where it left off.
+	* The framebuffer is output, not state, and is not part of it.
+	*/
+	typedef struct {
+		uint8_t registers[8];
+		uint8_t vram[0x4000];
+		uint8_t oam[0x100];
+		uint16_t dot;
+		uint16_t scanline;
+		uint32_t frame;
+		uint8_t nmiPending;
+		uint16_t sprite0Dot;
+		uint16_t v;
+		uint16_t t;
+		uint8_t fineX;
+		uint8_t w;
+		uint8_t dataBuffer;
+		uint8_t nametablePage[4];
+		pipeline_s pipeline;
+	} state_s;
+
 	void initialize();
 	uint8_t readRegister(uint16_t addr);
 	void writeRegister(uint16_t addr, uint8_t value);
 	uint8_t readRam(uint16_t addr);
 	void writeRam(uint16_t addr, uint8_t value);
 	void dma(uint8_t* data);
-	void execute();
-}
\ No newline at end of file
+	void sync();
+	uint32_t quietDots(bool status);
+	bool pollNmi();
+	void setSkipRender(bool skip);
+	void setMirroring(mirroring_e mode);
+	void setBackend(backend_e mode);
+	backend_e getBackend();
+	void setSpriteLimit(bool enabled);
+
+	uint32_t getFrameCount();
+	uint8_t getMask();
+	uint8_t* getFramebuffer();
+	bool frameChanged();
+	bool lineChanged(int line);
+	void setFramebuffer(uint8_t* buffer);
+	void save(state_s& state);
+	void load(const state_s& state);
+	void attach(state_s& state);
+	void detach();
+}
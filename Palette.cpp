@@ -0,0 +1,147 @@
+#include "Palette.h"
+#include "PPU.h"
+
+#include <cstdio>
+#include <mutex>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace Palette
+{
+	/* --- Default colours ADAPTED FROM https://github.com/AndreaOrru/LaiNES/blob/master/src/include/palette.inc */
+	const uint32_t defaultRgb[64] = {
+		0x7C7C7C, 0x0000FC, 0x0000BC, 0x4428BC, 0x940084, 0xA80020, 0xA81000, 0x881400,
+		0x503000, 0x007800, 0x006800, 0x005800, 0x004058, 0x000000, 0x000000, 0x000000,
+		0xBCBCBC, 0x0078F8, 0x0058F8, 0x6844FC, 0xD800CC, 0xE40058, 0xF83800, 0xE45C10,
+		0xAC7C00, 0x00B800, 0x00A800, 0x00A844, 0x008888, 0x000000, 0x000000, 0x000000,
+		0xF8F8F8, 0x3CBCFC, 0x6888FC, 0x9878F8, 0xF878F8, 0xF85898, 0xF87858, 0xFCA044,
+		0xF8B800, 0xB8F818, 0x58D854, 0x58F898, 0x00E8D8, 0x787878, 0x000000, 0x000000,
+		0xFCFCFC, 0xA4E4FC, 0xB8B8F8, 0xD8B8F8, 0xF8B8F8, 0xF8A4C0, 0xF0D0B0, 0xFCE0A8,
+		0xF8D878, 0xD8F878, 0xB8F8B8, 0xB8F8D8, 0x00FCFC, 0xF8D8F8, 0x000000, 0x000000
+	};
+
+	alignas(32) uint32_t tables[8][64]; // Indexed by $2001 bits 5-7 (emphasize red, green, blue)
+	bool tablesReady = false;
+
+	uint32_t rgba(int r, int g, int b)
+	{
+		return (uint32_t)r << 24 | (uint32_t)g << 16 | (uint32_t)b << 8 | 0xFF;
+	}
+
+	/*
+	* Derive the emphasis tables from 64 base colours: each emphasis bit dims
+	* the two channels it doesn't name.
+	*/
+	void buildTables(const uint8_t* rgb)
+	{
+		for (int emphasis = 0; emphasis < 8; ++emphasis)
+		{
+			for (int i = 0; i < 64; ++i)
+			{
+				float channel[3] = { (float)rgb[i * 3], (float)rgb[i * 3 + 1], (float)rgb[i * 3 + 2] };
+				for (int bit = 0; bit < 3; ++bit)
+				{
+					if (!(emphasis >> bit & 1))
+						continue;
+					for (int c = 0; c < 3; ++c)
+					{
+						if (c != bit)
+							channel[c] *= 0.816f;
+					}
+				}
+				tables[emphasis][i] = rgba((int)channel[0], (int)channel[1], (int)channel[2]);
+			}
+		}
+		tablesReady = true;
+	}
+
+	void buildDefaultTables()
+	{
+		uint8_t rgb[64 * 3];
+		for (int i = 0; i < 64; ++i)
+		{
+			rgb[i * 3] = defaultRgb[i] >> 16;
+			rgb[i * 3 + 1] = defaultRgb[i] >> 8;
+			rgb[i * 3 + 2] = defaultRgb[i];
+		}
+		buildTables(rgb);
+	}
+
+	/*
+	* Load a .pal file: 64 RGB triplets, or 512 with all 8 emphasis variants
+	* stored one after another. Keeps the current colours if the file is unusable.
+	*/
+	bool load(const char* filename)
+	{
+		FILE* f;
+#ifdef _MSC_VER
+		fopen_s(&f, filename, "rb");
+#else
+		f = fopen(filename, "rb");
+#endif
+		if (!f) return false;
+
+		uint8_t rgb[512 * 3];
+		size_t size = fread(rgb, 1, sizeof(rgb), f);
+		fclose(f);
+
+		if (size == 64 * 3)
+		{
+			buildTables(rgb);
+			return true;
+		}
+		if (size == 512 * 3)
+		{
+			for (int i = 0; i < 512; ++i)
+				tables[i / 64][i % 64] = rgba(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+			tablesReady = true;
+			return true;
+		}
+		return false;
+	}
+
+	/*
+	* The 64 colours in effect for a $2001 value.
+	*/
+	const uint32_t* table(uint8_t mask)
+	{
+		// Built once even if several threads ask at the same time. Any load() comes before them, at startup.
+		static std::once_flag defaultsChecked;
+		std::call_once(defaultsChecked, [] {
+			if (!tablesReady)
+				buildDefaultTables();
+		});
+		return tables[mask >> 5];
+	}
+
+	/*
+	* Convert a PPU_WIDTH x PPU_HEIGHT frame of palette indices straight into
+	* the destination, e.g. a locked streaming texture. pitch is in bytes.
+	*/
+	void convert(const uint8_t* indices, void* pixels, int pitch, uint8_t mask)
+	{
+		const uint32_t* lut = table(mask);
+		uint8_t keep = (mask & 0x01) ? 0x30 : 0x3F; // Greyscale keeps only the column of greys.
+
+		for (int y = 0; y < PPU_HEIGHT; ++y)
+		{
+			const uint8_t* in = &indices[y * PPU_WIDTH];
+			uint32_t* out = (uint32_t*)((uint8_t*)pixels + y * pitch);
+			int x = 0;
+#if defined(__AVX2__)
+			// Widen 8 indices to 32 bits and gather their colours in one go.
+			__m256i greyscale = _mm256_set1_epi32(keep);
+			for (; x + 8 <= PPU_WIDTH; x += 8)
+			{
+				__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&in[x]));
+				index = _mm256_and_si256(index, greyscale);
+				_mm256_storeu_si256((__m256i*)&out[x], _mm256_i32gather_epi32((const int*)lut, index, 4));
+			}
+#endif
+			for (; x < PPU_WIDTH; ++x)
+				out[x] = lut[in[x] & keep];
+		}
+	}
+}
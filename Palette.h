@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+* Final output stage: PPU palette indices to 32-bit RGBA8888 pixels
+* (0xRRGGBBAA, the layout of SDL_PIXELFORMAT_RGBA8888).
+*
+* Colour emphasis ($2001 bits 5-7) selects one of 8 precomputed 64-entry
+* tables and greyscale ($2001 bit 0) masks the index, both once per frame.
+*/
+namespace Palette
+{
+	bool load(const char* filename);
+	const uint32_t* table(uint8_t mask);
+	void convert(const uint8_t* indices, void* pixels, int pitch, uint8_t mask);
+}
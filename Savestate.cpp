@@ -0,0 +1,81 @@
+#include "Savestate.h"
+#include "Cartridge.h"
+
+namespace Savestate
+{
+	/*
+	* Capture the running console. The mapper buffer is only resized when the
+	* cartridge changes, so repeated saves into the same snapshot don't allocate.
+	*/
+	void save(Snapshot& snapshot)
+	{
+		CPU::save(snapshot.cpu);
+		PPU::save(snapshot.ppu);
+		APU::save(snapshot.apu);
+		Controller::save(snapshot.controller);
+
+		snapshot.mapper.resize(Cartridge::mapper->state_size());
+		Cartridge::mapper->save(snapshot.mapper.data());
+	}
+
+	void load(const Snapshot& snapshot)
+	{
+		CPU::load(snapshot.cpu);
+		PPU::load(snapshot.ppu);
+		APU::load(snapshot.apu);
+		Controller::load(snapshot.controller);
+		Cartridge::mapper->load(snapshot.mapper.data());
+	}
+
+	/*
+	* Each chip state goes out behind its size, so a file from a build with a
+	* different layout is turned away instead of read into the wrong fields.
+	*/
+	void writeBlock(std::ostream& out, const void* data, uint32_t size)
+	{
+		out.write((const char*)&size, sizeof(size));
+		out.write((const char*)data, size);
+	}
+
+	bool readBlock(std::istream& in, void* data, uint32_t size)
+	{
+		uint32_t fileSize = 0;
+		in.read((char*)&fileSize, sizeof(fileSize));
+		if (!in || fileSize != size)
+			return false;
+		in.read((char*)data, size);
+		return (bool)in;
+	}
+
+	/*
+	* Serialize a snapshot. Chip states are written as-is, so files are only
+	* portable between builds with the same struct layout and endianness.
+	*/
+	void write(std::ostream& out, const Snapshot& snapshot)
+	{
+		uint32_t mapperSize = (uint32_t)snapshot.mapper.size();
+		writeBlock(out, &snapshot.cpu, sizeof(snapshot.cpu));
+		writeBlock(out, &snapshot.ppu, sizeof(snapshot.ppu));
+		writeBlock(out, &snapshot.apu, sizeof(snapshot.apu));
+		writeBlock(out, &snapshot.controller, sizeof(snapshot.controller));
+		out.write((const char*)&mapperSize, sizeof(mapperSize));
+		out.write((const char*)snapshot.mapper.data(), mapperSize);
+	}
+
+	bool read(std::istream& in, Snapshot& snapshot)
+	{
+		uint32_t mapperSize = 0;
+		if (!readBlock(in, &snapshot.cpu, sizeof(snapshot.cpu))
+			|| !readBlock(in, &snapshot.ppu, sizeof(snapshot.ppu))
+			|| !readBlock(in, &snapshot.apu, sizeof(snapshot.apu))
+			|| !readBlock(in, &snapshot.controller, sizeof(snapshot.controller)))
+			return false;
+		in.read((char*)&mapperSize, sizeof(mapperSize));
+		if (!in || mapperSize > 0x100000)
+			return false;
+
+		snapshot.mapper.resize(mapperSize);
+		in.read((char*)snapshot.mapper.data(), mapperSize);
+		return (bool)in;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <iostream>
+
+#include "CPU.h"
+#include "PPU.h"
+#include "APU.h"
+#include "Controller.h"
+
+/*
+* Whole-console snapshot. Every core lives in namespace-level state (one copy
+* per thread), so running more than one console on a thread (lockstep
+* validation, rollback, run-ahead, the scheduler's workers) is done by
+* swapping snapshots in and out.
+*/
+namespace Savestate
+{
+	struct Snapshot
+	{
+		CPU::state_s cpu;
+		PPU::state_s ppu;
+		APU::state_s apu;
+		Controller::state_s controller;
+		std::vector<uint8_t> mapper;
+	};
+
+	void save(Snapshot& snapshot);
+	void load(const Snapshot& snapshot);
+
+	void write(std::ostream& out, const Snapshot& snapshot);
+	bool read(std::istream& in, Snapshot& snapshot);
+}
@@ -0,0 +1,389 @@
+#include "Scaler.h"
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace Scaler
+{
+	scaler_e mode = NEAREST;
+	int nearest = 2;
+
+	std::unique_ptr<WorkerPool> pool;
+	int threadCount = 0;
+
+	double milliseconds = 0;
+
+	const char* names[] = { "nearest", "scale2x", "scale3x", "xbr-lite" };
+
+	/*
+	* Accepts the names above, or "nearest<N>" for another integer factor.
+	*/
+	bool select(const char* name, int nearestFactor)
+	{
+		for (int m = NEAREST; m <= XBR_LITE; ++m)
+		{
+			if (!strcmp(name, names[m]))
+			{
+				select((scaler_e)m, nearestFactor);
+				return true;
+			}
+		}
+		if (!strncmp(name, "nearest", 7) && name[7] >= '1' && name[7] <= '8' && !name[8])
+		{
+			select(NEAREST, name[7] - '0');
+			return true;
+		}
+		return false;
+	}
+
+	void select(scaler_e m, int nearestFactor)
+	{
+		mode = m;
+		nearest = nearestFactor < 1 ? 1 : nearestFactor;
+	}
+
+	scaler_e current()
+	{
+		return mode;
+	}
+
+	const char* name(scaler_e m)
+	{
+		return names[m];
+	}
+
+	int factor()
+	{
+		switch (mode)
+		{
+		case NEAREST:
+			return nearest;
+		case SCALE3X:
+			return 3;
+		default:
+			return 2;
+		}
+	}
+
+	/*
+	* Threads to split rows across, counting the caller; 0 is one per hardware thread.
+	*/
+	void setThreads(int count)
+	{
+		pool.reset(new WorkerPool(count));
+		threadCount = pool->size();
+	}
+
+	/*
+	* Rows above and below are clamped at the frame's edges, as are columns
+	* through the helpers below.
+	*/
+	inline const uint32_t* row(const uint32_t* in, int width, int height, int y)
+	{
+		return &in[std::min(std::max(y, 0), height - 1) * width];
+	}
+
+	inline uint32_t* outRow(void* out, int pitch, int y)
+	{
+		return (uint32_t*)((uint8_t*)out + (size_t)y * pitch);
+	}
+
+	/*
+	* Nearest neighbour reads no row but its own, so it has no use for the
+	* height the other filters clamp against.
+	*/
+	void nearestRows(const uint32_t* in, int width, int, void* out, int pitch, int begin, int end)
+	{
+		for (int y = begin; y < end; ++y)
+		{
+			const uint32_t* src = &in[y * width];
+			uint32_t* dst = outRow(out, pitch, y * nearest);
+			int x = 0;
+#if defined(__AVX2__)
+			if (nearest == 2)
+			{
+				for (; x + 8 <= width; x += 8)
+				{
+					__m256i e = _mm256_loadu_si256((const __m256i*)&src[x]);
+					__m256i lo = _mm256_unpacklo_epi32(e, e), hi = _mm256_unpackhi_epi32(e, e);
+					_mm256_storeu_si256((__m256i*)&dst[x * 2], _mm256_permute2x128_si256(lo, hi, 0x20));
+					_mm256_storeu_si256((__m256i*)&dst[x * 2 + 8], _mm256_permute2x128_si256(lo, hi, 0x31));
+				}
+			}
+#endif
+			for (; x < width; ++x)
+				std::fill_n(&dst[x * nearest], nearest, src[x]);
+			for (int k = 1; k < nearest; ++k)
+				memcpy(outRow(out, pitch, y * nearest + k), dst, width * nearest * sizeof(uint32_t));
+		}
+	}
+
+	/*
+	* Scale2x: with B above, D left, F right and H below the source pixel E,
+	*   E0 = D==B && B!=F && D!=H ? D : E    E1 = B==F && B!=D && F!=H ? F : E
+	*   E2 = D==H && D!=B && H!=F ? D : E    E3 = H==F && H!=D && B!=F ? F : E
+	*/
+	void scale2xRows(const uint32_t* in, int width, int height, void* out, int pitch, int begin, int end)
+	{
+		for (int y = begin; y < end; ++y)
+		{
+			const uint32_t* above = row(in, width, height, y - 1);
+			const uint32_t* src = &in[y * width];
+			const uint32_t* below = row(in, width, height, y + 1);
+			uint32_t* top = outRow(out, pitch, y * 2);
+			uint32_t* bottom = outRow(out, pitch, y * 2 + 1);
+
+			auto scalar = [&](int x) {
+				uint32_t B = above[x], D = src[x > 0 ? x - 1 : x], E = src[x];
+				uint32_t F = src[x < width - 1 ? x + 1 : x], H = below[x];
+				bool edge = B != H && D != F;
+				top[x * 2] = edge && D == B ? D : E;
+				top[x * 2 + 1] = edge && B == F ? F : E;
+				bottom[x * 2] = edge && D == H ? D : E;
+				bottom[x * 2 + 1] = edge && H == F ? F : E;
+			};
+
+			scalar(0);
+			int x = 1;
+#if defined(__AVX2__)
+			for (; x + 9 <= width; x += 8)
+			{
+				__m256i B = _mm256_loadu_si256((const __m256i*)&above[x]);
+				__m256i D = _mm256_loadu_si256((const __m256i*)&src[x - 1]);
+				__m256i E = _mm256_loadu_si256((const __m256i*)&src[x]);
+				__m256i F = _mm256_loadu_si256((const __m256i*)&src[x + 1]);
+				__m256i H = _mm256_loadu_si256((const __m256i*)&below[x]);
+
+				// B!=H && D!=F is the same as the pairs of inequalities in the rules above once one equality holds.
+				__m256i flat = _mm256_or_si256(_mm256_cmpeq_epi32(B, H), _mm256_cmpeq_epi32(D, F));
+				__m256i e0 = _mm256_blendv_epi8(E, D, _mm256_andnot_si256(flat, _mm256_cmpeq_epi32(D, B)));
+				__m256i e1 = _mm256_blendv_epi8(E, F, _mm256_andnot_si256(flat, _mm256_cmpeq_epi32(B, F)));
+				__m256i e2 = _mm256_blendv_epi8(E, D, _mm256_andnot_si256(flat, _mm256_cmpeq_epi32(D, H)));
+				__m256i e3 = _mm256_blendv_epi8(E, F, _mm256_andnot_si256(flat, _mm256_cmpeq_epi32(H, F)));
+
+				__m256i lo = _mm256_unpacklo_epi32(e0, e1), hi = _mm256_unpackhi_epi32(e0, e1);
+				_mm256_storeu_si256((__m256i*)&top[x * 2], _mm256_permute2x128_si256(lo, hi, 0x20));
+				_mm256_storeu_si256((__m256i*)&top[x * 2 + 8], _mm256_permute2x128_si256(lo, hi, 0x31));
+				lo = _mm256_unpacklo_epi32(e2, e3), hi = _mm256_unpackhi_epi32(e2, e3);
+				_mm256_storeu_si256((__m256i*)&bottom[x * 2], _mm256_permute2x128_si256(lo, hi, 0x20));
+				_mm256_storeu_si256((__m256i*)&bottom[x * 2 + 8], _mm256_permute2x128_si256(lo, hi, 0x31));
+			}
+#endif
+			for (; x < width; ++x)
+				scalar(x);
+		}
+	}
+
+	/*
+	* Scale3x (AdvMAME3x), with A-I the 3x3 neighbourhood read left to right,
+	* top to bottom. The corners follow Scale2x; the edges only take a
+	* neighbour's colour when the corner next to them doesn't already match.
+	*/
+	inline void scale3xPixel(uint32_t A, uint32_t B, uint32_t C, uint32_t D, uint32_t E, uint32_t F, uint32_t G, uint32_t H, uint32_t I, uint32_t* r0, uint32_t* r1, uint32_t* r2)
+	{
+		if (B == H || D == F)
+		{
+			r0[0] = r0[1] = r0[2] = r1[0] = r1[1] = r1[2] = r2[0] = r2[1] = r2[2] = E;
+			return;
+		}
+		r0[0] = D == B ? D : E;
+		r0[1] = (D == B && E != C) || (B == F && E != A) ? B : E;
+		r0[2] = B == F ? F : E;
+		r1[0] = (D == B && E != G) || (D == H && E != A) ? D : E;
+		r1[1] = E;
+		r1[2] = (B == F && E != I) || (H == F && E != C) ? F : E;
+		r2[0] = D == H ? D : E;
+		r2[1] = (D == H && E != I) || (H == F && E != G) ? H : E;
+		r2[2] = H == F ? F : E;
+	}
+
+	void scale3xRows(const uint32_t* in, int width, int height, void* out, int pitch, int begin, int end)
+	{
+		for (int y = begin; y < end; ++y)
+		{
+			const uint32_t* above = row(in, width, height, y - 1);
+			const uint32_t* src = &in[y * width];
+			const uint32_t* below = row(in, width, height, y + 1);
+			uint32_t* r0 = outRow(out, pitch, y * 3);
+			uint32_t* r1 = outRow(out, pitch, y * 3 + 1);
+			uint32_t* r2 = outRow(out, pitch, y * 3 + 2);
+
+			auto scalar = [&](int x) {
+				int l = x > 0 ? x - 1 : x, r = x < width - 1 ? x + 1 : x;
+				scale3xPixel(above[l], above[x], above[r], src[l], src[x], src[r], below[l], below[x], below[r], &r0[x * 3], &r1[x * 3], &r2[x * 3]);
+			};
+
+			scalar(0);
+			int x = 1;
+#if defined(__AVX2__)
+			for (; x + 9 <= width; x += 8)
+			{
+				__m256i A = _mm256_loadu_si256((const __m256i*)&above[x - 1]);
+				__m256i B = _mm256_loadu_si256((const __m256i*)&above[x]);
+				__m256i C = _mm256_loadu_si256((const __m256i*)&above[x + 1]);
+				__m256i D = _mm256_loadu_si256((const __m256i*)&src[x - 1]);
+				__m256i E = _mm256_loadu_si256((const __m256i*)&src[x]);
+				__m256i F = _mm256_loadu_si256((const __m256i*)&src[x + 1]);
+				__m256i G = _mm256_loadu_si256((const __m256i*)&below[x - 1]);
+				__m256i H = _mm256_loadu_si256((const __m256i*)&below[x]);
+				__m256i I = _mm256_loadu_si256((const __m256i*)&below[x + 1]);
+
+				// Flat areas are by far the common case: replicate E without the rules.
+				__m256i flat = _mm256_or_si256(_mm256_cmpeq_epi32(B, H), _mm256_cmpeq_epi32(D, F));
+				if (_mm256_movemask_epi8(flat) == -1)
+				{
+					// Each pixel three times over: 24 outputs as three plain stores per row.
+					__m256i a = _mm256_permutevar8x32_epi32(E, _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2));
+					__m256i b = _mm256_permutevar8x32_epi32(E, _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5));
+					__m256i c = _mm256_permutevar8x32_epi32(E, _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7));
+					for (uint32_t* r : { r0, r1, r2 })
+					{
+						_mm256_storeu_si256((__m256i*)&r[x * 3], a);
+						_mm256_storeu_si256((__m256i*)&r[x * 3 + 8], b);
+						_mm256_storeu_si256((__m256i*)&r[x * 3 + 16], c);
+					}
+					continue;
+				}
+
+				__m256i db = _mm256_andnot_si256(flat, _mm256_cmpeq_epi32(D, B));
+				__m256i bf = _mm256_andnot_si256(flat, _mm256_cmpeq_epi32(B, F));
+				__m256i dh = _mm256_andnot_si256(flat, _mm256_cmpeq_epi32(D, H));
+				__m256i hf = _mm256_andnot_si256(flat, _mm256_cmpeq_epi32(H, F));
+				auto differs = [](__m256i a, __m256i b) {
+					return _mm256_xor_si256(_mm256_cmpeq_epi32(a, b), _mm256_set1_epi32(-1));
+				};
+
+				alignas(32) uint32_t e[9][8];
+				_mm256_store_si256((__m256i*)e[0], _mm256_blendv_epi8(E, D, db));
+				_mm256_store_si256((__m256i*)e[1], _mm256_blendv_epi8(E, B, _mm256_or_si256(_mm256_and_si256(db, differs(E, C)), _mm256_and_si256(bf, differs(E, A)))));
+				_mm256_store_si256((__m256i*)e[2], _mm256_blendv_epi8(E, F, bf));
+				_mm256_store_si256((__m256i*)e[3], _mm256_blendv_epi8(E, D, _mm256_or_si256(_mm256_and_si256(db, differs(E, G)), _mm256_and_si256(dh, differs(E, A)))));
+				_mm256_store_si256((__m256i*)e[4], E);
+				_mm256_store_si256((__m256i*)e[5], _mm256_blendv_epi8(E, F, _mm256_or_si256(_mm256_and_si256(bf, differs(E, I)), _mm256_and_si256(hf, differs(E, C)))));
+				_mm256_store_si256((__m256i*)e[6], _mm256_blendv_epi8(E, D, dh));
+				_mm256_store_si256((__m256i*)e[7], _mm256_blendv_epi8(E, H, _mm256_or_si256(_mm256_and_si256(dh, differs(E, I)), _mm256_and_si256(hf, differs(E, G)))));
+				_mm256_store_si256((__m256i*)e[8], _mm256_blendv_epi8(E, F, hf));
+
+				for (int k = 0; k < 8; ++k)
+				{
+					uint32_t* o0 = &r0[(x + k) * 3];
+					uint32_t* o1 = &r1[(x + k) * 3];
+					uint32_t* o2 = &r2[(x + k) * 3];
+					o0[0] = e[0][k], o0[1] = e[1][k], o0[2] = e[2][k];
+					o1[0] = e[3][k], o1[1] = e[4][k], o1[2] = e[5][k];
+					o2[0] = e[6][k], o2[1] = e[7][k], o2[2] = e[8][k];
+				}
+			}
+#endif
+			for (; x < width; ++x)
+				scalar(x);
+		}
+	}
+
+	/*
+	* Colour distance for xBR, weighted towards luma like its YUV metric.
+	*/
+	inline int distance(uint32_t a, uint32_t b)
+	{
+		int r = abs((int)(a >> 24) - (int)(b >> 24));
+		int g = abs((int)((a >> 16) & 0xFF) - (int)((b >> 16) & 0xFF));
+		int bl = abs((int)((a >> 8) & 0xFF) - (int)((b >> 8) & 0xFF));
+		return 2 * r + 4 * g + bl;
+	}
+
+	inline uint32_t blend(uint32_t a, uint32_t b)
+	{
+		return (((a >> 1) & 0x7F7F7F00) + ((b >> 1) & 0x7F7F7F00)) | 0xFF;
+	}
+
+	/*
+	* One output corner of xBR level 1, written for the bottom right: the edge
+	* runs along H-F when the weights across it beat those across E-I. The full
+	* filter also weighs pixels two steps out; this keeps to the 3x3 window.
+	*/
+	inline uint32_t xbrCorner(uint32_t E, uint32_t F, uint32_t H, uint32_t I, uint32_t C, uint32_t G, uint32_t D, uint32_t B)
+	{
+		if (E == F || E == H)
+			return E;
+		int along = distance(E, C) + distance(E, G) + 4 * distance(H, F);
+		int across = distance(H, D) + distance(F, B) + 4 * distance(E, I);
+		if (along >= across)
+			return E;
+		return blend(E, distance(E, F) <= distance(E, H) ? F : H);
+	}
+
+	void xbrRows(const uint32_t* in, int width, int height, void* out, int pitch, int begin, int end)
+	{
+		for (int y = begin; y < end; ++y)
+		{
+			const uint32_t* above = row(in, width, height, y - 1);
+			const uint32_t* src = &in[y * width];
+			const uint32_t* below = row(in, width, height, y + 1);
+			uint32_t* top = outRow(out, pitch, y * 2);
+			uint32_t* bottom = outRow(out, pitch, y * 2 + 1);
+
+			for (int x = 0; x < width; ++x)
+			{
+				int l = x > 0 ? x - 1 : x, r = x < width - 1 ? x + 1 : x;
+				uint32_t A = above[l], B = above[x], C = above[r];
+				uint32_t D = src[l], E = src[x], F = src[r];
+				uint32_t G = below[l], H = below[x], I = below[r];
+
+				top[x * 2] = xbrCorner(E, D, B, A, G, C, F, H);
+				top[x * 2 + 1] = xbrCorner(E, F, B, C, I, A, D, H);
+				bottom[x * 2] = xbrCorner(E, D, H, G, A, I, F, B);
+				bottom[x * 2 + 1] = xbrCorner(E, F, H, I, C, G, D, B);
+			}
+		}
+	}
+
+	/*
+	* Scale a width x height RGBA frame by factor() into out, in bands of rows
+	* spread over the pool.
+	*/
+	void scale(const uint32_t* in, int width, int height, void* out, int pitch)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		if (!pool)
+			setThreads(0);
+
+		void (*rows)(const uint32_t*, int, int, void*, int, int, int);
+		switch (mode)
+		{
+		case SCALE2X:
+			rows = scale2xRows;
+			break;
+		case SCALE3X:
+			rows = scale3xRows;
+			break;
+		case XBR_LITE:
+			rows = xbrRows;
+			break;
+		default:
+			rows = nearestRows;
+			break;
+		}
+
+		int bands = threadCount * 4;
+		pool->run(bands, [&](int band) {
+			rows(in, width, height, out, pitch, band * height / bands, (band + 1) * height / bands);
+		});
+
+		milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	/*
+	* Time the last scale() took.
+	*/
+	double lastMilliseconds()
+	{
+		return milliseconds;
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+* CPU-side upscalers from an RGBA8888 frame (as written by Palette::convert or
+* Ntsc::filter) to a destination such as a locked streaming texture. Output is
+* split into bands of rows across a worker pool.
+*/
+namespace Scaler
+{
+	typedef enum {
+		NEAREST, // Integer factor, any size
+		SCALE2X, // AdvMAME2x/EPX edge rules, 2x
+		SCALE3X, // AdvMAME3x, 3x
+		XBR_LITE // xBR's edge weighting reduced to the 3x3 neighbourhood, 2x with blending
+	} scaler_e;
+
+	bool select(const char* name, int nearestFactor = 2);
+	void select(scaler_e mode, int nearestFactor = 2);
+	scaler_e current();
+	const char* name(scaler_e mode);
+	int factor();
+	void setThreads(int count);
+
+	void scale(const uint32_t* in, int width, int height, void* out, int pitch);
+	double lastMilliseconds();
+}
@@ -0,0 +1,478 @@
+#include "Scheduler.h"
+#include "Cartridge.h"
+#include "Console.h"
+#include "Controller.h"
+#include "PPU.h"
+#include "Savestate.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace Scheduler
+{
+	typedef std::chrono::steady_clock timer;
+
+	/*
+	* A console between tasks. Its snapshot is always current then, and is
+	* allocated by the first worker to run it so that it lives on that worker's
+	* NUMA node.
+	*/
+	typedef struct {
+		std::unique_ptr<Savestate::Snapshot> state; // Null until the console first runs
+		std::vector<uint8_t> framebuffer;
+		uint64_t version; // Frames run, to tell whether a worker's chips still hold this console
+		uint8_t buttons[2];
+		uint32_t framesLeft; // FREE mode
+		int home; // Worker that last ran it
+	} console_s;
+
+	typedef struct {
+		std::thread thread;
+		std::mutex mutex; // Guards tasks
+		std::deque<int> tasks; // Consoles due a frame
+		int cpu; // -1 if not pinned
+		int node;
+		std::vector<int> victims; // Other workers in stealing order: same node first
+		int resident; // Console whose state is in this worker's chips, -1 if none
+		uint64_t residentVersion;
+		uint64_t tasksRun, steals, swaps;
+		double busySeconds, overheadSeconds;
+	} worker_s;
+
+	int threadCount = 0;
+	bool pinning = true;
+
+	std::vector<std::unique_ptr<worker_s>> workers;
+	std::vector<console_s> consoles;
+	Savestate::Snapshot start; // Every console starts as a copy of the console that called begin()
+	PPU::backend_e backend = PPU::SCANLINE;
+
+	std::mutex mutex; // Guards the fields below and the sleeping side of wake
+	std::condition_variable wake, finished;
+	std::atomic<int> queued(0); // Tasks sitting in deques
+	std::atomic<int> sleepers(0);
+	int remaining = 0; // Tasks (BARRIER) or consoles (FREE) still to finish
+	bool stopping = false;
+	mode_e runMode = BARRIER;
+	stats_s stats = {};
+
+	/*
+	* Parse a sysfs CPU list such as "0-3,8-11".
+	*/
+	std::vector<int> parseList(const std::string& list)
+	{
+		std::vector<int> values;
+		size_t i = 0;
+		while (i < list.size())
+		{
+			size_t end = list.find(',', i);
+			if (end == std::string::npos)
+				end = list.size();
+			std::string range = list.substr(i, end - i);
+			size_t dash = range.find('-');
+			int first = atoi(range.c_str());
+			int last = dash == std::string::npos ? first : atoi(range.c_str() + dash + 1);
+			for (int value = first; value <= last; ++value)
+				values.push_back(value);
+			i = end + 1;
+		}
+		return values;
+	}
+
+	/*
+	* The CPUs this process may run on, grouped by NUMA node, with the node of
+	* each. Without NUMA information everything is node 0.
+	*/
+	void topology(std::vector<int>& cpus, std::vector<int>& nodes)
+	{
+#ifdef _WIN32
+		DWORD_PTR processMask, systemMask;
+		if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+			return;
+		for (int cpu = 0; cpu < (int)sizeof(DWORD_PTR) * 8; ++cpu)
+		{
+			if (!(processMask & ((DWORD_PTR)1 << cpu)))
+				continue;
+			UCHAR node = 0;
+			GetNumaProcessorNode((UCHAR)cpu, &node);
+			cpus.push_back(cpu);
+			nodes.push_back(node == 0xFF ? 0 : node);
+		}
+#elif defined(__linux__)
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+			return;
+
+		std::vector<bool> seen(CPU_SETSIZE, false);
+		std::string possible;
+		std::ifstream("/sys/devices/system/node/possible") >> possible;
+		for (int node : parseList(possible))
+		{
+			std::string list;
+			std::ifstream("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist") >> list;
+			for (int cpu : parseList(list))
+			{
+				if (cpu < 0 || cpu >= CPU_SETSIZE || seen[cpu] || !CPU_ISSET(cpu, &allowed))
+					continue;
+				seen[cpu] = true;
+				cpus.push_back(cpu);
+				nodes.push_back(node);
+			}
+		}
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		{
+			if (CPU_ISSET(cpu, &allowed) && !seen[cpu])
+			{
+				cpus.push_back(cpu);
+				nodes.push_back(0);
+			}
+		}
+#endif
+
+		// Keep each node's CPUs together, so neighbouring workers share a node.
+		std::vector<size_t> order(cpus.size());
+		for (size_t i = 0; i < order.size(); ++i)
+			order[i] = i;
+		std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return nodes[a] < nodes[b]; });
+		std::vector<int> sortedCpus, sortedNodes;
+		for (size_t i : order)
+		{
+			sortedCpus.push_back(cpus[i]);
+			sortedNodes.push_back(nodes[i]);
+		}
+		cpus.swap(sortedCpus);
+		nodes.swap(sortedNodes);
+	}
+
+	void pin(int cpu)
+	{
+		if (cpu < 0)
+			return;
+#ifdef _WIN32
+		SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+	}
+
+	/*
+	* Queue a frame of a console on a worker's deque.
+	*/
+	void push(worker_s& worker, int console)
+	{
+		{
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			worker.tasks.push_back(console);
+		}
+		++queued;
+		if (sleepers > 0)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			wake.notify_one();
+		}
+	}
+
+	/*
+	* The newest task on the worker's own deque, or else the oldest on someone
+	* else's.
+	*/
+	bool take(worker_s& self, int& console)
+	{
+		{
+			std::lock_guard<std::mutex> lock(self.mutex);
+			if (!self.tasks.empty())
+			{
+				console = self.tasks.back();
+				self.tasks.pop_back();
+				--queued;
+				return true;
+			}
+		}
+		for (int victim : self.victims)
+		{
+			worker_s& other = *workers[victim];
+			std::lock_guard<std::mutex> lock(other.mutex);
+			if (!other.tasks.empty())
+			{
+				console = other.tasks.front();
+				other.tasks.pop_front();
+				--queued;
+				++self.steals;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*
+	* Advance a console one frame on this worker's chips.
+	*/
+	void runTask(int index, worker_s& self, int console)
+	{
+		timer::time_point begin = timer::now();
+		console_s& target = consoles[console];
+
+		if (self.resident != console || self.residentVersion != target.version)
+		{
+			if (!target.state)
+			{
+				target.state.reset(new Savestate::Snapshot(start));
+				target.framebuffer.assign(PPU_WIDTH * PPU_HEIGHT, 0);
+			}
+			Savestate::load(*target.state);
+			PPU::setFramebuffer(target.framebuffer.data());
+			self.resident = console;
+			++self.swaps;
+		}
+		Controller::setButtons(0, target.buttons[0]);
+		Controller::setButtons(1, target.buttons[1]);
+
+		timer::time_point frameBegin = timer::now();
+		Console::runFrame();
+		timer::time_point frameEnd = timer::now();
+
+		// Anyone may pick the console up next, so leave its snapshot current.
+		Savestate::save(*target.state);
+		self.residentVersion = ++target.version;
+		target.home = index;
+		++self.tasksRun;
+
+		bool done = true;
+		if (runMode == FREE && --target.framesLeft > 0)
+		{
+			push(self, console);
+			done = false;
+		}
+
+		self.busySeconds += std::chrono::duration<double>(frameEnd - frameBegin).count();
+		self.overheadSeconds += std::chrono::duration<double>(frameBegin - begin + (timer::now() - frameEnd)).count();
+
+		if (done)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--remaining == 0)
+				finished.notify_all();
+		}
+	}
+
+	void work(int index)
+	{
+		worker_s& self = *workers[index];
+		pin(self.cpu);
+
+		Cartridge::loadForThread();
+		Console::power();
+		PPU::setBackend(backend);
+
+		while (true)
+		{
+			int console;
+			if (take(self, console))
+			{
+				runTask(index, self, console);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(mutex);
+			++sleepers;
+			wake.wait(lock, [] { return stopping || queued > 0; });
+			--sleepers;
+			if (stopping)
+				break;
+		}
+		Cartridge::unload();
+	}
+
+	/*
+	* Worker threads for the next begin(); 0 picks one per hardware thread.
+	*/
+	void setThreads(int count)
+	{
+		threadCount = count;
+	}
+
+	/*
+	* Whether the next begin() pins workers to CPUs, in NUMA node order.
+	*/
+	void setPinning(bool enabled)
+	{
+		pinning = enabled;
+	}
+
+	int threads()
+	{
+		if (!workers.empty())
+			return (int)workers.size();
+		return threadCount > 0 ? threadCount : std::max(1, (int)std::thread::hardware_concurrency());
+	}
+
+	/*
+	* Start count consoles, each a copy of the current console, and the workers
+	* to run them. The calling thread's own console is left alone.
+	*/
+	void begin(int count)
+	{
+		end();
+
+		Savestate::save(start);
+		backend = PPU::getBackend();
+		consoles.resize(count);
+		for (console_s& console : consoles)
+		{
+			console.state.reset();
+			console.version = 0;
+			console.buttons[0] = Controller::getButtons(0);
+			console.buttons[1] = Controller::getButtons(1);
+			console.framesLeft = 0;
+		}
+
+		std::vector<int> cpus, nodes;
+		if (pinning)
+			topology(cpus, nodes);
+
+		int size = threads();
+		for (int i = 0; i < size; ++i)
+		{
+			workers.emplace_back(new worker_s());
+			worker_s& worker = *workers.back();
+			worker.cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+			worker.node = nodes.empty() ? 0 : nodes[i % nodes.size()];
+			worker.resident = -1;
+			worker.residentVersion = 0;
+		}
+		for (int i = 0; i < size; ++i)
+		{
+			for (int pass = 0; pass < 2; ++pass)
+			{
+				for (int step = 1; step < size; ++step)
+				{
+					int victim = (i + step) % size;
+					if ((workers[victim]->node == workers[i]->node) == (pass == 0))
+						workers[i]->victims.push_back(victim);
+				}
+			}
+		}
+
+		// Consoles start out in contiguous blocks, one block per worker.
+		for (int i = 0; i < count; ++i)
+			consoles[i].home = (int)((int64_t)i * size / count);
+
+		stopping = false;
+		for (int i = 0; i < size; ++i)
+			workers[i]->thread = std::thread(work, i);
+	}
+
+	void end()
+	{
+		if (workers.empty())
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (std::unique_ptr<worker_s>& worker : workers)
+			worker->thread.join();
+		workers.clear();
+		consoles.clear();
+	}
+
+	/*
+	* Buttons held on a console's controller port from its next frame on.
+	*/
+	void setButtons(int console, int port, uint8_t buttons)
+	{
+		consoles[console].buttons[port] = buttons;
+	}
+
+	/*
+	* Advance every console by frames frames and wait for all of them.
+	*/
+	void run(uint32_t frames, mode_e mode)
+	{
+		if (workers.empty() || consoles.empty() || frames == 0)
+			return;
+
+		for (std::unique_ptr<worker_s>& worker : workers)
+		{
+			worker->tasksRun = worker->steals = worker->swaps = 0;
+			worker->busySeconds = worker->overheadSeconds = 0;
+		}
+
+		timer::time_point begin = timer::now();
+		runMode = mode;
+		uint32_t rounds = mode == BARRIER ? frames : 1;
+		for (uint32_t round = 0; round < rounds; ++round)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				remaining = (int)consoles.size();
+			}
+			for (int i = 0; i < (int)consoles.size(); ++i)
+			{
+				consoles[i].framesLeft = mode == BARRIER ? 1 : frames;
+				push(*workers[consoles[i].home], i);
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				wake.notify_all();
+			}
+
+			std::unique_lock<std::mutex> lock(mutex);
+			finished.wait(lock, [] { return remaining == 0; });
+		}
+
+		stats = {};
+		stats.seconds = std::chrono::duration<double>(timer::now() - begin).count();
+		for (std::unique_ptr<worker_s>& worker : workers)
+		{
+			stats.tasks += worker->tasksRun;
+			stats.steals += worker->steals;
+			stats.swaps += worker->swaps;
+			stats.busySeconds += worker->busySeconds;
+			stats.overheadSeconds += worker->overheadSeconds;
+		}
+	}
+
+	stats_s getStats()
+	{
+		return stats;
+	}
+
+	uint8_t* getRam(int console)
+	{
+		Savestate::Snapshot* state = consoles[console].state.get();
+		return state ? state->cpu.ram : start.cpu.ram;
+	}
+
+	/*
+	* A console's last frame, or nullptr before it has run.
+	*/
+	uint8_t* getFramebuffer(int console)
+	{
+		return consoles[console].framebuffer.empty() ? nullptr : consoles[console].framebuffer.data();
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+* Many consoles of the loaded cartridge on a pool of worker threads, with
+* "advance console K by one frame" as the unit of work. Chip state is per
+* thread, so each worker runs one console at a time on its own copy of the chips
+* and cartridge, swapping a console's snapshot in when it picks up another one.
+*
+* Every worker has its own deque of tasks. It pushes and pops at the back; an
+* idle worker steals from the front of another's, trying the workers on its own
+* NUMA node first. With pinning on, workers are pinned to CPUs in node order.
+*
+* BARRIER mode finishes frame N on every console before any console starts
+* N + 1, for callers that act on all consoles in between. FREE mode lets each
+* console run its frames independently: a worker that finishes a frame queues
+* the console's next one on its own deque, so consoles tend to stay put and
+* only move when another worker runs out.
+*/
+namespace Scheduler
+{
+	typedef enum {
+		BARRIER,
+		FREE
+	} mode_e;
+
+	typedef struct {
+		uint64_t tasks;
+		uint64_t steals;
+		uint64_t swaps; // Tasks that had to swap their console in
+		double seconds; // Wall time of the run
+		double busySeconds; // Summed over workers: time spent running frames
+		double overheadSeconds; // Summed over workers: finding tasks and swapping consoles
+	} stats_s;
+
+	void setThreads(int count);
+	void setPinning(bool enabled);
+	int threads();
+
+	void begin(int consoles);
+	void end();
+
+	void setButtons(int console, int port, uint8_t buttons);
+	void run(uint32_t frames, mode_e mode);
+	stats_s getStats();
+
+	uint8_t* getRam(int console);
+	uint8_t* getFramebuffer(int console);
+}
@@ -0,0 +1,303 @@
+#include "Screenshot.h"
+#include "Hash.h"
+#include "Palette.h"
+#include "PPU.h"
+#include "WorkerPool.h"
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+
+namespace Screenshot
+{
+	typedef struct {
+		std::string filename;
+		const uint8_t* indices;
+		uint8_t mask;
+		format_e format;
+	} pending_s;
+
+	std::vector<pending_s> pending;
+	std::unique_ptr<WorkerPool> pool;
+
+	const int window = 32768; // Deflate's largest match distance
+	const int maxMatch = 258;
+	const int maxChain = 32; // Candidates tried per position; frames are repetitive enough that few are needed.
+
+	const uint16_t lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	const uint8_t lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	const uint16_t distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	const uint8_t distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+	/*
+	* Deflate's bit order: values go in least significant bit first, Huffman
+	* codes most significant bit first.
+	*/
+	class BitWriter
+	{
+		std::vector<uint8_t>& out;
+		uint32_t bits = 0;
+		int count = 0;
+
+	public:
+		BitWriter(std::vector<uint8_t>& out) : out(out) {}
+
+		void put(uint32_t value, int length)
+		{
+			bits |= value << count;
+			count += length;
+			while (count >= 8)
+			{
+				out.push_back((uint8_t)bits);
+				bits >>= 8;
+				count -= 8;
+			}
+		}
+
+		void putCode(uint32_t code, int length)
+		{
+			uint32_t reversed = 0;
+			for (int i = 0; i < length; ++i)
+				reversed |= ((code >> i) & 1) << (length - 1 - i);
+			put(reversed, length);
+		}
+
+		void finish()
+		{
+			if (count)
+				out.push_back((uint8_t)bits);
+			bits = 0;
+			count = 0;
+		}
+	};
+
+	/*
+	* A symbol of the fixed literal/length code (RFC 1951 3.2.6).
+	*/
+	void putSymbol(BitWriter& bits, int symbol)
+	{
+		if (symbol < 144)
+			bits.putCode(0x30 + symbol, 8);
+		else if (symbol < 256)
+			bits.putCode(0x190 + symbol - 144, 9);
+		else if (symbol < 280)
+			bits.putCode(symbol - 256, 7);
+		else
+			bits.putCode(0xC0 + symbol - 280, 8);
+	}
+
+	void putMatch(BitWriter& bits, int length, int distance)
+	{
+		int code = 28;
+		while (lengthBase[code] > length)
+			--code;
+		putSymbol(bits, 257 + code);
+		bits.put(length - lengthBase[code], lengthExtra[code]);
+
+		code = 29;
+		while (distanceBase[code] > distance)
+			--code;
+		bits.putCode(code, 5);
+		bits.put(distance - distanceBase[code], distanceExtra[code]);
+	}
+
+	inline uint32_t hash3(const uint8_t* p)
+	{
+		return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> 16;
+	}
+
+	/*
+	* zlib stream of one fixed-Huffman deflate block, matches found greedily
+	* through hash chains.
+	*/
+	void deflate(const std::vector<uint8_t>& data, std::vector<uint8_t>& out)
+	{
+		int size = (int)data.size();
+		std::vector<int> head(1 << 16, -1), previous(size);
+
+		out.push_back(0x78); // Deflate, 32KB window
+		out.push_back(0x01); // Fastest compression, check bits
+		BitWriter bits(out);
+		bits.put(1, 1); // Final block
+		bits.put(1, 2); // Fixed Huffman codes
+
+		auto insert = [&](int position) {
+			if (position + 3 <= size)
+			{
+				uint32_t h = hash3(&data[position]);
+				previous[position] = head[h];
+				head[h] = position;
+			}
+		};
+
+		for (int i = 0; i < size;)
+		{
+			int best = 0, distance = 0;
+			if (i + 3 <= size)
+			{
+				int limit = size - i < maxMatch ? size - i : maxMatch;
+				int chain = 0;
+				for (int j = head[hash3(&data[i])]; j >= 0 && i - j <= window && chain < maxChain; j = previous[j], ++chain)
+				{
+					int length = 0;
+					while (length < limit && data[j + length] == data[i + length])
+						++length;
+					if (length > best)
+					{
+						best = length;
+						distance = i - j;
+						if (length == limit)
+							break;
+					}
+				}
+			}
+
+			if (best >= 3)
+			{
+				putMatch(bits, best, distance);
+				for (int k = 0; k < best; ++k)
+					insert(i + k);
+				i += best;
+			}
+			else
+			{
+				putSymbol(bits, data[i]);
+				insert(i);
+				++i;
+			}
+		}
+		putSymbol(bits, 256);
+		bits.finish();
+
+		uint32_t adler = Hash::adler32(data.data(), data.size());
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back((uint8_t)(adler >> shift));
+	}
+
+	void putChunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t length)
+	{
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back((uint8_t)(length >> shift));
+		size_t start = out.size();
+		out.insert(out.end(), type, type + 4);
+		out.insert(out.end(), data, data + length);
+		uint32_t crc = Hash::crc32(&out[start], length + 4);
+		for (int shift = 24; shift >= 0; shift -= 8)
+			out.push_back((uint8_t)(crc >> shift));
+	}
+
+	/*
+	* Encode one frame. Greyscale and emphasis are applied to the PLTE (PNG)
+	* or the pixels (PPM) from the frame's own mask.
+	*/
+	void encode(const uint8_t* indices, uint8_t mask, format_e format, std::vector<uint8_t>& out)
+	{
+		const uint32_t* table = Palette::table(mask);
+		uint8_t keep = (mask & 0x01) ? 0x30 : 0x3F;
+		out.clear();
+
+		if (format == PPM)
+		{
+			char header[32];
+			int length = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", PPU_WIDTH, PPU_HEIGHT);
+			out.assign(header, header + length);
+			out.resize(length + PPU_WIDTH * PPU_HEIGHT * 3);
+			uint8_t* rgb = &out[length];
+			for (int p = 0; p < PPU_WIDTH * PPU_HEIGHT; ++p)
+			{
+				uint32_t rgba = table[indices[p] & keep];
+				rgb[p * 3] = rgba >> 24;
+				rgb[p * 3 + 1] = rgba >> 16;
+				rgb[p * 3 + 2] = rgba >> 8;
+			}
+			return;
+		}
+
+		const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		out.assign(signature, signature + 8);
+
+		const uint8_t header[13] = {
+			0, 0, PPU_WIDTH >> 8, PPU_WIDTH & 0xFF, 0, 0, PPU_HEIGHT >> 8, PPU_HEIGHT & 0xFF,
+			8, 3, 0, 0, 0 // 8-bit indexed, deflate, adaptive filtering, no interlace
+		};
+		putChunk(out, "IHDR", header, sizeof(header));
+
+		uint8_t palette[64 * 3];
+		for (int i = 0; i < 64; ++i)
+		{
+			uint32_t rgba = table[i & keep];
+			palette[i * 3] = rgba >> 24;
+			palette[i * 3 + 1] = rgba >> 16;
+			palette[i * 3 + 2] = rgba >> 8;
+		}
+		putChunk(out, "PLTE", palette, sizeof(palette));
+
+		// Rows go in unfiltered: filters suit photographs, not 64-colour indexed art.
+		std::vector<uint8_t> raw(PPU_HEIGHT * (PPU_WIDTH + 1));
+		for (int y = 0; y < PPU_HEIGHT; ++y)
+		{
+			uint8_t* row = &raw[y * (PPU_WIDTH + 1)];
+			row[0] = 0;
+			for (int x = 0; x < PPU_WIDTH; ++x)
+				row[x + 1] = indices[y * PPU_WIDTH + x] & 0x3F;
+		}
+		std::vector<uint8_t> compressed;
+		deflate(raw, compressed);
+		putChunk(out, "IDAT", compressed.data(), compressed.size());
+		putChunk(out, "IEND", nullptr, 0);
+	}
+
+	bool write(const std::string& filename, const uint8_t* indices, uint8_t mask, format_e format)
+	{
+		std::vector<uint8_t> out;
+		encode(indices, mask, format, out);
+
+		FILE* f;
+#ifdef _MSC_VER
+		fopen_s(&f, filename.c_str(), "wb");
+#else
+		f = fopen(filename.c_str(), "wb");
+#endif
+		if (!f)
+			return false;
+		bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+		return fclose(f) == 0 && ok;
+	}
+
+	/*
+	* Threads to encode across, counting the caller; 0 is one per hardware thread.
+	*/
+	void setThreads(int count)
+	{
+		pool.reset(new WorkerPool(count));
+	}
+
+	void add(const std::string& filename, const uint8_t* indices, uint8_t mask, format_e format)
+	{
+		pending.push_back({ filename, indices, mask, format });
+	}
+
+	/*
+	* Encode and write everything queued, one frame per task. False if any file failed.
+	*/
+	bool flush()
+	{
+		if (pending.empty())
+			return true;
+		if (!pool)
+			setThreads(0);
+
+		// Build the lookup tables up front so no worker waits on the build.
+		Palette::table(0);
+		Hash::crc32(nullptr, 0);
+
+		std::atomic<bool> ok(true);
+		pool->run((int)pending.size(), [&](int task) {
+			const pending_s& frame = pending[task];
+			if (!write(frame.filename, frame.indices, frame.mask, frame.format))
+				ok = false;
+		});
+		pending.clear();
+		return ok;
+	}
+}
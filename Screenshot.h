@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+* Still frames from the PPU's palette indices. PNG output is 8-bit indexed
+* with the 64 palette colours as its PLTE, so pixels go into the image as they
+* are; PPM is plain 24-bit RGB.
+*
+* add() queues a frame by reference, without copying it; flush() then encodes
+* everything queued across a worker pool and writes the files. Buffers passed
+* to add() must stay untouched until flush() returns.
+*/
+namespace Screenshot
+{
+	typedef enum {
+		PNG,
+		PPM
+	} format_e;
+
+	void encode(const uint8_t* indices, uint8_t mask, format_e format, std::vector<uint8_t>& out);
+	bool write(const std::string& filename, const uint8_t* indices, uint8_t mask, format_e format);
+
+	void setThreads(int count);
+	void add(const std::string& filename, const uint8_t* indices, uint8_t mask, format_e format);
+	bool flush();
+}
@@ -0,0 +1,151 @@
+#include "Timeline.h"
+#include "PPU.h"
+
+namespace Timeline
+{
+	typedef struct {
+		uint64_t when;
+		event_e event;
+	} entry_s;
+
+	thread_local uint64_t clock = 0;
+	thread_local uint64_t due = UINT64_MAX; // When the top of the heap is, kept apart so advance() needn't look
+	thread_local entry_s heap[EVENT_COUNT];
+	thread_local int size = 0;
+	thread_local int slot[EVENT_COUNT] = {}; // Heap index + 1 of each kind, 0 when it isn't pending
+
+	inline void place(int index, const entry_s& entry)
+	{
+		heap[index] = entry;
+		slot[entry.event] = index + 1;
+	}
+
+	void siftUp(int index)
+	{
+		entry_s entry = heap[index];
+		while (index > 0)
+		{
+			int parent = (index - 1) / 2;
+			if (heap[parent].when <= entry.when)
+				break;
+			place(index, heap[parent]);
+			index = parent;
+		}
+		place(index, entry);
+	}
+
+	void siftDown(int index)
+	{
+		entry_s entry = heap[index];
+		for (;;)
+		{
+			int child = index * 2 + 1;
+			if (child >= size)
+				break;
+			if (child + 1 < size && heap[child + 1].when < heap[child].when)
+				++child;
+			if (entry.when <= heap[child].when)
+				break;
+			place(index, heap[child]);
+			index = child;
+		}
+		place(index, entry);
+	}
+
+	void remove(int index)
+	{
+		slot[heap[index].event] = 0;
+		if (index != --size)
+		{
+			event_e moved = heap[size].event;
+			place(index, heap[size]);
+			siftDown(index);
+			siftUp(slot[moved] - 1);
+		}
+		due = size ? heap[0].when : UINT64_MAX;
+	}
+
+	/*
+	* Catch up whichever chip scheduled an event, which schedules its next.
+	*/
+	void dispatch(event_e event)
+	{
+		switch (event)
+		{
+		case VBLANK:
+		case FRAME_END:
+			PPU::sync();
+			break;
+		default:
+			break;
+		}
+	}
+
+	uint64_t now()
+	{
+		return clock;
+	}
+
+	/*
+	* Move the clock on, taking every event that comes due on the way. Chips
+	* catch up to the new time, not the event's, which they can't tell apart as
+	* long as steps are no longer than the CPU's.
+	*/
+	void advance(uint32_t dots)
+	{
+		clock += dots;
+		while (due <= clock)
+		{
+			event_e event = heap[0].event;
+			remove(0);
+			dispatch(event);
+		}
+	}
+
+	/*
+	* Bring every chip up to now, for when the CPU is about to change something
+	* they read on their own, such as the cartridge's banks.
+	*/
+	void catchUp()
+	{
+		PPU::sync();
+	}
+
+	/*
+	* Set when an event of this kind happens, replacing any pending one.
+	*/
+	void schedule(event_e event, uint64_t when)
+	{
+		int index = slot[event] - 1;
+		if (index < 0)
+		{
+			index = size++;
+			place(index, { when, event });
+			siftUp(index);
+		}
+		else
+		{
+			uint64_t previous = heap[index].when;
+			heap[index].when = when;
+			if (when < previous)
+				siftUp(index);
+			else
+				siftDown(index);
+		}
+		due = heap[0].when;
+	}
+
+	void cancel(event_e event)
+	{
+		if (slot[event])
+			remove(slot[event] - 1);
+	}
+
+	/*
+	* When the next event is, UINT64_MAX if there is none.
+	*/
+	uint64_t next()
+	{
+		return due;
+	}
+}
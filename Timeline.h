@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+* One clock for the whole console, counted in PPU dots, three to a CPU
+* instruction. The CPU runs at the front and the other chips run behind it,
+* owing the time since they last caught up. A chip catches up when the CPU
+* touches it, or at the next event it has scheduled: a moment at which the CPU
+* could tell it was behind without touching it, such as the NMI at the start
+* of V-Blank.
+*
+* Pending events wait in a min-heap with one slot per kind, so the next one is
+* always on top and rescheduling one costs a few swaps. Events are derived from
+* the chips' state and scheduled again whenever it is loaded, so they are not
+* part of a savestate.
+*/
+namespace Timeline
+{
+	typedef enum {
+		VBLANK, // The PPU sets the V-Blank flag and may raise an NMI.
+		FRAME_END, // The PPU moves on to the next frame.
+		EVENT_COUNT
+	} event_e;
+
+	uint64_t now();
+	void advance(uint32_t dots);
+	void catchUp();
+
+	void schedule(event_e event, uint64_t when);
+	void cancel(event_e event);
+	uint64_t next();
+}
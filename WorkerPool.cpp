@@ -0,0 +1,73 @@
+#include "WorkerPool.h"
+
+/*
+* size counts the calling thread; 0 picks one per hardware thread.
+*/
+WorkerPool::WorkerPool(int size)
+{
+	if (size <= 0)
+		size = (int)std::thread::hardware_concurrency();
+	for (int i = 1; i < size; ++i)
+		threads.emplace_back(&WorkerPool::work, this);
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+int WorkerPool::size()
+{
+	return (int)threads.size() + 1;
+}
+
+/*
+* Take tasks until none are left. Called with the lock held.
+*/
+void WorkerPool::drain(std::unique_lock<std::mutex>& lock)
+{
+	while (next < tasks)
+	{
+		int task = next++;
+		lock.unlock();
+		job(task);
+		lock.lock();
+		if (--pending == 0)
+			finished.notify_all();
+	}
+}
+
+void WorkerPool::work()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		wake.wait(lock, [this] { return stopping || next < tasks; });
+		if (stopping)
+			return;
+		drain(lock);
+	}
+}
+
+/*
+* Run task(0) ... task(count - 1) across the pool and wait for all of them.
+*/
+void WorkerPool::run(int count, const std::function<void(int)>& task)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	job = task;
+	tasks = count;
+	next = 0;
+	pending = count;
+	wake.notify_all();
+
+	drain(lock);
+	finished.wait(lock, [this] { return pending == 0; });
+	tasks = next = 0;
+}
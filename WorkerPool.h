@@ -0,0 +1,34 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+* Persistent threads that share out a job split into numbered tasks. The
+* calling thread works on the job too, and run() returns once every task is
+* done, so a pool of size 1 simply runs the job inline. One job at a time.
+*/
+class WorkerPool
+{
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable wake, finished;
+	std::function<void(int)> job;
+	int tasks = 0;
+	int next = 0;
+	int pending = 0; // Tasks handed out but not yet finished
+	bool stopping = false;
+
+	void work();
+	void drain(std::unique_lock<std::mutex>& lock);
+
+public:
+	WorkerPool(int size = 0);
+	~WorkerPool();
+
+	int size();
+	void run(int count, const std::function<void(int)>& task);
+};
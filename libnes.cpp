@@ -0,0 +1,241 @@
+#include "libnes.h"
+#include "APU.h"
+#include "Cartridge.h"
+#include "Console.h"
+#include "Controller.h"
+#include "CPU.h"
+#include "Mapper.h"
+#include "Palette.h"
+#include "PPU.h"
+
+#include <cstring>
+#include <new>
+
+/*
+* A console that owns its state. While a call runs, the calling thread's chips
+* are pointed at it: the PPU attaches to the state in place, the CPU runs on its
+* RAM and the cartridge is its mapper, so switching costs a few pointers and
+* the chips' registers rather than a snapshot.
+*/
+struct nes
+{
+	CPU::state_s cpu;
+	PPU::state_s ppu;
+	APU::state_s apu;
+	Controller::state_s controller;
+	uint8_t buttons[2];
+	bool render;
+	Mapper* mapper;
+	uint8_t framebuffer[PPU_WIDTH * PPU_HEIGHT];
+};
+
+namespace
+{
+	const uint32_t stateMagic = 0x5354454E; // "NEST"
+
+	/*
+	* Points the calling thread's chips at a console for the length of a call.
+	*/
+	class Active
+	{
+		nes& console;
+		Mapper* previousMapper;
+		uint8_t* previousRam;
+		uint8_t* previousFramebuffer;
+
+	public:
+		Active(nes& console) : console(console)
+		{
+			static thread_local bool threadReady = false;
+			if (!threadReady)
+			{
+				APU::initialize(); // The only chip that needs memory of its own on this thread
+				threadReady = true;
+			}
+
+			previousMapper = Cartridge::mapper;
+			previousRam = CPU::getRam();
+			previousFramebuffer = PPU::getFramebuffer();
+
+			Cartridge::mapper = console.mapper;
+			CPU::setRam(console.cpu.ram);
+			CPU::setRegisters(console.cpu.regs);
+			PPU::attach(console.ppu);
+			PPU::setFramebuffer(console.framebuffer);
+			PPU::setSkipRender(!console.render);
+			APU::load(console.apu);
+			Controller::load(console.controller);
+			Controller::setButtons(0, console.buttons[0]);
+			Controller::setButtons(1, console.buttons[1]);
+		}
+
+		~Active()
+		{
+			console.cpu.regs = CPU::getRegisters();
+			PPU::detach();
+			APU::save(console.apu);
+			Controller::save(console.controller);
+
+			PPU::setSkipRender(false);
+			PPU::setFramebuffer(previousFramebuffer);
+			CPU::setRam(previousRam);
+			Cartridge::mapper = previousMapper;
+		}
+	};
+}
+
+extern "C"
+{
+	uint32_t nes_abi_version(void)
+	{
+		return NES_ABI_VERSION;
+	}
+
+	nes* nes_create(void)
+	{
+		nes* console = new (std::nothrow) nes();
+		if (console)
+			console->render = true;
+		return console;
+	}
+
+	void nes_destroy(nes* console)
+	{
+		if (!console)
+			return;
+		delete console->mapper;
+		delete console;
+	}
+
+	int nes_load_rom(nes* console, const void* data, size_t size)
+	{
+		{
+			Active active(*console);
+			Mapper* mapper = Cartridge::create((const uint8_t*)data, size); // Wires this console's nametables
+			if (!mapper)
+				return -1;
+			delete console->mapper;
+			console->mapper = mapper;
+		}
+		nes_power(console);
+		return 0;
+	}
+
+	/*
+	* Power cycle: chips back to their power-on state, cartridge RAM kept.
+	*/
+	void nes_power(nes* console)
+	{
+		if (!console->mapper)
+			return;
+
+		uint8_t pages[4]; // Wired by the cartridge, not the PPU
+		memcpy(pages, console->ppu.nametablePage, sizeof(pages));
+		memset(&console->ppu, 0, sizeof(console->ppu));
+		memcpy(console->ppu.nametablePage, pages, sizeof(pages));
+		memset(&console->apu, 0, sizeof(console->apu));
+		memset(&console->controller, 0, sizeof(console->controller));
+
+		Active active(*console);
+		CPU::power();
+	}
+
+	void nes_set_buttons(nes* console, int port, uint8_t buttons)
+	{
+		if (port == 0 || port == 1)
+			console->buttons[port] = buttons;
+	}
+
+	void nes_set_render(nes* console, int enabled)
+	{
+		console->render = enabled != 0;
+	}
+
+	void nes_run_frame(nes* console)
+	{
+		if (!console->mapper)
+			return;
+
+		Active active(*console);
+		Console::runFrame();
+	}
+
+	uint32_t nes_frame_count(const nes* console)
+	{
+		return console->ppu.frame;
+	}
+
+	const uint8_t* nes_get_framebuffer(const nes* console)
+	{
+		return console->framebuffer;
+	}
+
+	uint8_t nes_get_mask(const nes* console)
+	{
+		return console->ppu.registers[1];
+	}
+
+	void nes_get_rgba(const nes* console, void* pixels, int pitch)
+	{
+		Palette::convert(console->framebuffer, pixels, pitch, console->ppu.registers[1]);
+	}
+
+	uint8_t* nes_get_ram(nes* console)
+	{
+		return console->cpu.ram;
+	}
+
+	const int16_t* nes_get_audio(const nes* console, size_t* count)
+	{
+		(void)console;
+		if (count)
+			*count = 0;
+		return nullptr;
+	}
+
+	/*
+	* Layout: magic, the chip states as they are in memory, then the mapper's.
+	*/
+	size_t nes_state_size(const nes* console)
+	{
+		if (!console->mapper)
+			return 0;
+		return sizeof(stateMagic) + sizeof(console->cpu) + sizeof(console->ppu) + sizeof(console->apu)
+			+ sizeof(console->controller) + console->mapper->state_size();
+	}
+
+	int nes_save_state(nes* console, void* buffer, size_t size)
+	{
+		if (!console->mapper || size < nes_state_size(console))
+			return -1;
+
+		uint8_t* out = (uint8_t*)buffer;
+		memcpy(out, &stateMagic, sizeof(stateMagic)); out += sizeof(stateMagic);
+		memcpy(out, &console->cpu, sizeof(console->cpu)); out += sizeof(console->cpu);
+		memcpy(out, &console->ppu, sizeof(console->ppu)); out += sizeof(console->ppu);
+		memcpy(out, &console->apu, sizeof(console->apu)); out += sizeof(console->apu);
+		memcpy(out, &console->controller, sizeof(console->controller)); out += sizeof(console->controller);
+		console->mapper->save(out);
+		return 0;
+	}
+
+	int nes_load_state(nes* console, const void* buffer, size_t size)
+	{
+		uint32_t magic;
+		if (!console->mapper || size < nes_state_size(console))
+			return -1;
+		memcpy(&magic, buffer, sizeof(magic));
+		if (magic != stateMagic)
+			return -1;
+
+		const uint8_t* in = (const uint8_t*)buffer + sizeof(stateMagic);
+		memcpy(&console->cpu, in, sizeof(console->cpu)); in += sizeof(console->cpu);
+		memcpy(&console->ppu, in, sizeof(console->ppu)); in += sizeof(console->ppu);
+		memcpy(&console->apu, in, sizeof(console->apu)); in += sizeof(console->apu);
+		memcpy(&console->controller, in, sizeof(console->controller)); in += sizeof(console->controller);
+
+		Active active(*console); // Mapper registers can rewire the PPU's nametables.
+		console->mapper->load(in);
+		return 0;
+	}
+}
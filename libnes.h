@@ -0,0 +1,79 @@
+#ifndef LIBNES_H
+#define LIBNES_H
+
+/*
+* C interface to the emulator core, for embedding it in other programs. Built
+* as the nes (shared) and nes_static libraries, which need nothing beyond the
+* C++ standard library.
+*
+* Each nes handle is one console that owns all of its state, so any number can
+* exist at once. Calls on different handles may run on different threads at
+* the same time; calls on one handle must not overlap. Stepping allocates and
+* copies nothing: the console runs on its own memory, and the framebuffer and
+* RAM pointers stay valid until nes_destroy().
+*
+* The ABI only grows: new functions may be added, existing ones keep their
+* signatures. NES_ABI_VERSION changes when they do not.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32) && defined(NES_SHARED)
+#ifdef NES_BUILDING
+#define NES_API __declspec(dllexport)
+#else
+#define NES_API __declspec(dllimport)
+#endif
+#elif defined(NES_BUILDING) && defined(__GNUC__)
+#define NES_API __attribute__((visibility("default")))
+#else
+#define NES_API
+#endif
+
+#define NES_ABI_VERSION 1
+#define NES_WIDTH 256
+#define NES_HEIGHT 240
+
+typedef struct nes nes;
+
+NES_API uint32_t nes_abi_version(void);
+
+NES_API nes* nes_create(void);
+NES_API void nes_destroy(nes* console);
+
+/* Load an iNES image from memory (copied) and power on. Returns 0, or -1 if the image or its mapper is unsupported. */
+NES_API int nes_load_rom(nes* console, const void* data, size_t size);
+NES_API void nes_power(nes* console);
+
+/* Buttons held on port 0 or 1 from the next frame on, bit 0 = A ... bit 7 = Right. */
+NES_API void nes_set_buttons(nes* console, int port, uint8_t buttons);
+/* Whether frames are composed; off skips the picture but not sprite 0 or anything else the game sees. */
+NES_API void nes_set_render(nes* console, int enabled);
+NES_API void nes_run_frame(nes* console);
+NES_API uint32_t nes_frame_count(const nes* console);
+
+/* NES_WIDTH x NES_HEIGHT palette indices 0-63, and the $2001 mask that goes with them for colour emphasis. */
+NES_API const uint8_t* nes_get_framebuffer(const nes* console);
+NES_API uint8_t nes_get_mask(const nes* console);
+/* The last frame as 32-bit RGBA pixels (R in the highest byte), pitch bytes per row. */
+NES_API void nes_get_rgba(const nes* console, void* pixels, int pitch);
+/* 2KB of work RAM, writable. */
+NES_API uint8_t* nes_get_ram(nes* console);
+/* Signed 16-bit mono samples produced by the last frame. The APU does not synthesise audio yet, so this is always NULL and 0. */
+NES_API const int16_t* nes_get_audio(const nes* console, size_t* count);
+
+/* Savestates in a caller-owned buffer of nes_state_size() bytes, only valid for the same build and ROM. Return 0 or -1. */
+NES_API size_t nes_state_size(const nes* console);
+NES_API int nes_save_state(nes* console, void* buffer, size_t size);
+NES_API int nes_load_state(nes* console, const void* buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
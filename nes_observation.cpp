@@ -0,0 +1,224 @@
+#include "ObservationRing.h"
+
+#include <chrono>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <climits>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+static_assert(sizeof(nes_obs_header) == 192, "nes_obs_header layout changed");
+static_assert(sizeof(nes_obs_slot) % 64 == 0, "nes_obs_slot must stay a whole number of cache lines");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) && sizeof(std::atomic<uint64_t>) == sizeof(uint64_t),
+	"Doorbells are accessed in place as atomics");
+
+namespace ObservationRing
+{
+	/*
+	* Wait until a doorbell no longer reads seen, or timeoutMs passes (never,
+	* if negative). Returns false on timeout.
+	*/
+	bool waitChange(uint32_t& field, uint32_t seen, int timeoutMs)
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+		while (word(field).load(std::memory_order_acquire) == seen)
+		{
+			std::chrono::steady_clock::duration left = deadline - std::chrono::steady_clock::now();
+			if (timeoutMs >= 0 && left <= std::chrono::steady_clock::duration::zero())
+				return false;
+#ifdef __linux__
+			// Not FUTEX_PRIVATE_FLAG: the word is shared with another process.
+			struct timespec timeout;
+			long long nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+			timeout.tv_sec = (time_t)(nanoseconds / 1000000000);
+			timeout.tv_nsec = (long)(nanoseconds % 1000000000);
+			syscall(SYS_futex, &field, FUTEX_WAIT, seen, timeoutMs < 0 ? nullptr : &timeout, nullptr, 0);
+#else
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+#endif
+		}
+		return true;
+	}
+
+	void ring(uint32_t& field, uint32_t value)
+	{
+		word(field).store(value, std::memory_order_release);
+#ifdef __linux__
+		syscall(SYS_futex, &field, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#endif
+	}
+
+	std::string objectName(const char* name)
+	{
+#ifdef _WIN32
+		return std::string("Local\\") + (name[0] == '/' ? name + 1 : name);
+#else
+		return name[0] == '/' ? std::string(name) : "/" + std::string(name);
+#endif
+	}
+
+	/*
+	* Create (size > 0) or open (size == 0) the shared-memory object.
+	*/
+	nes_obs* map(const char* name, size_t size)
+	{
+		nes_obs* obs = new nes_obs();
+		obs->name = objectName(name);
+		obs->owner = size > 0;
+		void* view = nullptr;
+
+#ifdef _WIN32
+		if (obs->owner)
+			obs->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, obs->name.c_str());
+		else
+			obs->mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, obs->name.c_str());
+		if (obs->mapping)
+			view = MapViewOfFile(obs->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+		if (view && !obs->owner)
+		{
+			MEMORY_BASIC_INFORMATION info;
+			VirtualQuery(view, &info, sizeof(info));
+			size = info.RegionSize;
+		}
+		if (!view && obs->mapping)
+			CloseHandle(obs->mapping);
+#else
+		int fd = obs->owner ? shm_open(obs->name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600) : shm_open(obs->name.c_str(), O_RDWR, 0);
+		if (fd >= 0)
+		{
+			struct stat info;
+			if (obs->owner ? ftruncate(fd, size) == 0 : (fstat(fd, &info) == 0 && (size = info.st_size) >= sizeof(nes_obs_header)))
+			{
+				view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+				if (view == MAP_FAILED)
+					view = nullptr;
+			}
+			::close(fd);
+			if (!view && obs->owner)
+				shm_unlink(obs->name.c_str());
+		}
+#endif
+
+		if (!view)
+		{
+			delete obs;
+			return nullptr;
+		}
+		obs->header = (nes_obs_header*)view;
+		obs->size = size;
+		return obs;
+	}
+
+	void unmap(nes_obs* obs)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(obs->header);
+		CloseHandle(obs->mapping);
+#else
+		munmap(obs->header, obs->size);
+		if (obs->owner)
+			shm_unlink(obs->name.c_str());
+#endif
+		delete obs;
+	}
+
+	nes_obs_slot* slot(const nes_obs* obs, uint64_t step)
+	{
+		const nes_obs_header* header = obs->header;
+		return (nes_obs_slot*)((uint8_t*)header + header->slot_offset + ((step - 1) % header->slot_count) * header->slot_size);
+	}
+
+	int command(nes_obs* obs, uint32_t command, uint32_t frames, uint8_t port1, uint8_t port2, int timeoutMs)
+	{
+		nes_obs_header* header = obs->header;
+		header->command = command;
+		header->frames = frames;
+		header->buttons[0] = port1;
+		header->buttons[1] = port2;
+
+		uint32_t request = header->request + 1;
+		ring(header->request, request);
+		uint32_t done = word(header->done).load(std::memory_order_acquire);
+		while (done != request)
+		{
+			if (!waitChange(header->done, done, timeoutMs))
+				return -1;
+			done = word(header->done).load(std::memory_order_acquire);
+		}
+		return 0;
+	}
+}
+
+using namespace ObservationRing;
+
+extern "C"
+{
+	/*
+	* Map a ring created by the emulator, or NULL if there is none by that name.
+	*/
+	nes_obs* nes_obs_open(const char* name)
+	{
+		nes_obs* obs = map(name, 0);
+		if (!obs)
+			return nullptr;
+
+		const nes_obs_header* header = obs->header;
+		if (obs->size < sizeof(nes_obs_header) || word(obs->header->magic).load(std::memory_order_acquire) != NES_OBS_MAGIC
+			|| header->version != NES_OBS_VERSION || header->slot_size != sizeof(nes_obs_slot)
+			|| header->slot_offset + (size_t)header->slot_count * header->slot_size > obs->size)
+		{
+			unmap(obs);
+			return nullptr;
+		}
+		return obs;
+	}
+
+	void nes_obs_close(nes_obs* obs)
+	{
+		if (obs)
+			unmap(obs);
+	}
+
+	const nes_obs_header* nes_obs_get_header(const nes_obs* obs)
+	{
+		return obs->header;
+	}
+
+	int nes_obs_step(nes_obs* obs, uint32_t frames, uint8_t port1, uint8_t port2, int timeout_ms)
+	{
+		return command(obs, NES_OBS_STEP, frames, port1, port2, timeout_ms);
+	}
+
+	int nes_obs_reset(nes_obs* obs, int timeout_ms)
+	{
+		return command(obs, NES_OBS_RESET, 0, 0, 0, timeout_ms);
+	}
+
+	int nes_obs_quit(nes_obs* obs, int timeout_ms)
+	{
+		return command(obs, NES_OBS_QUIT, 0, 0, 0, timeout_ms);
+	}
+
+	const nes_obs_slot* nes_obs_slot_for(const nes_obs* obs, uint64_t step)
+	{
+		if (step == 0 || step > word(obs->header->steps).load(std::memory_order_acquire))
+			return nullptr;
+
+		nes_obs_slot* target = slot(obs, step);
+		return word(target->step).load(std::memory_order_acquire) == step ? target : nullptr;
+	}
+
+	const nes_obs_slot* nes_obs_latest(const nes_obs* obs)
+	{
+		return nes_obs_slot_for(obs, word(obs->header->steps).load(std::memory_order_acquire));
+	}
+}
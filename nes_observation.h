@@ -0,0 +1,95 @@
+#ifndef NES_OBSERVATION_H
+#define NES_OBSERVATION_H
+
+/*
+* Shared-memory observations for consumers in another process, such as a
+* training harness. The emulator (NESHeadless --serve NAME) creates a named
+* shared-memory object: a header followed by a ring of observation slots, each
+* holding the palette-index frame, the 2KB of work RAM and the step that filled
+* it. The consumer maps the same object and reads slots in place.
+*
+* Commands go through two doorbells in the header. The consumer fills in
+* command, frames and buttons, then bumps request. The emulator runs the
+* command, publishing one slot per frame, and sets done to that request once
+* it is finished. On Linux both doorbells are futexes, so neither side spins.
+* Elsewhere the waiting side polls.
+*
+* A slot is reused every slot_count steps. A consumer that falls that far
+* behind sees the slot's step change under it, so it reads step before and
+* after copying anything out. nes_obs_slot_for() does the first check.
+*
+* The functions below are in the nes_observation library, which needs nothing
+* from the emulator; nes_observe (NESObserve.c) is a small C consumer. The
+* layout is plain C with fixed-size fields, so it can also be mapped directly,
+* e.g. with Python's mmap and numpy, at the offsets in the header.
+*/
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NES_OBS_MAGIC 0x53424F4Eu /* "NOBS" */
+#define NES_OBS_VERSION 1
+#define NES_OBS_WIDTH 256
+#define NES_OBS_HEIGHT 240
+
+typedef enum {
+	NES_OBS_STEP = 1, /* Run frames frames with buttons held */
+	NES_OBS_RESET = 2, /* Back to the state the emulator started serving from */
+	NES_OBS_QUIT = 3 /* Stop serving and remove the shared-memory object */
+} nes_obs_command_e;
+
+typedef struct {
+	uint64_t step; /* Step that filled the slot, from 1; written last */
+	uint32_t frame; /* PPU frame counter */
+	uint8_t mask; /* $2001 at the end of the frame, for colour emphasis */
+	uint8_t reserved[51];
+	uint8_t ram[0x800];
+	uint8_t framebuffer[NES_OBS_WIDTH * NES_OBS_HEIGHT]; /* Palette indices 0-63 */
+} nes_obs_slot;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_count;
+	uint32_t slot_size;
+	uint32_t slot_offset; /* From the start of the mapping */
+	uint32_t reserved0[11];
+
+	/* Written by the consumer */
+	uint32_t request; /* Doorbell: bumped once per command */
+	uint32_t command; /* nes_obs_command_e */
+	uint32_t frames;
+	uint8_t buttons[2]; /* Ports 1 and 2, bit 0 = A ... bit 7 = Right */
+	uint8_t reserved1[50];
+
+	/* Written by the emulator */
+	uint32_t done; /* Doorbell: the last request finished */
+	uint32_t reserved2;
+	uint64_t steps; /* Slots published so far; the newest is slot (steps - 1) % slot_count */
+	uint8_t reserved3[48];
+} nes_obs_header;
+
+typedef struct nes_obs nes_obs;
+
+/* Consumer side. Names are as given to --serve, with or without the leading '/'. */
+nes_obs* nes_obs_open(const char* name);
+void nes_obs_close(nes_obs* obs);
+const nes_obs_header* nes_obs_get_header(const nes_obs* obs);
+
+/* Send a command and wait up to timeout_ms (negative waits forever). Returns 0 once done, -1 on timeout. */
+int nes_obs_step(nes_obs* obs, uint32_t frames, uint8_t port1, uint8_t port2, int timeout_ms);
+int nes_obs_reset(nes_obs* obs, int timeout_ms);
+int nes_obs_quit(nes_obs* obs, int timeout_ms);
+
+/* The slot for a step, or NULL if it has not been published or was already reused. */
+const nes_obs_slot* nes_obs_slot_for(const nes_obs* obs, uint64_t step);
+const nes_obs_slot* nes_obs_latest(const nes_obs* obs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif